@@ -0,0 +1,45 @@
+// RFC 4648 base32 decoding.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "base32.h"
+
+int base32_decode(const char *line, uint8_t *out, int max) {
+  uint32_t buffer = 0;
+  int bits = 0, length = 0;
+  for (; *line && *line != '\n'; ++line) {
+    char c = *line;
+    int value;
+    if (c >= 'A' && c <= 'Z') {
+      value = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      value = c - 'a';
+    } else if (c >= '2' && c <= '7') {
+      value = c - '2' + 26;
+    } else if (c == ' ' || c == '=' || c == '\r') {
+      continue;
+    } else {
+      return 0;
+    }
+    buffer = buffer << 5 | value;
+    bits += 5;
+    if (bits >= 8) {
+      if (length == max) {
+        return 0;
+      }
+      bits -= 8;
+      out[length++] = buffer >> bits;
+    }
+  }
+  return length;
+}
@@ -0,0 +1,25 @@
+// RFC 4648 base32, as otpauth:// secrets are written, for the host tools.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BASE32_H__
+#define BASE32_H__
+
+#include <stdint.h>
+
+// Decodes line, up to its NUL or newline, into out. Case, spaces and padding
+// are ignored. Returns the decoded length, or 0 if line has anything else or
+// decodes to more than max bytes.
+int base32_decode(const char *line, uint8_t *out, int max);
+
+#endif
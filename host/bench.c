@@ -0,0 +1,541 @@
+// Benchmarks for the code generation core, built against include/pebble.h.
+//
+// Before timing anything the RFC 4226 and RFC 6238 test vectors are checked,
+// so a kernel change that breaks the output can't produce a flattering number.
+// Run with -c to only check the vectors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+
+#include "generate.h"
+#include "generate_batch.h"
+#include "harness.h"
+#include "hmac.h"
+#include "sha1.h"
+#include "sha1_mb.h"
+#include "sha256.h"
+#include "sha512.h"
+#include "verify.h"
+
+// sha1.c built again without the hardware path, with and without -DUNRAVEL;
+// see the Makefile.
+void sha1_compress_portable(uint32_t digest[5], const uint32_t block[16]);
+void sha1_compress_unravel(uint32_t digest[5], const uint32_t block[16]);
+
+// Peak stack used by fn(ctx, 0), found by painting the stack below us with a
+// pattern and seeing how much of it fn overwrites. stack_paint() and
+// stack_scan() have the same frame, so their arrays cover the same bytes.
+#define STACK_PROBE 8192
+#define STACK_PAINT 0xA5
+
+static __attribute__((noinline)) void stack_paint(void) {
+  uint8_t probe[STACK_PROBE];
+  memset(probe, STACK_PAINT, sizeof(probe));
+  __asm__ volatile("" : : "r"(probe) : "memory");
+}
+
+static __attribute__((noinline)) int stack_scan(void) {
+  uint8_t probe[STACK_PROBE];
+  __asm__ volatile("" : : "r"(probe) : "memory"); // Whatever fn left there.
+  int untouched = 0;
+  while (untouched < STACK_PROBE && probe[untouched] == STACK_PAINT) {
+    untouched++;
+  }
+  return STACK_PROBE - untouched;
+}
+
+static int stack_usage(BenchFn fn, void *ctx) {
+  stack_paint();
+  fn(ctx, 0);
+  return stack_scan();
+}
+
+typedef void (*CompressFn)(uint32_t digest[5], const uint32_t block[16]);
+
+typedef struct {
+  CompressFn compress;
+  uint32_t digest[5];
+  uint32_t block[16];
+} CompressCtx;
+
+static void bench_compress(void *p, unsigned long i) {
+  CompressCtx *ctx = p;
+  ctx->block[0] = i;
+  ctx->compress(ctx->digest, ctx->block);
+}
+
+static void bench_sha256_compress(void *p, unsigned long i) {
+  uint32_t *state = p; // Digest followed by the block.
+  state[8] = i;
+  sha256_compress(state, state + 8);
+}
+
+static void bench_sha512_compress(void *p, unsigned long i) {
+  uint64_t *state = p;
+  state[8] = i;
+  sha512_compress(state, state + 8);
+}
+
+typedef struct {
+  HMACAlgorithm algorithm;
+  HMAC_KEY key;
+} AlgorithmCtx;
+
+static void bench_code_algorithm(void *p, unsigned long tm) {
+  AlgorithmCtx *ctx = p;
+  sink = generateCodeWithKey(ctx->algorithm, &ctx->key, tm, 6);
+}
+
+typedef struct {
+  uint8_t key[100];
+  int key_length;
+} HmacCtx;
+
+static void bench_hmac(void *p, unsigned long i) {
+  HmacCtx *ctx = p;
+  uint8_t message[8] = { 0, 0, 0, 0, i >> 24, i >> 16, i >> 8, i };
+  uint8_t hash[SHA1_DIGEST_LENGTH];
+  hmac_sha1(ctx->key, ctx->key_length, message, sizeof(message), hash, sizeof(hash));
+  sink = hash[0];
+}
+
+typedef struct {
+  const uint8_t *secret;
+  uint8_t secret_length;
+  HMAC_SHA1_KEY key;
+} CodeCtx;
+
+// Resume a SHA1 computation from a chaining value taken right after one full
+// 64 byte block has been absorbed.
+static void sha1_resume(SHA1_INFO *ctx, const uint32_t midstate[5]) {
+  sha1_init(ctx);
+  memcpy(ctx->digest, midstate, 5 * sizeof(uint32_t));
+  ctx->count_lo = 64 * 8;
+}
+
+// HMAC_SHA1 from prepared midstates through sha1_update()/sha1_final(), as
+// hmac.c did before hmac_sha1_counter(); only bench_code_generic() uses it.
+static void hmac_sha1_prepared(const HMAC_SHA1_KEY *hmac_key,
+                               const uint8_t *data, int dataLength,
+                               uint8_t *result, int resultLength) {
+  SHA1_INFO ctx;
+  uint8_t sha[SHA1_DIGEST_LENGTH];
+
+  // Compute inner digest
+  sha1_resume(&ctx, hmac_key->inner);
+  sha1_update(&ctx, data, dataLength);
+  sha1_final(&ctx, sha);
+
+  // Compute outer digest
+  sha1_resume(&ctx, hmac_key->outer);
+  sha1_update(&ctx, sha, SHA1_DIGEST_LENGTH);
+  sha1_final(&ctx, sha);
+
+  // Copy result to output buffer and truncate or pad as necessary
+  memset(result, 0, resultLength);
+  if (resultLength > SHA1_DIGEST_LENGTH) {
+    resultLength = SHA1_DIGEST_LENGTH;
+  }
+  memcpy(result, sha, resultLength);
+
+  memset(sha, 0, sizeof(sha));
+}
+
+// The path generateCode() took before the single-block fast path: the generic
+// HMAC through sha1_update()/sha1_final(), then byte-wise truncation.
+static void bench_code_generic(void *p, unsigned long tm) {
+  CodeCtx *ctx = p;
+  uint8_t challenge[8];
+  for (int i = 8; i--; tm >>= 8) {
+    challenge[i] = tm;
+  }
+  uint8_t hash[SHA1_DIGEST_LENGTH];
+  hmac_sha1_prepared(&ctx->key, challenge, 8, hash, SHA1_DIGEST_LENGTH);
+  int offset = hash[SHA1_DIGEST_LENGTH - 1] & 0xF;
+  unsigned int truncatedHash = 0;
+  for (int i = 0; i < 4; ++i) {
+    truncatedHash <<= 8;
+    truncatedHash  |= hash[offset + i];
+  }
+  sink = (truncatedHash & 0x7FFFFFFF) % (1000 * 1000);
+}
+
+static void bench_code_fast(void *p, unsigned long tm) {
+  CodeCtx *ctx = p;
+  sink = generateCodeFromKey(&ctx->key, tm);
+}
+
+static void bench_code(void *p, unsigned long tm) {
+  CodeCtx *ctx = p;
+  sink = generateCode(ctx->secret, ctx->secret_length, tm);
+}
+
+// RFC 4226 appendix D: HOTP values for counters 0-9.
+static const uint8_t rfc4226_secret[] = "12345678901234567890";
+static const int rfc4226_codes[] = {
+  755224, 287082, 359152, 969429, 338314, 254676, 287922, 162583, 399871, 520489
+};
+
+// RFC 6238 appendix B. Its seeds are the RFC 4226 secret repeated to the
+// hash's output size; its codes have eight digits.
+static const uint8_t rfc6238_sha256_secret[] = "12345678901234567890123456789012";
+static const uint8_t rfc6238_sha512_secret[] =
+  "1234567890123456789012345678901234567890123456789012345678901234";
+
+static const struct {
+  unsigned long time;
+  int sha1, sha256, sha512;
+} rfc6238[] = {
+  { 59, 94287082, 46119246, 90693936 },
+  { 1111111109, 7081804, 68084774, 25091201 },
+  { 1111111111, 14050471, 67062674, 99943326 },
+  { 1234567890, 89005924, 91819424, 93441116 },
+  { 2000000000, 69279037, 90698825, 38618901 },
+  { 20000000000UL, 65353130, 77737706, 47863826 },
+};
+
+static int check_code(const char *what, unsigned long tm, int code, int expected) {
+  if (code == expected) {
+    return 0;
+  }
+  fprintf(stderr, "FAIL %s at %lu: got %08d, expected %08d\n", what, tm, code, expected);
+  return 1;
+}
+
+static int check_vectors(void) {
+  int failures = 0;
+  HMAC_SHA1_KEY key;
+  hmac_sha1_prepare(&key, rfc4226_secret, 20);
+
+  for (unsigned long i = 0; i < sizeof(rfc4226_codes) / sizeof(*rfc4226_codes); ++i) {
+    failures += check_code("RFC 4226 generateCode", i, generateCode(rfc4226_secret, 20, i), rfc4226_codes[i]);
+    failures += check_code("RFC 4226 generateCodeFromKey", i, generateCodeFromKey(&key, i), rfc4226_codes[i]);
+  }
+  HMAC_KEY sha1_key, sha256_key, sha512_key;
+  hmac_prepare(HMAC_SHA1, &sha1_key, rfc4226_secret, 20);
+  hmac_prepare(HMAC_SHA256, &sha256_key, rfc6238_sha256_secret, 32);
+  hmac_prepare(HMAC_SHA512, &sha512_key, rfc6238_sha512_secret, 64);
+  for (unsigned long i = 0; i < sizeof(rfc6238) / sizeof(*rfc6238); ++i) {
+    unsigned long step = rfc6238[i].time / 30;
+    failures += check_code("RFC 6238 SHA1", rfc6238[i].time,
+                           generateCode(rfc4226_secret, 20, step),
+                           rfc6238[i].sha1 % VERIFICATION_CODE_MODULUS);
+    for (int digits = MIN_CODE_DIGITS; digits <= MAX_CODE_DIGITS; ++digits) {
+      int modulus = digits == 6 ? 1000000 : digits == 7 ? 10000000 : 100000000;
+      failures += check_code("RFC 6238 SHA1", rfc6238[i].time,
+                             generateCodeWithKey(HMAC_SHA1, &sha1_key, step, digits),
+                             rfc6238[i].sha1 % modulus);
+      failures += check_code("RFC 6238 SHA256", rfc6238[i].time,
+                             generateCodeWithKey(HMAC_SHA256, &sha256_key, step, digits),
+                             rfc6238[i].sha256 % modulus);
+      failures += check_code("RFC 6238 SHA512", rfc6238[i].time,
+                             generateCodeWithKey(HMAC_SHA512, &sha512_key, step, digits),
+                             rfc6238[i].sha512 % modulus);
+    }
+  }
+
+  // The reciprocals must hold up to the largest truncated hash, and the
+  // formatter must keep leading zeros.
+  char formatted[MAX_CODE_DIGITS + 1];
+  failures += check_code("reduceCode 6", 0x7FFFFFFF, reduceCode(0x7FFFFFFF, 6), 0x7FFFFFFF % 1000000);
+  failures += check_code("reduceCode 7", 0x7FFFFFFF, reduceCode(0x7FFFFFFF, 7), 0x7FFFFFFF % 10000000);
+  failures += check_code("reduceCode 8", 0x7FFFFFFF, reduceCode(0x7FFFFFFF, 8), 0x7FFFFFFF % 100000000);
+  formatCode(rfc6238[1].sha1, 8, formatted);
+  if (strcmp(formatted, "07081804")) {
+    fprintf(stderr, "FAIL formatCode: got %s, expected 07081804\n", formatted);
+    failures++;
+  }
+
+  // All builds of the compression function must agree.
+  uint32_t block[16], a[5] = { 1, 2, 3, 4, 5 }, b[5] = { 1, 2, 3, 4, 5 }, c[5] = { 1, 2, 3, 4, 5 };
+  for (int round = 0; round < 100; ++round) {
+    for (int i = 0; i < 16; ++i) {
+      block[i] = (round + i) * 0x9E3779B9;
+    }
+    sha1_compress(a, block);
+    sha1_compress_portable(b, block);
+    sha1_compress_unravel(c, block);
+  }
+  if (memcmp(a, b, sizeof(a)) || memcmp(a, c, sizeof(a))) {
+    fprintf(stderr, "FAIL sha1_compress builds disagree\n");
+    failures++;
+  }
+
+  // Every multi-buffer kernel must match the scalar code for keys of all
+  // lengths, and for a batch that doesn't fill its last vector.
+  enum { N = 37 };
+  uint8_t keys[N][100], lengths[N];
+  const uint8_t *key_ptrs[N];
+  HMAC_SHA1_KEY prepared[N];
+  uint32_t truncated[N];
+  for (int i = 0; i < N; ++i) {
+    lengths[i] = 1 + (i * 13) % 100;
+    for (int j = 0; j < lengths[i]; ++j) {
+      keys[i][j] = i * 31 + j;
+    }
+    key_ptrs[i] = keys[i];
+  }
+  for (int k = 0; sha1_mb_kernels[k]; ++k) {
+    const SHA1_MB_KERNEL *kernel = sha1_mb_kernels[k];
+    if (!kernel->supported()) {
+      continue;
+    }
+    hmac_sha1_prepare_batch(kernel, key_ptrs, lengths, N, prepared);
+    hmac_sha1_counter_batch(kernel, prepared, NULL, 1234567, N, truncated);
+    for (int i = 0; i < N; ++i) {
+      int expected = generateCode(keys[i], lengths[i], 1234567);
+      if ((int)(truncated[i] % VERIFICATION_CODE_MODULUS) != expected) {
+        fprintf(stderr, "FAIL %s kernel, key %d\n", kernel->name, i);
+        failures++;
+      }
+    }
+  }
+
+  printf("Test vectors: %s\n", failures ? "FAILED" : "ok");
+  return failures;
+}
+
+typedef struct {
+  const SHA1_MB_KERNEL *kernel;
+  size_t n;
+  HMAC_SHA1_KEY *keys;
+  uint32_t *truncated;
+} BatchCtx;
+
+static void bench_batch(void *p, unsigned long tm) {
+  BatchCtx *ctx = p;
+  hmac_sha1_counter_batch(ctx->kernel, ctx->keys, NULL, tm, ctx->n, ctx->truncated);
+  sink = ctx->truncated[0];
+}
+
+static void bench_batch_scalar_loop(void *p, unsigned long tm) {
+  BatchCtx *ctx = p;
+  // What refresh_all() does: one generateCodeFromKey() per token.
+  for (size_t i = 0; i < ctx->n; ++i) {
+    ctx->truncated[i] = generateCodeFromKey(&ctx->keys[i], tm);
+  }
+  sink = ctx->truncated[0];
+}
+
+static int check_offset(const char *what, int offset, int expected) {
+  if (offset == expected) {
+    return 0;
+  }
+  fprintf(stderr, "FAIL %s: got offset %d, expected %d\n", what, offset, expected);
+  return 1;
+}
+
+static int check_verify(void) {
+  int failures = 0;
+  VerifyParams params = { HMAC_SHA1, 8, 30, 1 };
+  // 94287082 is the code at 59 s, the second step.
+  failures += check_offset("verify current step", verifyCode(&params, rfc4226_secret, 20, "94287082", 59), 0);
+  failures += check_offset("verify step behind", verifyCode(&params, rfc4226_secret, 20, "94287082", 89), -1);
+  failures += check_offset("verify step ahead", verifyCode(&params, rfc4226_secret, 20, "94287082", 29), 1);
+  failures += check_offset("verify outside window", verifyCode(&params, rfc4226_secret, 20, "94287082", 119), VERIFY_NO_MATCH);
+  failures += check_offset("verify short code", verifyCode(&params, rfc4226_secret, 20, "9428708", 59), VERIFY_NO_MATCH);
+  failures += check_offset("verify long code", verifyCode(&params, rfc4226_secret, 20, "942870820", 59), VERIFY_NO_MATCH);
+  failures += check_offset("verify non-digit", verifyCode(&params, rfc4226_secret, 20, "9428708x", 59), VERIFY_NO_MATCH);
+  params.window = 3;
+  failures += check_offset("verify before the epoch", verifyCode(&params, rfc4226_secret, 20, "94287082", 0), 1);
+
+  // The batch must agree with one call per request, across algorithms,
+  // windows, offsets in and out of them, and wrong codes.
+  enum { N = 600 };
+  static HMAC_KEY keys[N];
+  static char codes[N][MAX_CODE_DIGITS + 1];
+  static VerifyRequest requests[N];
+  static int offsets[N];
+  const unsigned long tm = 1234567890;
+  for (int i = 0; i < N; ++i) {
+    uint8_t secret[20];
+    for (int j = 0; j < 20; ++j) {
+      secret[j] = i * 7 + j;
+    }
+    VerifyParams p = { i % 5 ? HMAC_SHA1 : (HMACAlgorithm)(1 + i % 2), MIN_CODE_DIGITS + i % 3, 30 << (i % 2), i % 4 };
+    hmac_prepare(p.algorithm, &keys[i], secret, sizeof(secret));
+    int offset = i % 9 - 4;
+    formatCode(generateCodeWithKey(p.algorithm, &keys[i], tm / p.period + offset, p.digits), p.digits, codes[i]);
+    if (i % 11 == 0) {
+      codes[i][0] = codes[i][0] == '9' ? '0' : codes[i][0] + 1;
+    }
+    requests[i] = (VerifyRequest){ p, &keys[i], codes[i] };
+  }
+  size_t matched = verifyCodes(requests, N, tm, offsets);
+  size_t expected_matches = 0;
+  for (int i = 0; i < N; ++i) {
+    int expected = verifyCodeWithKey(&requests[i].params, requests[i].key, requests[i].code, tm);
+    expected_matches += expected != VERIFY_NO_MATCH;
+    failures += check_offset("verifyCodes", offsets[i], expected);
+  }
+  if (matched != expected_matches || !matched || matched == N) {
+    fprintf(stderr, "FAIL verifyCodes matched %zu of %d, expected %zu\n", matched, N, expected_matches);
+    failures++;
+  }
+
+  printf("Verification: %s\n", failures ? "FAILED" : "ok");
+  return failures;
+}
+
+typedef struct {
+  VerifyParams params;
+  HMAC_KEY key;
+} VerifyCtx;
+
+// Checking a wrong code against a ±1 window, the worst case: three steps.
+static void bench_verify_generate(void *p, unsigned long tm) {
+  VerifyCtx *ctx = p;
+  int match = 0;
+  for (int offset = -ctx->params.window; offset <= ctx->params.window; ++offset) {
+    match |= generateCode(rfc4226_secret, 20, tm / 30 + offset) == 123456;
+  }
+  sink = match;
+}
+
+static void bench_verify(void *p, unsigned long tm) {
+  VerifyCtx *ctx = p;
+  sink = verifyCode(&ctx->params, rfc4226_secret, 20, "123456", tm);
+}
+
+static void bench_verify_key(void *p, unsigned long tm) {
+  VerifyCtx *ctx = p;
+  sink = verifyCodeWithKey(&ctx->params, &ctx->key, "123456", tm);
+}
+
+typedef struct {
+  size_t n;
+  VerifyRequest *requests;
+  int *offsets;
+} VerifyBatchCtx;
+
+static void bench_verify_loop(void *p, unsigned long tm) {
+  VerifyBatchCtx *ctx = p;
+  for (size_t i = 0; i < ctx->n; ++i) {
+    ctx->offsets[i] = verifyCodeWithKey(&ctx->requests[i].params, ctx->requests[i].key, ctx->requests[i].code, tm);
+  }
+  sink = ctx->offsets[0];
+}
+
+static void bench_verify_batch(void *p, unsigned long tm) {
+  VerifyBatchCtx *ctx = p;
+  sink = verifyCodes(ctx->requests, ctx->n, tm, ctx->offsets);
+}
+
+int main(int argc, char **argv) {
+  if (check_vectors() + check_verify()) {
+    return 1;
+  }
+  if (argc > 1 && !strcmp(argv[1], "-c")) {
+    return 0;
+  }
+
+  const unsigned long iterations = 1000000;
+  char name[64];
+
+  printf("Build: %s kernel, %s message schedule\n",
+#ifdef SHA1_NO_HW
+         "portable",
+#else
+         "dispatched",
+#endif
+#ifdef SHA1_LOW_FOOTPRINT
+         "rolling 16 word"
+#else
+         "80 word"
+#endif
+         );
+
+  CodeCtx stack_ctx = { rfc4226_secret, 20 };
+  hmac_sha1_prepare(&stack_ctx.key, stack_ctx.secret, stack_ctx.secret_length);
+  printf("Peak stack: generateCode %d bytes, generateCodeFromKey %d bytes\n",
+         stack_usage(bench_code, &stack_ctx), stack_usage(bench_code_fast, &stack_ctx));
+
+  CompressCtx compress = { sha1_compress };
+  bench_run("sha1_compress (dispatched)", bench_compress, &compress, iterations, 1);
+  compress.compress = sha1_compress_portable;
+  bench_run("sha1_compress (portable)", bench_compress, &compress, iterations, 1);
+  compress.compress = sha1_compress_unravel;
+  bench_run("sha1_compress (portable, UNRAVEL)", bench_compress, &compress, iterations, 1);
+
+  static const int key_lengths[] = { 10, 20, 32, 64, 100 };
+  for (int i = 0; i < 5; ++i) {
+    HmacCtx hmac = { .key_length = key_lengths[i] };
+    for (int j = 0; j < hmac.key_length; ++j) {
+      hmac.key[j] = j;
+    }
+    snprintf(name, sizeof(name), "hmac_sha1, %d byte key", hmac.key_length);
+    // Inner and outer key block, message block, outer digest block - plus two
+    // to hash a key longer than the block size down first.
+    bench_run(name, bench_hmac, &hmac, iterations, hmac.key_length > 64 ? 6 : 4);
+  }
+
+  CodeCtx ctx = { rfc4226_secret, 20 };
+  hmac_sha1_prepare(&ctx.key, ctx.secret, ctx.secret_length);
+  bench_run("generateCode", bench_code, &ctx, iterations, 4);
+  bench_run("code, generic sha1_update/sha1_final", bench_code_generic, &ctx, iterations, 2);
+  bench_run("generateCodeFromKey (single block)", bench_code_fast, &ctx, iterations, 2);
+
+  static uint32_t sha256_state[8 + 16];
+  bench_run("sha256_compress", bench_sha256_compress, sha256_state, iterations, 1);
+  static uint64_t sha512_state[8 + 16];
+  bench_run("sha512_compress", bench_sha512_compress, sha512_state, iterations, 1);
+
+  // The per-window cost of a token for each algorithm, midstates cached.
+  static const char *algorithm_names[] = { "SHA1", "SHA256", "SHA512" };
+  for (int a = HMAC_SHA1; a <= HMAC_SHA512; ++a) {
+    AlgorithmCtx alg = { a };
+    hmac_prepare(a, &alg.key, rfc6238_sha512_secret, 20);
+    snprintf(name, sizeof(name), "generateCodeWithKey, %s", algorithm_names[a]);
+    bench_run(name, bench_code_algorithm, &alg, iterations, 2);
+  }
+
+  // Batches of 1024 cached keys, per kernel; ns/op here is per batch.
+  enum { BATCH = 1024 };
+  static HMAC_SHA1_KEY batch_keys[BATCH];
+  static uint32_t batch_out[BATCH];
+  for (int i = 0; i < BATCH; ++i) {
+    uint8_t secret[20];
+    for (int j = 0; j < 20; ++j) {
+      secret[j] = i + j;
+    }
+    hmac_sha1_prepare(&batch_keys[i], secret, sizeof(secret));
+  }
+  BatchCtx batch = { NULL, BATCH, batch_keys, batch_out };
+  bench_run("1024 codes, generateCodeFromKey loop", bench_batch_scalar_loop, &batch, iterations / BATCH, 2 * BATCH);
+  for (int k = 0; sha1_mb_kernels[k]; ++k) {
+    batch.kernel = sha1_mb_kernels[k];
+    if (!batch.kernel->supported()) {
+      continue;
+    }
+    snprintf(name, sizeof(name), "1024 codes, batch %s", batch.kernel->name);
+    bench_run(name, bench_batch, &batch, iterations / BATCH, 2 * BATCH);
+  }
+
+  // Verifying a wrong six digit code over a ±1 window: three steps.
+  VerifyCtx verify = { { HMAC_SHA1, 6, 30, 1 } };
+  hmac_prepare(HMAC_SHA1, &verify.key, rfc4226_secret, 20);
+  bench_run("verify ±1, generateCode per step", bench_verify_generate, &verify, iterations, 12);
+  bench_run("verify ±1, verifyCode", bench_verify, &verify, iterations, 8);
+  bench_run("verify ±1, verifyCodeWithKey", bench_verify_key, &verify, iterations, 6);
+
+  static VerifyRequest verify_requests[BATCH];
+  static int verify_offsets[BATCH];
+  for (int i = 0; i < BATCH; ++i) {
+    verify_requests[i] = (VerifyRequest){ { HMAC_SHA1, 6, 30, 1 }, (const HMAC_KEY *)&batch_keys[i], "123456" };
+  }
+  VerifyBatchCtx verify_batch = { BATCH, verify_requests, verify_offsets };
+  bench_run("verify 1024 ±1, verifyCodeWithKey loop", bench_verify_loop, &verify_batch, iterations / BATCH, 6 * BATCH);
+  bench_run("verify 1024 ±1, verifyCodes", bench_verify_batch, &verify_batch, iterations / BATCH, 6 * BATCH);
+  return 0;
+}
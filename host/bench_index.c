@@ -0,0 +1,280 @@
+// Benchmarks for the sliding-window code index in code_index.c, against
+// verifying from the keystore's midstates, and for what rolling it forward
+// costs per record.
+//
+// Checks first that the index gives keystore_verify()'s answer for every
+// offset in and around the window, across rolls, resets and records it
+// doesn't cover, and while another thread rolls it. Run with -c to only run
+// those.
+//
+//   bench_index [-c] [-n records]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "code_index.h"
+#include "generate.h"
+#include "harness.h"
+#include "keystore.h"
+#include "verify.h"
+
+#define PERIOD 30
+
+static uint64_t random_state = 88172645463325252ull;
+
+static uint64_t next_random(void) {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 7;
+  random_state ^= random_state << 17;
+  return random_state;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A keystore of n random 20 byte secrets, in a file that's already unlinked.
+// With mixed set, one record in 16 is SHA-256 with 8 digits and one in 16
+// has a 60 s period, which the index leaves to keystore_verify().
+static int make_keystore(Keystore *keystore, size_t n, int mixed) {
+  char path[] = "/tmp/bench_index.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return -1;
+  }
+  close(fd);
+
+  KeystoreWriter writer;
+  int status = keystore_create(&writer, path, keystore_record_size(HMAC_SHA256));
+  for (size_t i = 0; i < n && !status; ++i) {
+    uint8_t secret[20];
+    for (int j = 0; j < 20; ++j) {
+      secret[j] = next_random();
+    }
+    KeystoreRecord record;
+    int kind = mixed ? i % 16 : 0;
+    keystore_record_init(&record, kind == 1 ? HMAC_SHA256 : HMAC_SHA1, kind == 1 ? 8 : 6,
+                         kind == 2 ? 2 * PERIOD : PERIOD, secret, sizeof(secret));
+    status = keystore_append(&writer, &record);
+  }
+  if (keystore_finish(&writer) || status || keystore_open(keystore, path, KEYSTORE_POPULATE)) {
+    perror(path);
+    unlink(path);
+    return -1;
+  }
+  unlink(path);
+  return 0;
+}
+
+// The code of user at step offset offset from tm's, or "000000" if there's
+// no such step.
+static void code_at(const Keystore *keystore, size_t user, unsigned long tm, int offset, char *out) {
+  const KeystoreRecord *record = keystore_record(keystore, user);
+  long t = (long)tm + (long)offset * (long)record->period;
+  if (t < 0) {
+    strcpy(out, "000000");
+    return;
+  }
+  int code;
+  keystore_codes(keystore, user, 1, t, &code);
+  formatCode(code, record->digits, out);
+}
+
+// Codes at every offset from -window - 2 to window + 2, and a wrong one, for
+// a sample of users, against keystore_verify().
+static int check_users(const CodeIndex *index, unsigned long tm, int samples) {
+  const Keystore *keystore = index->keystore;
+  int failures = 0;
+  for (int s = 0; s < samples; ++s) {
+    size_t user = next_random() % keystore->count;
+    for (int offset = -index->window - 2; offset <= index->window + 3; ++offset) {
+      char code[MAX_CODE_DIGITS + 1];
+      if (offset > index->window + 2) {
+        strcpy(code, "12345x");
+      } else {
+        code_at(keystore, user, tm, offset, code);
+      }
+      int expected = keystore_verify(keystore, user, index->window, code, tm);
+      int got = code_index_verify(index, user, code, tm);
+      if (got != expected) {
+        fprintf(stderr, "FAIL user %zu at %lu, code %s: index says %d, keystore %d\n", user, tm, code,
+                got, expected);
+        failures++;
+      }
+    }
+  }
+  return failures;
+}
+
+typedef struct {
+  CodeIndex *index;
+  _Atomic int done;
+  _Atomic unsigned long tm;
+  int failures;
+} RaceCtx;
+
+// Verifies users' codes at the roller's latest time while check_index()
+// rolls from under it.
+static void *race_reader(void *p) {
+  RaceCtx *ctx = p;
+  const Keystore *keystore = ctx->index->keystore;
+  while (!ctx->done) {
+    unsigned long tm = ctx->tm;
+    size_t user = next_random() % keystore->count;
+    char code[MAX_CODE_DIGITS + 1];
+    code_at(keystore, user, tm, (int)(next_random() % 3) - 1, code);
+    if (code_index_verify(ctx->index, user, code, tm) != keystore_verify(keystore, user, 1, code, tm)) {
+      ctx->failures++;
+    }
+  }
+  return NULL;
+}
+
+static int check_index(void) {
+  Keystore keystore;
+  if (make_keystore(&keystore, 3000, 1)) {
+    return 1;
+  }
+  int failures = 0;
+
+  for (int window = 0; window <= 2; ++window) {
+    CodeIndex index;
+    // From the epoch, where the window is cut short, on through rolls a step
+    // at a time and part way through steps.
+    code_index_init(&index, &keystore, PERIOD, window, 0);
+    for (unsigned long tm = 0; tm < 20 * PERIOD; tm += 7) {
+      code_index_roll(&index, tm);
+      failures += check_users(&index, tm, 20);
+    }
+    // Behind the clock, the index still answers right, from the keystore.
+    failures += check_users(&index, 100 * PERIOD, 50);
+    // And far enough behind, it starts over.
+    code_index_roll(&index, 100 * PERIOD);
+    failures += check_users(&index, 100 * PERIOD, 50);
+    code_index_free(&index);
+  }
+
+  // One thread rolling two steps at a time, another verifying.
+  CodeIndex index;
+  code_index_init(&index, &keystore, PERIOD, 1, 1000 * PERIOD);
+  RaceCtx race = { &index, 0, 1000 * PERIOD, 0 };
+  pthread_t reader;
+  pthread_create(&reader, NULL, race_reader, &race);
+  for (unsigned long step = 1000; step < 1200; step += 2) {
+    code_index_roll(&index, step * PERIOD);
+    race.tm = step * PERIOD;
+  }
+  race.done = 1;
+  pthread_join(reader, NULL);
+  if (race.failures) {
+    fprintf(stderr, "FAIL %d verifications differed while rolling\n", race.failures);
+    failures += race.failures;
+  }
+
+  // The background roller starts and stops cleanly, and is current.
+  unsigned long before = time(NULL);
+  if (code_index_start(&index)) {
+    fprintf(stderr, "FAIL the roller didn't start\n");
+    failures++;
+  }
+  usleep(20000);
+  code_index_stop(&index);
+  unsigned long now = time(NULL);
+  uint64_t end = atomic_load(&index.end);
+  if (end < before / PERIOD + 3 || end > now / PERIOD + 3) {
+    fprintf(stderr, "FAIL the roller left the index at step %llu\n", (unsigned long long)end);
+    failures++;
+  }
+  failures += check_users(&index, now, 50);
+  code_index_free(&index);
+
+  keystore_close(&keystore);
+  return failures;
+}
+
+typedef struct {
+  const CodeIndex *index;
+  unsigned long tm;
+  size_t users;
+} VerifyCtx;
+
+// A wrong code, the worst case: every step of the window is tried.
+static void bench_keystore_verify(void *p, unsigned long i) {
+  VerifyCtx *ctx = p;
+  sink += keystore_verify(ctx->index->keystore, next_random() % ctx->users, 1, "123456", ctx->tm);
+}
+
+static void bench_index_verify(void *p, unsigned long i) {
+  VerifyCtx *ctx = p;
+  sink += code_index_verify(ctx->index, next_random() % ctx->users, "123456", ctx->tm);
+}
+
+int main(int argc, char **argv) {
+  int failures = check_index();
+  printf("Code index: %s\n", failures ? "FAILED" : "ok");
+  if (failures) {
+    return 1;
+  }
+  size_t n = 1000000;
+  int opt;
+  while ((opt = getopt(argc, argv, "cn:")) != -1) {
+    if (opt == 'c') {
+      return 0;
+    }
+    n = strtoul(optarg, NULL, 10);
+  }
+
+  Keystore keystore;
+  if (!n || make_keystore(&keystore, n, 0)) {
+    return 1;
+  }
+  unsigned long tm = 1000 * PERIOD;
+  for (int window = 1; window <= 2; ++window) {
+    CodeIndex index;
+    double start = now_seconds();
+    if (code_index_init(&index, &keystore, PERIOD, window, tm)) {
+      fprintf(stderr, "bench_index: out of memory\n");
+      return 1;
+    }
+    double fill = now_seconds() - start;
+    // One step's roll, as the roller does it each period.
+    start = now_seconds();
+    code_index_roll(&index, tm + PERIOD);
+    double roll = now_seconds() - start;
+
+    printf("%zu records, window ±%d: %d steps, %d bytes per record, %.0f MB\n", n, window, index.slots,
+           index.slots * 4, n * index.slots * 4 / 1e6);
+    printf("  filling: %.0f ms; rolling a step: %.0f ms, %.0f ns per record, %.2f%% of a core\n",
+           fill * 1e3, roll * 1e3, roll / n * 1e9, roll / PERIOD * 100);
+
+    VerifyCtx ctx = { &index, tm + PERIOD, n };
+    char name[64];
+    snprintf(name, sizeof(name), "verify ±%d, keystore_verify", window);
+    bench_run(name, bench_keystore_verify, &ctx, 1000000, 0);
+    snprintf(name, sizeof(name), "verify ±%d, code_index_verify", window);
+    bench_run(name, bench_index_verify, &ctx, 1000000, 0);
+    code_index_free(&index);
+  }
+  keystore_close(&keystore);
+  return 0;
+}
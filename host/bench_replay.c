@@ -0,0 +1,312 @@
+// Benchmarks for the replay cache in replay_cache.c: throughput of a mixed
+// lookup and insert load from 1 to threads threads, all on a small set of hot
+// records, with one shard and with many.
+//
+// Checks first that the cache refuses a pair a second time until it expires,
+// reuses expired entries, refuses inserts when full rather than losing
+// entries, and, with threads racing to insert the same pairs, accepts each
+// exactly once. Run with -c to only run those.
+//
+//   bench_replay [-c] [-j threads] [-n operations per run]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "replay_cache.h"
+
+#define PERIOD      30
+#define WINDOW      1
+#define MAX_THREADS 256
+
+// The benchmark's hot records, and how many operations a simulated second
+// holds across all threads: each step sees every hot record a few times.
+// Threads move the shared clock on a tick of operations at a time.
+#define HOT_RECORDS    4096
+#define OPS_PER_SECOND 1000
+#define TICK           1024
+
+static uint64_t next_random(uint64_t *x) {
+  *x ^= *x << 13;
+  *x ^= *x >> 7;
+  *x ^= *x << 17;
+  return *x;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int expect(int ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "FAIL %s\n", what);
+  }
+  return !ok;
+}
+
+typedef struct {
+  ReplayCache *cache;
+  pthread_barrier_t *start;
+  size_t pairs, offset;
+  size_t fresh;
+} RaceCtx;
+
+// Every thread inserts the same pairs, each starting at a different point.
+static void *race_inserter(void *p) {
+  RaceCtx *ctx = p;
+  pthread_barrier_wait(ctx->start);
+  for (size_t i = 0; i < ctx->pairs; ++i) {
+    size_t pair = (i + ctx->offset) % ctx->pairs;
+    ctx->fresh += replay_cache_insert(ctx->cache, pair / 4, 1000 + pair % 4, 2000 * PERIOD, 0) ==
+                  REPLAY_FRESH;
+  }
+  return NULL;
+}
+
+typedef struct {
+  ReplayCache *cache;
+  size_t pairs;
+  _Atomic int done;
+  size_t missed;
+} MoveCtx;
+
+// Looks up pairs that stay recorded throughout, while check_cache() makes
+// inserts move them about.
+static void *move_reader(void *p) {
+  MoveCtx *ctx = p;
+  uint64_t seed = 2463534242ull;
+  while (!ctx->done) {
+    ctx->missed += !replay_cache_contains(ctx->cache, next_random(&seed) % ctx->pairs, 1, 0);
+  }
+  return NULL;
+}
+
+static int check_cache(void) {
+  ReplayCache cache;
+  int failures = 0;
+
+  // One pair, through its window and past it.
+  replay_cache_init(&cache, 1024, 4);
+  unsigned long tm = 1000 * PERIOD + 5;
+  uint64_t step = tm / PERIOD;
+  unsigned long expires = replay_expiry(step, PERIOD, WINDOW);
+  failures += expect(!replay_cache_contains(&cache, 7, step, tm), "an empty cache holds nothing");
+  failures += expect(replay_cache_insert(&cache, 7, step, expires, tm) == REPLAY_FRESH, "first use");
+  failures += expect(replay_cache_contains(&cache, 7, step, tm), "a recorded pair is found");
+  failures += expect(replay_cache_insert(&cache, 7, step, expires, tm + PERIOD) == REPLAY_USED,
+                     "a second use a step later is refused");
+  failures += expect(replay_cache_insert(&cache, 7, step + 1, expires + PERIOD, tm) == REPLAY_FRESH,
+                     "the next step is another pair");
+  failures += expect(replay_cache_insert(&cache, 8, step, expires, tm) == REPLAY_FRESH,
+                     "another record is another pair");
+  failures += expect(replay_cache_contains(&cache, 7, step, expires - 1), "live until it expires");
+  failures += expect(!replay_cache_contains(&cache, 7, step, expires), "gone once expired");
+  failures += expect(replay_cache_insert(&cache, 7, step, expires, expires) == REPLAY_FRESH,
+                     "an expired entry is reused");
+  replay_cache_free(&cache);
+
+  // Filled until it refuses: nothing recorded is lost, and every entry can be
+  // used once the ones in it expire.
+  replay_cache_init(&cache, 4096, 4);
+  size_t capacity = replay_cache_capacity(&cache), stored = 0;
+  uint64_t id = 0;
+  while (replay_cache_insert(&cache, id, 1, 100, 0) == REPLAY_FRESH) {
+    id++;
+  }
+  stored = id;
+  failures += expect(stored >= capacity * 3 / 4, "the cache takes at least 3/4 of its capacity");
+  int lost = 0;
+  for (id = 0; id < stored; ++id) {
+    lost += !replay_cache_contains(&cache, id, 1, 99);
+  }
+  failures += expect(!lost, "a full cache keeps what it accepted");
+  failures += expect(replay_cache_insert(&cache, 0, 1, 100, 99) == REPLAY_USED,
+                     "a full cache still refuses a replay");
+  size_t reused = 0;
+  for (id = 0; id < capacity; ++id) {
+    reused += replay_cache_insert(&cache, id, 2, 200, 100) == REPLAY_FRESH;
+  }
+  failures += expect(reused >= capacity * 3 / 4, "expired entries make room again");
+  printf("Replay cache: %zu entries, %zu (%.0f%%) filled before the first refusal\n", capacity, stored,
+         100.0 * stored / capacity);
+  replay_cache_free(&cache);
+
+  // Lookups never miss a pair while inserts move it between its buckets.
+  replay_cache_init(&cache, 16384, 1);
+  capacity = replay_cache_capacity(&cache);
+  MoveCtx mover = { &cache, capacity / 2, 0, 0 };
+  for (id = 0; id < mover.pairs; ++id) {
+    replay_cache_insert(&cache, id, 1, 100, 0);
+  }
+  pthread_t reader;
+  pthread_create(&reader, NULL, move_reader, &mover);
+  for (id = mover.pairs; replay_cache_insert(&cache, id, 1, 100, 0) == REPLAY_FRESH; ++id) {
+  }
+  mover.done = 1;
+  pthread_join(reader, NULL);
+  if (mover.missed) {
+    fprintf(stderr, "FAIL %zu lookups missed a pair being moved\n", mover.missed);
+    failures++;
+  }
+  replay_cache_free(&cache);
+
+  // Threads racing to insert the same pairs: each is accepted once.
+  enum { RACERS = 8, PAIRS = 20000 };
+  replay_cache_init(&cache, 2 * PAIRS, 16);
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, RACERS);
+  RaceCtx racers[RACERS];
+  pthread_t threads[RACERS];
+  for (int t = 0; t < RACERS; ++t) {
+    racers[t] = (RaceCtx){ &cache, &start, PAIRS, t * PAIRS / RACERS, 0 };
+    pthread_create(&threads[t], NULL, race_inserter, &racers[t]);
+  }
+  size_t fresh = 0;
+  for (int t = 0; t < RACERS; ++t) {
+    pthread_join(threads[t], NULL);
+    fresh += racers[t].fresh;
+  }
+  pthread_barrier_destroy(&start);
+  if (fresh != PAIRS) {
+    fprintf(stderr, "FAIL %zu of %d pairs accepted by racing threads\n", fresh, PAIRS);
+    failures++;
+  }
+  replay_cache_free(&cache);
+  return failures;
+}
+
+typedef struct {
+  ReplayCache *cache;
+  pthread_barrier_t *start;
+  _Atomic uint64_t *clock; // Operations begun, in ticks
+  int insert_percent;
+  size_t n;
+  uint64_t seed;
+  size_t found, refused;
+} LoadCtx;
+
+// Lookups and inserts of the current step of random hot records, on a clock
+// that all threads together move forward OPS_PER_SECOND operations a second.
+// Most inserts are of pairs already recorded, as from clients retrying.
+static void *run_load(void *p) {
+  LoadCtx *ctx = p;
+  pthread_barrier_wait(ctx->start);
+  unsigned long tm = 0;
+  for (size_t i = 0; i < ctx->n; ++i) {
+    if (i % TICK == 0) {
+      tm = 1000 * PERIOD + atomic_fetch_add(ctx->clock, TICK) / OPS_PER_SECOND;
+    }
+    uint64_t step = tm / PERIOD;
+    uint64_t r = next_random(&ctx->seed);
+    uint64_t id = r % HOT_RECORDS;
+    if ((int)(r >> 32) % 100 < ctx->insert_percent) {
+      ctx->refused +=
+          replay_cache_insert(ctx->cache, id, step, replay_expiry(step, PERIOD, WINDOW), tm) ==
+          REPLAY_FULL;
+    } else {
+      ctx->found += replay_cache_contains(ctx->cache, id, step, tm);
+    }
+  }
+  return NULL;
+}
+
+// Operations/s over n operations split across threads threads.
+static double load(unsigned shards, int threads, int insert_percent, size_t n) {
+  ReplayCache cache;
+  if (replay_cache_init(&cache, 8 * HOT_RECORDS, shards)) {
+    fprintf(stderr, "bench_replay: out of memory\n");
+    exit(1);
+  }
+  static LoadCtx ctx[MAX_THREADS];
+  static pthread_t workers[MAX_THREADS];
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, threads + 1);
+  _Atomic uint64_t clock = 0;
+  for (int t = 0; t < threads; ++t) {
+    ctx[t] = (LoadCtx){ &cache, &start, &clock, insert_percent, n / threads,
+                        0x9E3779B97F4A7C15ull * (t + 1), 0, 0 };
+    pthread_create(&workers[t], NULL, run_load, &ctx[t]);
+  }
+  pthread_barrier_wait(&start);
+  double begin = now_seconds();
+  size_t refused = 0;
+  for (int t = 0; t < threads; ++t) {
+    pthread_join(workers[t], NULL);
+    refused += ctx[t].refused;
+  }
+  double seconds = now_seconds() - begin;
+  pthread_barrier_destroy(&start);
+  replay_cache_free(&cache);
+  if (refused) {
+    fprintf(stderr, "bench_replay: %zu inserts refused for want of room\n", refused);
+  }
+  return n / threads * threads / seconds;
+}
+
+int main(int argc, char **argv) {
+  int failures = check_cache();
+  printf("Replay cache: %s\n", failures ? "FAILED" : "ok");
+  if (failures) {
+    return 1;
+  }
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cores > 0 ? (cores < MAX_THREADS ? cores : MAX_THREADS) : 1;
+  size_t n = 4000000;
+  int opt;
+  while ((opt = getopt(argc, argv, "cj:n:")) != -1) {
+    switch (opt) {
+      case 'c':
+        return 0;
+      case 'j':
+        threads = atoi(optarg);
+        break;
+      case 'n':
+        n = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr, "usage: bench_replay [-c] [-j threads] [-n operations]\n");
+        return 2;
+    }
+  }
+  if (threads < 1 || threads > MAX_THREADS || n < (size_t)threads) {
+    fprintf(stderr, "usage: bench_replay [-c] [-j threads] [-n operations]\n");
+    return 2;
+  }
+
+  // One shard has one lock for every insert; 64 per thread spread them out.
+  unsigned many = 64 * threads;
+  printf("%zu operations on %d hot records, millions of operations/s\n", n, HOT_RECORDS);
+  printf("threads  inserts   1 shard  %4u shards   scaling\n", many);
+  for (int insert_percent = 10; insert_percent <= 50; insert_percent += 40) {
+    double single = 0;
+    for (int t = 1; t <= threads; t = t < threads && 2 * t > threads ? threads : 2 * t) {
+      double one = load(1, t, insert_percent, n);
+      double sharded = load(many, t, insert_percent, n);
+      if (t == 1) {
+        single = sharded;
+      }
+      printf("%7d  %6d%%  %8.2f  %11.2f  %7.2fx\n", t, insert_percent, one / 1e6, sharded / 1e6,
+             sharded / single);
+    }
+  }
+  return 0;
+}
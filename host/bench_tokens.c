@@ -0,0 +1,879 @@
+// Benchmarks for the token table in src/tokens.c, against the linked list
+// pTOTP.c used before it, at a few hundred tokens, and for the token store in
+// src/store.c against the key-per-token layout before it.
+//
+// Checks that the table keeps every token intact and that the store round
+// trips, rejects corruption, migrates the old layout and replays its journal
+// run first. Run with -c to only run those.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+
+#include "harness.h"
+#include "sdk.h"
+#include "store.h"
+#include "tokens.h"
+
+// The linked list, as it was: display order is list order, every lookup
+// walks from the head, and each token is three allocations.
+typedef struct LegacyTokenInfo {
+  char name[MAX_NAME_LENGTH + 1];
+  short id;
+  uint8_t secret_length;
+  uint8_t* secret;
+  char code[7];
+  HMAC_KEY* hmac_key;
+} LegacyTokenInfo;
+
+typedef struct TokenListNode {
+  struct TokenListNode* next;
+  LegacyTokenInfo* key;
+} TokenListNode;
+
+static TokenListNode* token_list = NULL;
+
+static void list_add(LegacyTokenInfo* key) {
+  TokenListNode* node = malloc(sizeof(TokenListNode));
+  node->next = NULL;
+  node->key = key;
+  if (!token_list) {
+    token_list = node;
+  } else {
+    TokenListNode* tail = token_list;
+    while (tail->next != NULL) {
+      tail = tail->next;
+    }
+    tail->next = node;
+  }
+}
+
+static LegacyTokenInfo* list_by_index(int index) {
+  TokenListNode* node = token_list;
+  for (int i = 0; i < index; ++i) {
+    node = node->next;
+  }
+  return node->key;
+}
+
+static LegacyTokenInfo* list_by_id(short id) {
+  for (TokenListNode* node = token_list; node; node = node->next) {
+    if (node->key->id == id) {
+      return node->key;
+    }
+  }
+  return NULL;
+}
+
+static short list_length(void) {
+  short size = 0;
+  for (TokenListNode* node = token_list; node; node = node->next) {
+    size++;
+  }
+  return size;
+}
+
+static void list_clear(void) {
+  while (token_list) {
+    TokenListNode* temp = token_list;
+    token_list = temp->next;
+    free(temp->key->secret);
+    free(temp->key->hmac_key);
+    free(temp->key);
+    free(temp);
+  }
+}
+
+static void list_reorder(const uint8_t* ids, int count) {
+  TokenListNode* newList = NULL;
+  TokenListNode* last = NULL;
+  for (int i = 0; i < count; ++i) {
+    TokenListNode* node = malloc(sizeof(TokenListNode));
+    if (last) {
+      last->next = node;
+    } else {
+      newList = node;
+    }
+    node->next = NULL;
+    node->key = list_by_id(ids[i]);
+    last = node;
+  }
+  while (token_list) {
+    last = token_list;
+    token_list = last->next;
+    free(last);
+  }
+  token_list = newList;
+}
+
+// Tokens as pTOTP.c builds them, minus the HMAC: the benchmark is about the
+// container, not the hashing. Settings and secret vary with the ID, and the
+// secret is the ID repeated, so check_token() can tell what they should be.
+static TokenInfo* add_token(short id) {
+  TokenInfo info = {
+    .id = id,
+    .secret_length = 10 + id % 30,
+    .algorithm = id % 3,
+    .digits = MIN_CODE_DIGITS + id % 3,
+    .period = 15 << (id % 3)
+  };
+  char name[MAX_NAME_LENGTH + 1];
+  snprintf(name, sizeof(name), "token %d", id);
+  TokenInfo* key = token_list_add(&info, name);
+  memset(token_secret(key), id, key->secret_length);
+  return key;
+}
+
+static int check_token(const TokenInfo* key, const char* name, const char* what) {
+  uint8_t secret[40];
+  memset(secret, key->id, sizeof(secret));
+  if (token_by_id(key->id) != key || strcmp(token_name(key), name) ||
+      key->secret_length != 10 + key->id % 30 || memcmp(token_secret(key), secret, key->secret_length) ||
+      key->algorithm != key->id % 3 || key->digits != MIN_CODE_DIGITS + key->id % 3 ||
+      key->period != 15 << (key->id % 3)) {
+    fprintf(stderr, "FAIL %s: token %d corrupted\n", what, key->id);
+    return 1;
+  }
+  return 0;
+}
+
+// The layout before the packed store, as pTOTP.c wrote it.
+#define P_TOKENS_COUNT    2
+#define P_TOKENS_START    10000
+#define P_SECRETS_START   20000
+
+typedef struct LegacyTokenRecord {
+  char name[MAX_NAME_LENGTH + 1];
+  short id;
+  uint8_t secret_length;
+  uint32_t unused;
+} LegacyTokenRecord;
+
+static void legacy_save(void) {
+  persist_write_int(P_TOKENS_COUNT, token_list_length());
+  for (short idx = 0; idx < token_list_length(); ++idx) {
+    TokenInfo* key = token_by_list_index(idx);
+    LegacyTokenRecord stored = {
+      .id = key->id,
+      .secret_length = key->secret_length
+    };
+    strncpy(stored.name, token_name(key), MAX_NAME_LENGTH);
+    persist_write_data(P_TOKENS_START + idx, &stored, sizeof(stored));
+  }
+  for (short idx = 0; idx < token_list_length(); ++idx) {
+    TokenInfo* key = token_by_list_index(idx);
+    persist_write_data(P_SECRETS_START + key->id, token_secret(key), key->secret_length);
+  }
+}
+
+static void make_legacy_token(LegacyTokenInfo* key, short id) {
+  memset(key, 0, sizeof(*key));
+  snprintf(key->name, sizeof(key->name), "token %d", id);
+  key->id = id;
+  key->secret_length = 20;
+  key->secret = calloc(1, key->secret_length);
+  key->hmac_key = calloc(1, hmac_key_size(HMAC_SHA1));
+}
+
+typedef struct {
+  int n;
+  uint8_t order[2][MAX_TOKENS]; // Reversed, and forwards again
+} TableCtx;
+
+static void fill_table(int n) {
+  for (short id = 0; id < n; ++id) {
+    add_token(id);
+  }
+}
+
+static void fill_list(int n) {
+  for (short id = 0; id < n; ++id) {
+    LegacyTokenInfo* key = malloc(sizeof(LegacyTokenInfo));
+    make_legacy_token(key, id);
+    list_add(key);
+  }
+}
+
+// What a pass over the list in display order costs, e.g. refresh_all() or
+// sending the list to the phone; drawing the rows on screen did the same.
+static void bench_table_rows(void *p, unsigned long i) {
+  uint32_t sum = 0;
+  for (short row = 0; row < token_list_length(); ++row) {
+    sum += token_by_list_index(row)->id;
+  }
+  sink = sum;
+}
+
+static void bench_list_rows(void *p, unsigned long i) {
+  uint32_t sum = 0;
+  for (short row = 0; row < list_length(); ++row) {
+    sum += list_by_index(row)->id;
+  }
+  sink = sum;
+}
+
+static void bench_table_ids(void *p, unsigned long i) {
+  TableCtx *ctx = p;
+  uint32_t sum = 0;
+  for (short id = 0; id < ctx->n; ++id) {
+    sum += token_by_id(id)->secret_length;
+  }
+  sink = sum;
+}
+
+static void bench_list_ids(void *p, unsigned long i) {
+  TableCtx *ctx = p;
+  uint32_t sum = 0;
+  for (short id = 0; id < ctx->n; ++id) {
+    sum += list_by_id(id)->secret_length;
+  }
+  sink = sum;
+}
+
+static void bench_table_reorder(void *p, unsigned long i) {
+  TableCtx *ctx = p;
+  token_list_reorder(ctx->order[i & 1], ctx->n);
+  sink = token_by_list_index(0)->id;
+}
+
+static void bench_list_reorder(void *p, unsigned long i) {
+  TableCtx *ctx = p;
+  list_reorder(ctx->order[i & 1], ctx->n);
+  sink = list_by_index(0)->id;
+}
+
+// Deleting a token from the middle and creating it again, as the phone does
+// when a token is replaced.
+static void bench_table_churn(void *p, unsigned long i) {
+  TableCtx *ctx = p;
+  short id = i % ctx->n;
+  token_list_delete(id);
+  add_token(id);
+}
+
+static void bench_list_churn(void *p, unsigned long i) {
+  TableCtx *ctx = p;
+  short id = i % ctx->n;
+  TokenListNode* node = token_list;
+  TokenListNode* last = NULL;
+  while (node->key->id != id) {
+    last = node;
+    node = node->next;
+  }
+  if (last) {
+    last->next = node->next;
+  } else {
+    token_list = node->next;
+  }
+  free(node->key->secret);
+  free(node->key->hmac_key);
+  free(node->key);
+  free(node);
+  LegacyTokenInfo* key = malloc(sizeof(LegacyTokenInfo));
+  make_legacy_token(key, id);
+  list_add(key);
+}
+
+static void bench_table_load(void *p, unsigned long i) {
+  TableCtx *ctx = p;
+  fill_table(ctx->n);
+  token_list_clear();
+}
+
+static void bench_list_load(void *p, unsigned long i) {
+  TableCtx *ctx = p;
+  fill_list(ctx->n);
+  list_clear();
+}
+
+// A step's worth of refresh_all() at 80 tokens: every code, as it generated
+// them before, or only the window pTOTP.c keeps current - three rows on
+// screen and one either side looked ahead.
+#define CODES_TOKENS 80
+#define CODES_WINDOW 5
+
+static void bench_codes_all(void *p, unsigned long i) {
+  unsigned long base_step = 4 * i; // A new step for every period
+  for (short row = 0; row < CODES_TOKENS; ++row) {
+    sink += token_code(token_by_list_index(row), base_step)[0];
+  }
+}
+
+static void bench_codes_window(void *p, unsigned long i) {
+  unsigned long base_step = 4 * i;
+  for (short row = 0; row < CODES_WINDOW; ++row) {
+    TokenInfo* key = token_by_list_index(row);
+    token_lookahead(key, base_step); // Spread over the ticks in between on the watch
+    if (row > 0 && row < CODES_WINDOW - 1) {
+      sink += token_code(key, base_step)[0];
+    }
+  }
+}
+
+static int check_codes(void) {
+  // Cached, looked ahead, skipped over or neither, the code is the step's.
+  static const unsigned long base_steps[] = { 0, 0, 1, 2, 3, 3, 4, 8, 9, 100, 99, 101, 105, 106, 400 };
+  int failures = 0;
+  fill_table(30);
+  for (short row = 0; row < 30; ++row) {
+    TokenInfo* key = token_by_list_index(row);
+    token_prepare_key(key);
+    for (int i = 0; i < 15; ++i) {
+      if (i % 3 == 1) {
+        token_lookahead(key, base_steps[i]);
+      }
+      char expected[MAX_CODE_DIGITS + 1];
+      unsigned long step = base_steps[i] >> (key->period / 30);
+      formatCode(generateCodeWithKey(key->algorithm, token_hmac_key(key), step, key->digits), key->digits, expected);
+      if (strcmp(token_code(key, base_steps[i]), expected)) {
+        fprintf(stderr, "FAIL token %d at base step %lu\n", key->id, base_steps[i]);
+        failures++;
+      }
+    }
+  }
+  token_list_clear();
+  return failures;
+}
+
+static int check_table(void) {
+  // Deleting, renaming and replacing has to keep every token's data intact
+  // as the arena compacts around it.
+  int failures = 0;
+  fill_table(MAX_TOKENS);
+  for (short id = 0; id < MAX_TOKENS; id += 3) {
+    token_list_delete(id);
+  }
+  for (short id = 1; id < MAX_TOKENS; id += 3) {
+    key_list_is_dirty = false;
+    token_set_name(id, "a considerably longer token name");
+    if (!key_list_is_dirty) {
+      fprintf(stderr, "FAIL renaming token %d didn't mark the list dirty\n", id);
+      failures++;
+    }
+  }
+  for (short id = 0; id < MAX_TOKENS; id += 6) {
+    add_token(id);
+  }
+  for (short row = 0; row < token_list_length(); ++row) {
+    TokenInfo* key = token_by_list_index(row);
+    char name[MAX_NAME_LENGTH + 1];
+    snprintf(name, sizeof(name), key->id % 3 == 1 ? "a considerably longer token name" : "token %d", key->id);
+    failures += check_token(key, name, "table");
+  }
+  token_list_clear();
+  return failures;
+}
+
+// Tokens with the longest name and secret, from ID 0 until the table
+// refuses one; returns how many it took.
+static int fill_long_tokens(void) {
+  char name[MAX_NAME_LENGTH + 1];
+  short id = 0;
+  for (; id < MAX_TOKENS; ++id) {
+    TokenInfo info = { .id = id, .secret_length = 255, .digits = DEFAULT_DIGITS, .period = DEFAULT_PERIOD };
+    snprintf(name, sizeof(name), "%-*d", MAX_NAME_LENGTH, id);
+    TokenInfo* key = token_list_add(&info, name);
+    if (!key) {
+      break;
+    }
+    memset(token_secret(key), id, key->secret_length);
+  }
+  return id;
+}
+
+static int check_long_tokens(int n, const char* what) {
+  if (token_list_length() != n) {
+    fprintf(stderr, "FAIL %s: %d of %d tokens\n", what, token_list_length(), n);
+    return 1;
+  }
+  int failures = 0;
+  char name[MAX_NAME_LENGTH + 1];
+  uint8_t secret[255];
+  for (short row = 0; row < n; ++row) {
+    TokenInfo* key = token_by_list_index(row);
+    snprintf(name, sizeof(name), "%-*d", MAX_NAME_LENGTH, row);
+    memset(secret, row, sizeof(secret));
+    if (key->id != row || strcmp(token_name(key), name) || key->secret_length != sizeof(secret) ||
+        memcmp(token_secret(key), secret, sizeof(secret))) {
+      fprintf(stderr, "FAIL %s: token %d corrupted\n", what, row);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+// The arena's offsets are 16 bits: a full table of the longest tokens doesn't
+// fit, and the token that would overflow them is refused, not written past
+// the end.
+static int check_arena_limit(void) {
+  int n = fill_long_tokens();
+  int failures = check_long_tokens(n, "full arena");
+  size_t data = token_arena_used() - n * sizeof(TokenInfo);
+  if (n == MAX_TOKENS || data > UINT16_MAX) {
+    fprintf(stderr, "FAIL arena took %d long tokens, %zu bytes of data\n", n, data);
+    failures++;
+  }
+  // Nor may a rename push it over.
+  token_set_name(0, "a considerably longer token name");
+  data = token_arena_used() - n * sizeof(TokenInfo);
+  if (data > UINT16_MAX) {
+    fprintf(stderr, "FAIL rename overflowed the arena: %zu bytes of data\n", data);
+    failures++;
+  }
+  token_list_clear();
+  return failures;
+}
+
+static int check_store_contents(int n, const char* what) {
+  if (token_list_length() != n) {
+    fprintf(stderr, "FAIL %s: %d of %d tokens\n", what, token_list_length(), n);
+    return 1;
+  }
+  int failures = 0;
+  char name[MAX_NAME_LENGTH + 1];
+  for (short row = 0; row < n; ++row) {
+    TokenInfo* key = token_by_list_index(row);
+    snprintf(name, sizeof(name), "token %d", key->id);
+    failures += key->id != n - 1 - row || check_token(key, name, what);
+  }
+  return failures;
+}
+
+// The old layout had no settings, so migrated tokens take the defaults; the
+// rest is as check_store_contents() expects.
+static int check_migrated(int n, const char* what) {
+  if (token_list_length() != n) {
+    fprintf(stderr, "FAIL %s: %d of %d tokens\n", what, token_list_length(), n);
+    return 1;
+  }
+  int failures = 0;
+  char name[MAX_NAME_LENGTH + 1];
+  uint8_t secret[40];
+  for (short row = 0; row < n; ++row) {
+    TokenInfo* key = token_by_list_index(row);
+    snprintf(name, sizeof(name), "token %d", key->id);
+    memset(secret, key->id, sizeof(secret));
+    if (key->id != n - 1 - row || strcmp(token_name(key), name) || key->secret_length != 10 + key->id % 30 ||
+        memcmp(token_secret(key), secret, key->secret_length) || key->algorithm != HMAC_SHA1 ||
+        key->digits != DEFAULT_DIGITS || key->period != DEFAULT_PERIOD) {
+      fprintf(stderr, "FAIL %s: token %d corrupted\n", what, key->id);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+// A full readback after loading sends every token, though none has a
+// generation; a delta readback sends only those stamped since.
+static int check_readback(int n, const char* what) {
+  int full = 0, delta = 0;
+  for (short row = 0; row < n; ++row) {
+    TokenInfo* key = token_by_list_index(row);
+    full += token_changed_since(key, 0);
+    delta += token_changed_since(key, 1);
+  }
+  if (full != n || delta) {
+    fprintf(stderr, "FAIL %s: readback sends %d of %d tokens, %d changed since 1\n", what, full, n, delta);
+    return 1;
+  }
+  if (n) {
+    token_by_list_index(n - 1)->generation = 2;
+    delta = 0;
+    for (short row = 0; row < n; ++row) {
+      delta += token_changed_since(token_by_list_index(row), 1);
+    }
+    token_by_list_index(n - 1)->generation = 0;
+    if (delta != 1) {
+      fprintf(stderr, "FAIL %s: %d tokens changed since 1, not 1\n", what, delta);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int check_store(void) {
+  int failures = 0;
+  static const int sizes[] = { 0, 1, 50, MAX_TOKENS };
+  for (int s = 0; s < 4; ++s) {
+    int n = sizes[s];
+    // Reversed, so the order has to survive too.
+    for (short id = n - 1; id >= 0; --id) {
+      add_token(id);
+    }
+    persist_clear();
+    store_save();
+    token_list_clear();
+    failures += !store_load() || check_store_contents(n, "store round trip");
+    failures += check_readback(n, "reloaded store");
+
+    // Saving what's already there writes nothing.
+    persist_reset_stats();
+    store_save();
+    if (persist_stats.writes) {
+      fprintf(stderr, "FAIL unchanged store rewrote %zu chunks\n", persist_stats.writes);
+      failures++;
+    }
+    token_list_clear();
+
+    // The old layout is read, saved again packed and deleted.
+    for (short id = n - 1; id >= 0; --id) {
+      add_token(id);
+    }
+    persist_clear();
+    legacy_save();
+    token_list_clear();
+    failures += !store_load() || check_migrated(n, "migration");
+    bool leftovers = persist_exists(P_TOKENS_COUNT);
+    for (int i = 0; i < 256; ++i) {
+      leftovers |= persist_exists(P_TOKENS_START + i) || persist_exists(P_SECRETS_START + i);
+    }
+    if (leftovers) {
+      fprintf(stderr, "FAIL migration left old keys behind\n");
+      failures++;
+    }
+    token_list_clear();
+    failures += !store_load() || check_migrated(n, "migrated store");
+    token_list_clear();
+  }
+
+  // A flipped bit anywhere is caught, and leaves the table empty.
+  fill_table(50);
+  persist_clear();
+  store_save();
+  token_list_clear();
+  for (int chunk = 0; persist_exists(P_STORE_START + chunk); ++chunk) {
+    uint8_t data[PERSIST_DATA_MAX_LENGTH];
+    int length = persist_read_data(P_STORE_START + chunk, data, sizeof(data));
+    for (int byte = 0; byte < length; byte += 7) {
+      data[byte] ^= 0x10;
+      persist_write_data(P_STORE_START + chunk, data, length);
+      if (store_load() || token_list_length()) {
+        fprintf(stderr, "FAIL corrupt byte %d of chunk %d loaded\n", byte, chunk);
+        failures++;
+      }
+      token_list_clear();
+      data[byte] ^= 0x10;
+      persist_write_data(P_STORE_START + chunk, data, length);
+    }
+  }
+  failures += !store_load() || token_list_length() != 50;
+  token_list_clear();
+  persist_clear();
+  return failures;
+}
+
+// The whole store, chunks joined; returns its length.
+static int read_store(uint8_t* data, int size) {
+  int length = 0;
+  for (int chunk = 0; persist_exists(P_STORE_START + chunk) && length < size; ++chunk) {
+    length += persist_read_data(P_STORE_START + chunk, data + length, size - length);
+  }
+  return length;
+}
+
+// A full table of the longest tokens round trips.
+static int check_store_length(void) {
+  int n = fill_long_tokens();
+  persist_clear();
+  store_save();
+  token_list_clear();
+  int failures = !store_load() || check_long_tokens(n, "store of long tokens");
+  token_list_clear();
+  persist_clear();
+  return failures;
+}
+
+// The table as display order and names, the rest following from the ID.
+typedef struct {
+  int n;
+  uint8_t ids[MAX_TOKENS];
+  char names[MAX_TOKENS][MAX_NAME_LENGTH + 1];
+} TableSnapshot;
+
+static void snapshot_table(TableSnapshot* snapshot) {
+  snapshot->n = token_list_length();
+  for (short row = 0; row < snapshot->n; ++row) {
+    TokenInfo* key = token_by_list_index(row);
+    snapshot->ids[row] = key->id;
+    strcpy(snapshot->names[row], token_name(key));
+  }
+}
+
+static int check_snapshot(const TableSnapshot* snapshot, const char* what) {
+  if (token_list_length() != snapshot->n) {
+    fprintf(stderr, "FAIL %s: %d of %d tokens\n", what, token_list_length(), snapshot->n);
+    return 1;
+  }
+  int failures = 0;
+  for (short row = 0; row < snapshot->n; ++row) {
+    TokenInfo* key = token_by_list_index(row);
+    failures += key->id != snapshot->ids[row] || check_token(key, snapshot->names[row], what);
+  }
+  return failures;
+}
+
+static unsigned int journal_random(void) {
+  static unsigned int state = 12345;
+  state = state * 1103515245 + 12345;
+  return state >> 16;
+}
+
+static bool has_run(const uint8_t* data, int length, uint8_t byte, int run) {
+  int count = 0;
+  for (int i = 0; i < length && count < run; ++i) {
+    count = data[i] == byte ? count + 1 : 0;
+  }
+  return count == run;
+}
+
+// Whether the secret add_token() gives id is anywhere in the store or the
+// journal.
+static bool secret_persisted(short id) {
+  static uint8_t data[MAX_TOKENS * (4 + MAX_NAME_LENGTH + 40) + 16];
+  int run = 10 + id % 30;
+  if (has_run(data, read_store(data, sizeof(data)), id, run)) {
+    return true;
+  }
+  for (int chunk = 0; persist_exists(P_JOURNAL_START + chunk); ++chunk) {
+    if (has_run(data, persist_read_data(P_JOURNAL_START + chunk, data, sizeof(data)), id, run)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int check_journal(void) {
+  int failures = 0;
+  TableSnapshot snapshot, previous;
+  fill_table(50);
+  persist_clear();
+  store_save();
+
+  // Random edits, flushed every few, must load back exactly as they were. The
+  // reorders of a full table don't fit in a chunk, and force compactions.
+  for (int op = 0; op < 5000; ++op) {
+    unsigned int r = journal_random() % 100;
+    short length = token_list_length();
+    if (r < 35) {
+      short id = journal_random() % MAX_TOKENS;
+      if (token_by_id(id) || length < MAX_TOKENS) {
+        add_token(id);
+        store_token_changed(id);
+      }
+    } else if (r < 55 && length) {
+      short id = token_by_list_index(journal_random() % length)->id;
+      token_list_delete(id);
+      store_token_changed(id);
+    } else if (r < 70 && length) {
+      char name[MAX_NAME_LENGTH + 1];
+      short id = token_by_list_index(journal_random() % length)->id;
+      snprintf(name, sizeof(name), "renamed %d", op);
+      token_set_name(id, name);
+      store_token_changed(id);
+    } else if (r < 80 && length) {
+      uint8_t ids[MAX_TOKENS];
+      for (short row = 0; row < length; ++row) {
+        ids[row] = token_by_list_index(row)->id;
+      }
+      for (short row = length - 1; row > 0; --row) {
+        short other = journal_random() % (row + 1);
+        uint8_t id = ids[row];
+        ids[row] = ids[other];
+        ids[other] = id;
+      }
+      token_list_reorder(ids, length);
+      store_order_changed();
+    } else if (r < 81) {
+      token_list_clear();
+      store_tokens_cleared();
+    } else if (r >= 90) {
+      store_flush();
+      snapshot_table(&snapshot);
+      token_list_clear();
+      store_load();
+      failures += check_snapshot(&snapshot, "journal replay");
+      // Deleted tokens' secrets go with them; ID 0's, all zeros, can't be told
+      // from other bytes.
+      for (short id = 1; id < MAX_TOKENS; ++id) {
+        if (!token_by_id(id) && secret_persisted(id)) {
+          fprintf(stderr, "FAIL deleted token %d's secret is still saved\n", id);
+          failures++;
+        }
+      }
+      if (persist_exists(P_JOURNAL_START + STORE_JOURNAL_MAX_CHUNKS)) {
+        fprintf(stderr, "FAIL journal wasn't compacted\n");
+        failures++;
+      }
+    }
+  }
+
+  // A torn chunk is dropped with everything after it, leaving the table as
+  // it was when the chunk before was written.
+  token_list_clear();
+  fill_table(50);
+  persist_clear();
+  store_save();
+  for (short id = 50; id < MAX_TOKENS && !failures; ++id) {
+    snapshot_table(&previous);
+    add_token(id);
+    store_token_changed(id);
+    store_flush();
+    if (persist_exists(P_JOURNAL_START + 1)) {
+      uint8_t data[PERSIST_DATA_MAX_LENGTH];
+      int length = persist_read_data(P_JOURNAL_START + 1, data, sizeof(data));
+      persist_write_data(P_JOURNAL_START + 1, data, length - 1);
+      token_list_clear();
+      store_load();
+      failures += check_snapshot(&previous, "torn journal");
+      if (persist_exists(P_JOURNAL_START + 1)) {
+        fprintf(stderr, "FAIL torn journal chunk kept\n");
+        failures++;
+      }
+      break;
+    }
+  }
+  token_list_clear();
+  persist_clear();
+  return failures;
+}
+
+// Persist traffic of saving and loading n tokens in each layout.
+static void bench_store(int n) {
+  fill_table(n);
+
+  persist_clear();
+  persist_reset_stats();
+  legacy_save();
+  PersistStats legacy_save_stats = persist_stats;
+  int legacy_keys = persist_key_count();
+
+  persist_clear();
+  persist_reset_stats();
+  store_save();
+  PersistStats save_stats = persist_stats;
+  int keys = persist_key_count();
+
+  // One renamed token rewrites its chunk and those after it.
+  token_set_name(n / 2, "renamed");
+  persist_reset_stats();
+  store_save();
+  PersistStats rename_stats = persist_stats;
+
+  // Through the journal instead, as pTOTP.c saves.
+  token_set_name(n / 2, "renamed again");
+  store_token_changed(n / 2);
+  persist_reset_stats();
+  store_flush();
+  PersistStats journal_rename_stats = persist_stats;
+  add_token(n);
+  store_token_changed(n);
+  persist_reset_stats();
+  store_flush();
+  PersistStats journal_create_stats = persist_stats;
+  store_save();
+
+  token_list_clear();
+  persist_reset_stats();
+  store_load();
+  PersistStats load_stats = persist_stats;
+  token_list_clear();
+
+  persist_clear();
+  fill_table(n);
+  legacy_save();
+  token_list_clear();
+  persist_reset_stats();
+  store_load(); // Includes saving it packed; only the reads are the old load.
+  PersistStats legacy_load_stats = persist_stats;
+  token_list_clear();
+  persist_clear();
+
+  printf("%3d tokens, key per token: %3d keys, save %3zu writes %6zu bytes, load %3zu reads %6zu bytes\n",
+         n, legacy_keys, legacy_save_stats.writes, legacy_save_stats.bytes_written,
+         legacy_load_stats.reads, legacy_load_stats.bytes_read);
+  printf("%3d tokens, packed store:  %3d keys, save %3zu writes %6zu bytes, load %3zu reads %6zu bytes, "
+         "rename rewrites %zu bytes\n",
+         n, keys, save_stats.writes, save_stats.bytes_written, load_stats.reads, load_stats.bytes_read,
+         rename_stats.bytes_written);
+  printf("%3d tokens, journaled:     rename writes %zu bytes, create writes %zu bytes\n",
+         n, journal_rename_stats.bytes_written, journal_create_stats.bytes_written);
+}
+
+int main(int argc, char **argv) {
+  int failures = check_table() + check_arena_limit() + check_codes() + check_store() + check_store_length() +
+                 check_journal();
+  printf("Token table and store: %s\n", failures ? "FAILED" : "ok");
+  if (failures) {
+    return 1;
+  }
+  if (argc > 1 && !strcmp(argv[1], "-c")) {
+    return 0;
+  }
+
+  static const int sizes[] = { 10, 50, 250 };
+  char name[64];
+
+  for (int s = 0; s < 3; ++s) {
+    TableCtx ctx = { sizes[s] };
+    // Alternating between the two, every token moves every time.
+    for (int i = 0; i < ctx.n; ++i) {
+      ctx.order[0][i] = ctx.n - 1 - i;
+      ctx.order[1][i] = i;
+    }
+    unsigned long iterations = 20000000 / (ctx.n * ctx.n) + 100;
+
+    fill_table(ctx.n);
+    fill_list(ctx.n);
+    if (list_length() != token_list_length()) {
+      fprintf(stderr, "FAIL table holds %d of %d tokens\n", token_list_length(), list_length());
+      return 1;
+    }
+    snprintf(name, sizeof(name), "%d rows, linked list", ctx.n);
+    bench_run(name, bench_list_rows, &ctx, iterations, 0);
+    snprintf(name, sizeof(name), "%d rows, table", ctx.n);
+    bench_run(name, bench_table_rows, &ctx, iterations, 0);
+    snprintf(name, sizeof(name), "%d lookups by ID, linked list", ctx.n);
+    bench_run(name, bench_list_ids, &ctx, iterations, 0);
+    snprintf(name, sizeof(name), "%d lookups by ID, table", ctx.n);
+    bench_run(name, bench_table_ids, &ctx, iterations, 0);
+    snprintf(name, sizeof(name), "reorder %d, linked list", ctx.n);
+    bench_run(name, bench_list_reorder, &ctx, iterations, 0);
+    snprintf(name, sizeof(name), "reorder %d, table", ctx.n);
+    bench_run(name, bench_table_reorder, &ctx, iterations, 0);
+    snprintf(name, sizeof(name), "delete and create of %d, linked list", ctx.n);
+    bench_run(name, bench_list_churn, &ctx, iterations / 10 + 10, 0);
+    snprintf(name, sizeof(name), "delete and create of %d, table", ctx.n);
+    bench_run(name, bench_table_churn, &ctx, iterations / 10 + 10, 0);
+    printf("arena for %d tokens: %zu bytes, %zu in use\n", ctx.n, token_arena_size(), token_arena_used());
+    list_clear();
+    token_list_clear();
+
+    snprintf(name, sizeof(name), "load %d, linked list", ctx.n);
+    bench_run(name, bench_list_load, &ctx, iterations / 10 + 10, 0);
+    snprintf(name, sizeof(name), "load %d, table", ctx.n);
+    bench_run(name, bench_table_load, &ctx, iterations / 10 + 10, 0);
+  }
+
+  fill_table(CODES_TOKENS);
+  for (short row = 0; row < CODES_TOKENS; ++row) {
+    token_prepare_key(token_by_list_index(row));
+  }
+  bench_run("codes for a step, all 80 tokens", bench_codes_all, NULL, 2000, 0);
+  bench_run("codes for a step, 5 row window", bench_codes_window, NULL, 2000, 0);
+  token_list_clear();
+
+  for (int s = 0; s < 3; ++s) {
+    bench_store(sizes[s]);
+  }
+  return 0;
+}
@@ -0,0 +1,184 @@
+// Sliding-window code index; see code_index.h.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "code_index.h"
+#include "generate.h"
+#include "verify.h"
+
+// Records per keystore_codes() call while rolling.
+#define ROLL_CHUNK 4096
+
+int code_index_init(CodeIndex *index, const Keystore *keystore, int period, int window,
+                    unsigned long tm) {
+  memset(index, 0, sizeof(*index));
+  index->keystore = keystore;
+  index->period = period;
+  index->window = window;
+  index->slots = 2 * window + 2;
+  index->codes = calloc(keystore->count ? keystore->count * index->slots : 1, sizeof(*index->codes));
+  if (!index->codes) {
+    return -1;
+  }
+  pthread_mutex_init(&index->lock, NULL);
+  pthread_cond_init(&index->wake, NULL);
+  code_index_roll(index, tm);
+  return 0;
+}
+
+void code_index_free(CodeIndex *index) {
+  code_index_stop(index);
+  pthread_mutex_destroy(&index->lock);
+  pthread_cond_destroy(&index->wake);
+  free(index->codes);
+  index->codes = NULL;
+}
+
+// Every record's code for step, into its slot.
+static void fill_step(CodeIndex *index, uint64_t step) {
+  const Keystore *keystore = index->keystore;
+  size_t slot = step % index->slots;
+  int codes[ROLL_CHUNK];
+  for (size_t first = 0; first < keystore->count; first += ROLL_CHUNK) {
+    size_t n = keystore->count - first < ROLL_CHUNK ? keystore->count - first : ROLL_CHUNK;
+    keystore_codes(keystore, first, n, step * index->period, codes);
+    _Atomic uint32_t *out = index->codes + first * index->slots + slot;
+    for (size_t i = 0; i < n; ++i, out += index->slots) {
+      const KeystoreRecord *record = keystore_record(keystore, first + i);
+      uint32_t value = CODE_INDEX_NONE;
+      if (record->period != (uint32_t)index->period) {
+        value = CODE_INDEX_ELSEWHERE;
+      } else if (codes[i] >= 0) {
+        value = codes[i] | (uint32_t)(record->digits - MIN_CODE_DIGITS) << CODE_INDEX_DIGITS_SHIFT;
+      }
+      atomic_store_explicit(out, value, memory_order_relaxed);
+    }
+  }
+}
+
+void code_index_roll(CodeIndex *index, unsigned long tm) {
+  uint64_t slots = index->slots;
+  uint64_t target = tm / index->period + index->window + 2;
+  uint64_t step = atomic_load_explicit(&index->end, memory_order_relaxed);
+  if (target <= step) {
+    return;
+  }
+  if (target - step > slots) {
+    // Too far behind to keep any of it: start over, empty.
+    step = target - slots;
+    atomic_store_explicit(&index->first, step, memory_order_relaxed);
+    atomic_store_explicit(&index->end, step, memory_order_release);
+  }
+
+  for (; step < target; ++step) {
+    if (step + 1 > slots) {
+      atomic_store_explicit(&index->first, step + 1 - slots, memory_order_relaxed);
+    }
+    // A reader that sees any code written below also sees first moved past
+    // the step it replaces; see code_index_verify().
+    atomic_thread_fence(memory_order_release);
+    fill_step(index, step);
+    atomic_store_explicit(&index->end, step + 1, memory_order_release);
+  }
+}
+
+static void *roller_main(void *p) {
+  CodeIndex *index = p;
+  pthread_mutex_lock(&index->lock);
+  while (!index->stopping) {
+    pthread_mutex_unlock(&index->lock);
+    code_index_roll(index, time(NULL));
+    pthread_mutex_lock(&index->lock);
+
+    // Until just after the next step starts, or code_index_stop().
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec = (deadline.tv_sec / index->period + 1) * index->period;
+    deadline.tv_nsec = 1000000;
+    while (!index->stopping && pthread_cond_timedwait(&index->wake, &index->lock, &deadline) != ETIMEDOUT) {
+    }
+  }
+  pthread_mutex_unlock(&index->lock);
+  return NULL;
+}
+
+int code_index_start(CodeIndex *index) {
+  if (index->running) {
+    return 0;
+  }
+  index->stopping = false;
+  int error = pthread_create(&index->thread, NULL, roller_main, index);
+  index->running = !error;
+  return error;
+}
+
+void code_index_stop(CodeIndex *index) {
+  if (!index->running) {
+    return;
+  }
+  pthread_mutex_lock(&index->lock);
+  index->stopping = true;
+  pthread_cond_signal(&index->wake);
+  pthread_mutex_unlock(&index->lock);
+  pthread_join(index->thread, NULL);
+  index->running = false;
+}
+
+int code_index_verify(const CodeIndex *index, size_t user, const char *code, unsigned long tm) {
+  const Keystore *keystore = index->keystore;
+  // A code of the wrong length for the record doesn't match its slots'
+  // digits, as keystore_verify() wouldn't parse it.
+  int digits = strnlen(code, MAX_CODE_DIGITS + 1);
+  long candidate = parseCode(code, digits);
+  if (user >= keystore->count || candidate < 0) {
+    return VERIFY_NO_MATCH;
+  }
+  uint32_t wanted = candidate | (uint32_t)(digits - MIN_CODE_DIGITS) << CODE_INDEX_DIGITS_SHIFT;
+
+  uint64_t step = tm / index->period;
+  uint64_t low = step >= (uint64_t)index->window ? step - index->window : 0;
+  uint64_t end = atomic_load_explicit(&index->end, memory_order_acquire);
+  if (low < atomic_load_explicit(&index->first, memory_order_acquire) || step + index->window >= end) {
+    return keystore_verify(keystore, user, index->window, code, tm);
+  }
+
+  // Nearest first, as verifyCodeWithKey() does.
+  const _Atomic uint32_t *row = index->codes + user * index->slots;
+  if (atomic_load_explicit(&row[step % index->slots], memory_order_relaxed) == CODE_INDEX_ELSEWHERE) {
+    return keystore_verify(keystore, user, index->window, code, tm);
+  }
+  int offset = VERIFY_NO_MATCH;
+  for (int n = 0; n <= 2 * index->window; ++n) {
+    int o = n & 1 ? -(n + 1) / 2 : n / 2;
+    if (o < 0 && step < (uint64_t)-o) {
+      continue;
+    }
+    if (atomic_load_explicit(&row[(step + o) % index->slots], memory_order_relaxed) == wanted) {
+      offset = o;
+      break;
+    }
+  }
+
+  // If a roll has since started replacing one of the steps read, what was
+  // read may be the replacement.
+  atomic_thread_fence(memory_order_acquire);
+  if (atomic_load_explicit(&index->first, memory_order_relaxed) > low) {
+    return keystore_verify(keystore, user, index->window, code, tm);
+  }
+  return offset;
+}
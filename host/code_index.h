@@ -0,0 +1,93 @@
+// Precomputed codes for every record of a keystore, over a sliding window of
+// steps, so verifying a code is a lookup rather than 2 * window + 1 HMACs.
+//
+// Each record has a ring of slots = 2 * window + 2 codes, one per step, in
+// one row: the steps either side of the current one that a verification
+// may need, plus the next step after those. Step s of record u is at
+// codes[u * slots + s % slots]. All records' rows hold the same steps,
+// [first, end), so one pair of counters covers the whole index. A code is
+// stored with its number of digits, so a lookup reads the row and nothing
+// else: not even the record.
+//
+// Rolling forward to the next step overwrites each record's oldest code with
+// the new step's: one code per record per period, all in the background. The
+// new step is a whole period ahead of when verifications first need it.
+//
+// Memory is 4 * slots bytes per record: 16 for a window of ±1, 24 for ±2.
+// Records whose period isn't the index's, and verifications the index doesn't
+// cover (a clock off by more than the lead, or a roll that's behind), fall
+// back to keystore_verify(). The index changes when, and how much, a request
+// costs, but never its answer.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CODE_INDEX_H__
+#define CODE_INDEX_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "keystore.h"
+
+// A slot is the code, with digits - MIN_CODE_DIGITS from bit 27 up; a code
+// that matches nothing, for a damaged record; or a mark that the record's
+// period isn't the index's.
+#define CODE_INDEX_DIGITS_SHIFT 27
+#define CODE_INDEX_NONE         0x7FFFFFFF
+#define CODE_INDEX_ELSEWHERE    0x80000000
+
+typedef struct {
+  const Keystore *keystore;
+  int period;
+  int window;
+  int slots;
+
+  // Steps [first, end) are in every row. A roll moves first past the slot it
+  // is about to overwrite before writing it, and end past it afterwards.
+  _Atomic uint64_t first, end;
+  _Atomic uint32_t *codes;
+
+  // The background roller.
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  bool running, stopping;
+} CodeIndex;
+
+// Allocates the index for keystore's records of period seconds, verified
+// within window steps, and fills it for tm. Returns 0, or -1 if the memory
+// can't be had.
+int code_index_init(CodeIndex *index, const Keystore *keystore, int period, int window,
+                    unsigned long tm);
+
+// Stops the roller if it's running and frees the codes.
+void code_index_free(CodeIndex *index);
+
+// Brings the index up to tm: computes every step up to tm's + window + 1 not
+// yet held, dropping the oldest. Only one thread may roll at a time; any
+// number may verify meanwhile.
+void code_index_roll(CodeIndex *index, unsigned long tm);
+
+// Rolls on a thread of its own, just after each step starts, from the wall
+// clock. Returns 0, or an error number from pthread_create().
+int code_index_start(CodeIndex *index);
+
+void code_index_stop(CodeIndex *index);
+
+// keystore_verify(index->keystore, user, index->window, code, tm), by lookup.
+int code_index_verify(const CodeIndex *index, size_t user, const char *code, unsigned long tm);
+
+#endif
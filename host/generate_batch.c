@@ -0,0 +1,187 @@
+// Batch code generation on top of the multi-buffer SHA1 kernels.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include "generate.h"
+#include "generate_batch.h"
+#include "sha1.h"
+
+// Index of the entry feeding lane l of the chunk starting at i. Lanes past the
+// end repeat the final entry so the kernel always sees full vectors.
+static inline size_t lane_source(size_t i, int lane, size_t n) {
+  return i + lane < n ? i + lane : n - 1;
+}
+
+static inline const HMAC_SHA1_KEY *key_at(const HMAC_SHA1_KEY *keys, size_t stride, size_t i) {
+  return (const HMAC_SHA1_KEY *)((const uint8_t *)keys + i * stride);
+}
+
+void hmac_sha1_prepare_batch(const SHA1_MB_KERNEL *kernel,
+                             const uint8_t *const keys[], const uint8_t lengths[],
+                             size_t n, HMAC_SHA1_KEY out[]) {
+  if (!kernel) {
+    kernel = sha1_mb_best();
+  }
+  const int L = kernel->lanes;
+  uint32_t key_words[16 * SHA1_MB_MAX_LANES];
+  uint32_t block[16 * SHA1_MB_MAX_LANES];
+  uint32_t inner[5 * SHA1_MB_MAX_LANES], outer[5 * SHA1_MB_MAX_LANES];
+
+  for (size_t i = 0; i < n; i += L) {
+    for (int l = 0; l < L; ++l) {
+      size_t src = lane_source(i, l, n);
+      const uint8_t *key = keys[src];
+      int length = lengths[src];
+      uint8_t padded[64], hashed_key[SHA1_DIGEST_LENGTH];
+      if (length > 64) {
+        // Rare enough not to be worth vectorizing.
+        SHA1_INFO ctx;
+        sha1_init(&ctx);
+        sha1_update(&ctx, key, length);
+        sha1_final(&ctx, hashed_key);
+        key = hashed_key;
+        length = SHA1_DIGEST_LENGTH;
+      }
+      memcpy(padded, key, length);
+      memset(padded + length, 0, 64 - length);
+      for (int w = 0; w < 16; ++w) {
+        key_words[w * L + l] = (uint32_t)padded[4 * w] << 24 | (uint32_t)padded[4 * w + 1] << 16 |
+                               (uint32_t)padded[4 * w + 2] << 8 | padded[4 * w + 3];
+      }
+      memset(padded, 0, sizeof(padded));
+      memset(hashed_key, 0, sizeof(hashed_key));
+    }
+
+    for (int w = 0; w < 5; ++w) {
+      for (int l = 0; l < L; ++l) {
+        inner[w * L + l] = outer[w * L + l] = sha1_initial_digest[w];
+      }
+    }
+    for (int j = 0; j < 16 * L; ++j) {
+      block[j] = key_words[j] ^ 0x36363636;
+    }
+    kernel->compress(inner, block);
+    for (int j = 0; j < 16 * L; ++j) {
+      block[j] = key_words[j] ^ 0x5C5C5C5C;
+    }
+    kernel->compress(outer, block);
+
+    for (int l = 0; l < L && i + l < n; ++l) {
+      for (int w = 0; w < 5; ++w) {
+        out[i + l].inner[w] = inner[w * L + l];
+        out[i + l].outer[w] = outer[w * L + l];
+      }
+    }
+  }
+
+  memset(key_words, 0, sizeof(key_words));
+  memset(block, 0, sizeof(block));
+}
+
+void hmac_sha1_counter_batch(const SHA1_MB_KERNEL *kernel,
+                             const HMAC_SHA1_KEY keys[],
+                             const uint64_t counters[], uint64_t counter,
+                             size_t n, uint32_t truncated[]) {
+  hmac_sha1_counter_batch_strided(kernel, keys, sizeof(HMAC_SHA1_KEY), counters, counter, n, truncated);
+}
+
+void hmac_sha1_counter_batch_strided(const SHA1_MB_KERNEL *kernel,
+                                     const HMAC_SHA1_KEY *keys, size_t stride,
+                                     const uint64_t counters[], uint64_t counter,
+                                     size_t n, uint32_t truncated[]) {
+  if (!kernel) {
+    kernel = sha1_mb_best();
+  }
+  const int L = kernel->lanes;
+  uint32_t block[16 * SHA1_MB_MAX_LANES];
+  uint32_t state[5 * SHA1_MB_MAX_LANES];
+
+  for (size_t i = 0; i < n; i += L) {
+    // Inner block: counter, terminator, zeros and the (64 + 8) * 8 bit length.
+    for (int l = 0; l < L; ++l) {
+      size_t src = lane_source(i, l, n);
+      uint64_t c = counters ? counters[src] : counter;
+      block[0 * L + l] = (uint32_t)(c >> 32);
+      block[1 * L + l] = (uint32_t)c;
+      block[2 * L + l] = 0x80000000;
+      block[15 * L + l] = (64 + 8) * 8;
+      for (int w = 0; w < 5; ++w) {
+        state[w * L + l] = key_at(keys, stride, src)->inner[w];
+      }
+    }
+    memset(block + 3 * L, 0, 12 * L * sizeof(uint32_t));
+    kernel->compress(state, block);
+
+    // Outer block: inner digest, terminator, zeros and (64 + 20) * 8.
+    memcpy(block, state, 5 * L * sizeof(uint32_t));
+    for (int l = 0; l < L; ++l) {
+      size_t src = lane_source(i, l, n);
+      block[5 * L + l] = 0x80000000;
+      block[15 * L + l] = (64 + SHA1_DIGEST_LENGTH) * 8;
+      for (int w = 0; w < 5; ++w) {
+        state[w * L + l] = key_at(keys, stride, src)->outer[w];
+      }
+    }
+    memset(block + 6 * L, 0, 9 * L * sizeof(uint32_t));
+    kernel->compress(state, block);
+
+    for (int l = 0; l < L && i + l < n; ++l) {
+      uint32_t hash[5];
+      for (int w = 0; w < 5; ++w) {
+        hash[w] = state[w * L + l];
+      }
+      truncated[i + l] = truncateHash(hash);
+    }
+  }
+
+  memset(block, 0, sizeof(block));
+  memset(state, 0, sizeof(state));
+}
+
+// Keys are prepared and hashed a bounded chunk at a time so the working set
+// stays in cache however large n is.
+#define BATCH_CHUNK 256
+
+void generateCodes(const uint8_t *const keys[], const uint8_t lengths[],
+                   size_t n, unsigned long tm, int out[]) {
+  const SHA1_MB_KERNEL *kernel = sha1_mb_best();
+  HMAC_SHA1_KEY prepared[BATCH_CHUNK];
+  uint32_t truncated[BATCH_CHUNK];
+
+  for (size_t i = 0; i < n; i += BATCH_CHUNK) {
+    size_t count = n - i < BATCH_CHUNK ? n - i : BATCH_CHUNK;
+    hmac_sha1_prepare_batch(kernel, keys + i, lengths + i, count, prepared);
+    hmac_sha1_counter_batch(kernel, prepared, NULL, tm, count, truncated);
+    for (size_t j = 0; j < count; ++j) {
+      out[i + j] = truncated[j] % VERIFICATION_CODE_MODULUS;
+    }
+  }
+
+  memset(prepared, 0, sizeof(prepared));
+}
+
+void generateCodesFromKeys(const HMAC_SHA1_KEY keys[], size_t n,
+                           unsigned long tm, int out[]) {
+  const SHA1_MB_KERNEL *kernel = sha1_mb_best();
+  uint32_t truncated[BATCH_CHUNK];
+
+  for (size_t i = 0; i < n; i += BATCH_CHUNK) {
+    size_t count = n - i < BATCH_CHUNK ? n - i : BATCH_CHUNK;
+    hmac_sha1_counter_batch(kernel, keys + i, NULL, tm, count, truncated);
+    for (size_t j = 0; j < count; ++j) {
+      out[i + j] = truncated[j] % VERIFICATION_CODE_MODULUS;
+    }
+  }
+}
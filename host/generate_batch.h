@@ -0,0 +1,53 @@
+// Batch code generation on top of the multi-buffer SHA1 kernels.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GENERATE_BATCH_H__
+#define GENERATE_BATCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hmac.h"
+#include "sha1_mb.h"
+
+// Each function takes the kernel to run; NULL picks sha1_mb_best().
+
+// hmac_sha1_prepare() for n keys at once.
+void hmac_sha1_prepare_batch(const SHA1_MB_KERNEL *kernel,
+                             const uint8_t *const keys[], const uint8_t lengths[],
+                             size_t n, HMAC_SHA1_KEY out[]);
+
+// truncateHash(HMAC_SHA1(keys[i], counters[i])) for n keys at once. If
+// counters is NULL every lane uses counter instead.
+void hmac_sha1_counter_batch(const SHA1_MB_KERNEL *kernel,
+                             const HMAC_SHA1_KEY keys[],
+                             const uint64_t counters[], uint64_t counter,
+                             size_t n, uint32_t truncated[]);
+
+// As hmac_sha1_counter_batch(), with key i stride bytes after key i - 1, so
+// keys can be read in place out of larger records.
+void hmac_sha1_counter_batch_strided(const SHA1_MB_KERNEL *kernel,
+                                     const HMAC_SHA1_KEY *keys, size_t stride,
+                                     const uint64_t counters[], uint64_t counter,
+                                     size_t n, uint32_t truncated[]);
+
+// out[i] = generateCode(keys[i], lengths[i], tm)
+void generateCodes(const uint8_t *const keys[], const uint8_t lengths[],
+                   size_t n, unsigned long tm, int out[]);
+
+// out[i] = generateCodeFromKey(&keys[i], tm)
+void generateCodesFromKeys(const HMAC_SHA1_KEY keys[], size_t n,
+                           unsigned long tm, int out[]);
+
+#endif
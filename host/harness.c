@@ -0,0 +1,56 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "harness.h"
+
+volatile uint32_t sink;
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t now_cycles(void) {
+#ifdef HAVE_RDTSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+void bench_run(const char *name, BenchFn fn, void *ctx, unsigned long iterations,
+               int compressions) {
+  for (unsigned long i = 0; i < iterations / 16; ++i) {
+    fn(ctx, i); // Warm up
+  }
+  double start = now_ns();
+  uint64_t start_cycles = now_cycles();
+  for (unsigned long i = 0; i < iterations; ++i) {
+    fn(ctx, i);
+  }
+  uint64_t cycles = now_cycles() - start_cycles;
+  double ns = now_ns() - start;
+  printf("%-40s %9.1f ns/op %9.1f cycles/op", name, ns / iterations, (double)cycles / iterations);
+  if (compressions) {
+    printf(" %7.2f M compressions/s", compressions * iterations / ns * 1e3);
+  }
+  printf("\n");
+}
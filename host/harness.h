@@ -0,0 +1,32 @@
+// Timing loop shared by the host benchmarks.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef HARNESS_H__
+#define HARNESS_H__
+
+#include <stdint.h>
+
+// Keeps results alive so the compiler can't drop the work being measured.
+extern volatile uint32_t sink;
+
+typedef void (*BenchFn)(void *ctx, unsigned long i);
+
+// Times iterations calls of fn(ctx, i) after a short warm up and prints
+// ns/op and cycles/op (x86 only, from the TSC). compressions is the number of
+// hash block compressions one call does, to report the kernel throughput
+// alongside; 0 leaves that column out.
+void bench_run(const char *name, BenchFn fn, void *ctx, unsigned long iterations,
+               int compressions);
+
+#endif
@@ -0,0 +1,4 @@
+// newlib (as shipped with the Pebble SDK) provides BYTE_ORDER through
+// <machine/endian.h>; glibc and friends provide it through <endian.h>.
+
+#include <endian.h>
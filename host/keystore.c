@@ -0,0 +1,302 @@
+// Memory-mapped keystore; see keystore.h for the format.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "generate.h"
+#include "generate_batch.h"
+#include "keystore.h"
+#include "store.h"
+#include "verify.h"
+
+#define KEYSTORE_CHUNK 256
+
+_Static_assert(sizeof(KeystoreHeader) == KEYSTORE_ALIGN, "the header is one cache line");
+_Static_assert(offsetof(KeystoreRecord, key) == 8, "keys start 8 bytes into a record");
+
+size_t keystore_record_size(HMACAlgorithm algorithm) {
+  size_t size = offsetof(KeystoreRecord, key) + hmac_key_size(algorithm);
+  return (size + KEYSTORE_ALIGN - 1) / KEYSTORE_ALIGN * KEYSTORE_ALIGN;
+}
+
+void keystore_record_init(KeystoreRecord *record, HMACAlgorithm algorithm, int digits, int period,
+                          const uint8_t *secret, int secret_length) {
+  memset(record, 0, sizeof(*record));
+  record->algorithm = algorithm;
+  record->digits = digits;
+  record->secret_length = secret_length < 255 ? secret_length : 255;
+  record->period = period;
+  hmac_prepare(algorithm, &record->key, secret, secret_length);
+}
+
+// Whether record can be used from a file of record_size records: a known
+// algorithm whose keys fit, and digits and period in range.
+static int record_valid(const KeystoreRecord *record, size_t record_size) {
+  return record->algorithm <= HMAC_SHA512 &&
+         keystore_record_size(record->algorithm) <= record_size &&
+         record->digits >= MIN_CODE_DIGITS && record->digits <= MAX_CODE_DIGITS &&
+         record->period > 0;
+}
+
+int keystore_create(KeystoreWriter *writer, const char *path, size_t record_size) {
+  memset(writer, 0, sizeof(*writer));
+  if (record_size < KEYSTORE_ALIGN || record_size > KEYSTORE_MAX_RECORD || record_size % KEYSTORE_ALIGN) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (!(writer->file = fopen(path, "wb"))) {
+    return -1;
+  }
+  writer->record_size = record_size;
+
+  // Zeros where the header goes, until keystore_finish().
+  KeystoreHeader blank;
+  memset(&blank, 0, sizeof(blank));
+  if (fwrite(&blank, sizeof(blank), 1, writer->file) != 1) {
+    int error = errno;
+    fclose(writer->file);
+    writer->file = NULL;
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+int keystore_append(KeystoreWriter *writer, const KeystoreRecord *record) {
+  if (!record_valid(record, writer->record_size)) {
+    errno = EINVAL;
+    return -1;
+  }
+  uint8_t buffer[KEYSTORE_MAX_RECORD];
+  size_t used = sizeof(*record) < writer->record_size ? sizeof(*record) : writer->record_size;
+  memset(buffer, 0, sizeof(buffer));
+  memcpy(buffer, record, used);
+  size_t written = fwrite(buffer, writer->record_size, 1, writer->file);
+  memset(buffer, 0, sizeof(buffer));
+  if (written != 1) {
+    return -1;
+  }
+  writer->count++;
+  return 0;
+}
+
+int keystore_finish(KeystoreWriter *writer) {
+  KeystoreHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, KEYSTORE_MAGIC, sizeof(header.magic));
+  header.version = KEYSTORE_VERSION;
+  header.byte_order = KEYSTORE_BYTE_ORDER;
+  header.record_size = writer->record_size;
+  header.count = writer->count;
+  header.crc = crc32_update(0, (const uint8_t *)&header, offsetof(KeystoreHeader, crc));
+
+  // The records reach the disk before the header that makes them valid.
+  int status = fflush(writer->file) || fsync(fileno(writer->file)) ||
+               fseek(writer->file, 0, SEEK_SET) ||
+               fwrite(&header, sizeof(header), 1, writer->file) != 1 ||
+               fflush(writer->file) || fsync(fileno(writer->file)) ? -1 : 0;
+  int error = errno;
+  if (fclose(writer->file) && !status) {
+    status = -1;
+    error = errno;
+  }
+  writer->file = NULL;
+  errno = error;
+  return status;
+}
+
+static int header_valid(const KeystoreHeader *header, size_t file_size) {
+  if (memcmp(header->magic, KEYSTORE_MAGIC, sizeof(header->magic)) ||
+      header->version != KEYSTORE_VERSION || header->byte_order != KEYSTORE_BYTE_ORDER ||
+      header->crc != crc32_update(0, (const uint8_t *)header, offsetof(KeystoreHeader, crc))) {
+    return 0;
+  }
+  size_t record_size = header->record_size;
+  if (record_size < KEYSTORE_ALIGN || record_size > KEYSTORE_MAX_RECORD || record_size % KEYSTORE_ALIGN) {
+    return 0;
+  }
+  size_t records = file_size - sizeof(*header);
+  return records % record_size == 0 && header->count == records / record_size;
+}
+
+int keystore_open(Keystore *keystore, const char *path, int flags) {
+  memset(keystore, 0, sizeof(*keystore));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(KeystoreHeader)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ,
+                   MAP_SHARED | (flags & KEYSTORE_POPULATE ? MAP_POPULATE : 0), fd, 0);
+  int error = errno;
+  close(fd); // The mapping keeps the file open.
+  if (map == MAP_FAILED) {
+    errno = error;
+    return -1;
+  }
+  const KeystoreHeader *header = map;
+  if (!header_valid(header, st.st_size)) {
+    munmap(map, st.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+  if (flags & KEYSTORE_RANDOM) {
+    madvise(map, st.st_size, MADV_RANDOM);
+  }
+
+  keystore->map = map;
+  keystore->map_size = st.st_size;
+  keystore->record_size = header->record_size;
+  keystore->count = header->count;
+  return 0;
+}
+
+void keystore_close(Keystore *keystore) {
+  if (keystore->map) {
+    munmap((void *)keystore->map, keystore->map_size);
+  }
+  memset(keystore, 0, sizeof(*keystore));
+}
+
+void keystore_codes(const Keystore *keystore, size_t first, size_t n, unsigned long tm, int out[]) {
+  const SHA1_MB_KERNEL *kernel = sha1_mb_best();
+  uint64_t counters[KEYSTORE_CHUNK];
+  uint32_t truncated[KEYSTORE_CHUNK];
+
+  size_t i = 0;
+  while (i < n) {
+    const KeystoreRecord *record = keystore_record(keystore, first + i);
+    if (!record_valid(record, keystore->record_size)) {
+      out[i++] = -1;
+      continue;
+    }
+    if (record->algorithm != HMAC_SHA1) {
+      out[i++] = generateCodeWithKey(record->algorithm, &record->key, tm / record->period, record->digits);
+      continue;
+    }
+
+    // The run of valid SHA1 records from here, in place.
+    size_t run = 0;
+    while (i + run < n && run < KEYSTORE_CHUNK) {
+      const KeystoreRecord *next = keystore_record(keystore, first + i + run);
+      if (next->algorithm != HMAC_SHA1 || !record_valid(next, keystore->record_size)) {
+        break;
+      }
+      counters[run++] = tm / next->period;
+    }
+    hmac_sha1_counter_batch_strided(kernel, &record->key.sha1, keystore->record_size,
+                                    counters, 0, run, truncated);
+    for (size_t j = 0; j < run; ++j) {
+      out[i + j] = reduceCode(truncated[j], keystore_record(keystore, first + i + j)->digits);
+    }
+    i += run;
+  }
+}
+
+int keystore_verify(const Keystore *keystore, size_t i, int window, const char *code,
+                    unsigned long tm) {
+  if (i >= keystore->count) {
+    return VERIFY_NO_MATCH;
+  }
+  const KeystoreRecord *record = keystore_record(keystore, i);
+  if (!record_valid(record, keystore->record_size)) {
+    return VERIFY_NO_MATCH;
+  }
+  VerifyParams params = { record->algorithm, record->digits, record->period, window };
+  return verifyCodeWithKey(&params, &record->key, code, tm);
+}
+
+// The SHA1 lanes gathered by keystore_codes_at().
+static void codes_at_flush(const Keystore *keystore, const size_t indices[], const HMAC_SHA1_KEY keys[],
+                           const uint64_t counters[], const size_t lanes[], size_t count, int out[]) {
+  uint32_t truncated[KEYSTORE_CHUNK];
+  hmac_sha1_counter_batch(NULL, keys, counters, 0, count, truncated);
+  for (size_t lane = 0; lane < count; ++lane) {
+    out[lanes[lane]] = reduceCode(truncated[lane], keystore_record(keystore, indices[lanes[lane]])->digits);
+  }
+}
+
+void keystore_codes_at(const Keystore *keystore, const size_t indices[], size_t n,
+                       unsigned long tm, int out[]) {
+  HMAC_SHA1_KEY keys[KEYSTORE_CHUNK];
+  uint64_t counters[KEYSTORE_CHUNK];
+  size_t lanes[KEYSTORE_CHUNK]; // Which of out each lane is for
+
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const KeystoreRecord *record = indices[i] < keystore->count ? keystore_record(keystore, indices[i]) : NULL;
+    if (!record || !record_valid(record, keystore->record_size)) {
+      out[i] = -1;
+    } else if (record->algorithm != HMAC_SHA1) {
+      out[i] = generateCodeWithKey(record->algorithm, &record->key, tm / record->period, record->digits);
+    } else {
+      keys[count] = record->key.sha1;
+      counters[count] = tm / record->period;
+      lanes[count++] = i;
+      if (count == KEYSTORE_CHUNK) {
+        codes_at_flush(keystore, indices, keys, counters, lanes, count, out);
+        count = 0;
+      }
+    }
+  }
+  if (count) {
+    codes_at_flush(keystore, indices, keys, counters, lanes, count, out);
+  }
+  memset(keys, 0, sizeof(keys));
+}
+
+void keystore_verify_at(const Keystore *keystore, const size_t indices[],
+                        const char *const codes[], size_t n, int window,
+                        unsigned long tm, int offsets[]) {
+  VerifyRequest requests[KEYSTORE_CHUNK];
+  int results[KEYSTORE_CHUNK];
+  size_t lanes[KEYSTORE_CHUNK];
+
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const KeystoreRecord *record = indices[i] < keystore->count ? keystore_record(keystore, indices[i]) : NULL;
+    offsets[i] = VERIFY_NO_MATCH;
+    if (record && record_valid(record, keystore->record_size)) {
+      requests[count] = (VerifyRequest){
+        { record->algorithm, record->digits, record->period, window }, &record->key, codes[i]
+      };
+      lanes[count++] = i;
+    }
+    if (count && (count == KEYSTORE_CHUNK || i == n - 1)) {
+      verifyCodes(requests, count, tm, results);
+      for (size_t j = 0; j < count; ++j) {
+        offsets[lanes[j]] = results[j];
+      }
+      count = 0;
+    }
+  }
+}
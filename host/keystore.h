@@ -0,0 +1,134 @@
+// A file of TOTP keys for the server side, in a binary format that's mapped
+// with mmap and used in place: no parsing or key blocks at startup.
+//
+// The file is a 64 byte header followed by count fixed-width records, each
+// record_size bytes, a multiple of the 64 byte cache line. A record holds a
+// key's algorithm, digits, period and secret length, and the midstates
+// hmac_prepare() derives from the secret, cut to the widest algorithm in the
+// file (64 bytes of record for SHA1, 128 for SHA-256, 192 for SHA-512). The
+// secret itself isn't kept. Numbers are in host byte order; a file written on
+// a host of the other byte order doesn't open.
+//
+// The midstates are as good as the secret to anyone who reads them: keep the
+// file as private as the secrets it was made from.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KEYSTORE_H__
+#define KEYSTORE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "hmac.h"
+
+#define KEYSTORE_MAGIC      "pTOTPks" // With its NUL, all 8 bytes of magic
+#define KEYSTORE_VERSION    1
+#define KEYSTORE_BYTE_ORDER 0x01020304
+#define KEYSTORE_ALIGN      64
+#define KEYSTORE_MAX_RECORD 192
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order; // KEYSTORE_BYTE_ORDER, as the writer stored it
+  uint32_t record_size;
+  uint32_t reserved;
+  uint64_t count;
+  uint8_t unused[28];
+  uint32_t crc; // crc32 of everything before it
+} KeystoreHeader;
+
+typedef struct {
+  uint8_t algorithm; // HMACAlgorithm
+  uint8_t digits;
+  uint8_t secret_length;
+  uint8_t reserved;
+  uint32_t period; // Seconds
+  // Only key.<algorithm> is stored: anything past the record's end isn't
+  // there, and belongs to the next record.
+  HMAC_KEY key;
+} KeystoreRecord;
+
+// The smallest record_size that holds keys for algorithm.
+size_t keystore_record_size(HMACAlgorithm algorithm);
+
+// Fills in record for secret, midstates and all.
+void keystore_record_init(KeystoreRecord *record, HMACAlgorithm algorithm, int digits, int period,
+                          const uint8_t *secret, int secret_length);
+
+// Writing: keystore_create(), keystore_append() per key, keystore_finish().
+// The header is written last, so a file that wasn't finished doesn't open.
+// Each returns 0, or -1 with errno set.
+typedef struct {
+  FILE *file;
+  size_t record_size;
+  uint64_t count;
+} KeystoreWriter;
+
+int keystore_create(KeystoreWriter *writer, const char *path, size_t record_size);
+
+// EINVAL if the record's keys don't fit record_size, or its digits or period
+// are out of range.
+int keystore_append(KeystoreWriter *writer, const KeystoreRecord *record);
+
+// Writes the header and syncs the file to disk.
+int keystore_finish(KeystoreWriter *writer);
+
+// Reading.
+typedef struct {
+  const uint8_t *map;
+  size_t map_size;
+  size_t record_size;
+  size_t count;
+} Keystore;
+
+#define KEYSTORE_POPULATE 1 // Read the whole file in at open (MAP_POPULATE)
+#define KEYSTORE_RANDOM   2 // Records will be looked up one at a time: no readahead
+
+// Maps path read-only. Only the header is checked, so opening costs the same
+// for any number of records; records are checked as they're used. Returns 0,
+// or -1 with errno set, EINVAL for a file that isn't a finished keystore.
+int keystore_open(Keystore *keystore, const char *path, int flags);
+
+void keystore_close(Keystore *keystore);
+
+static inline const KeystoreRecord *keystore_record(const Keystore *keystore, size_t i) {
+  return (const KeystoreRecord *)(keystore->map + sizeof(KeystoreHeader) + i * keystore->record_size);
+}
+
+// out[i] = the code of record first + i at tm, in its own digits, or -1 for a
+// damaged record. first + n must not pass keystore->count. Runs of SHA1
+// records go through the multi-buffer kernels, reading the midstates straight
+// out of the mapping.
+void keystore_codes(const Keystore *keystore, size_t first, size_t n, unsigned long tm, int out[]);
+
+// As keystore_codes(), for records in any order, as a server collects them:
+// out[i] for record indices[i], -1 for an index past the end. SHA1 midstates
+// are gathered a chunk at a time for the multi-buffer kernels.
+void keystore_codes_at(const Keystore *keystore, const size_t indices[], size_t n,
+                       unsigned long tm, int out[]);
+
+// verifyCodeWithKey() for record i with its own algorithm, digits and period.
+// VERIFY_NO_MATCH for an index past the end or a damaged record.
+int keystore_verify(const Keystore *keystore, size_t i, int window, const char *code,
+                    unsigned long tm);
+
+// offsets[i] = keystore_verify(keystore, indices[i], window, codes[i], tm),
+// through verifyCodes().
+void keystore_verify_at(const Keystore *keystore, const size_t indices[],
+                        const char *const codes[], size_t n, int window,
+                        unsigned long tm, int offsets[]);
+
+#endif
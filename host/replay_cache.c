@@ -0,0 +1,257 @@
+// Replay cache; see replay_cache.h.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay_cache.h"
+
+#define CACHE_LINE 64
+
+// How many entries an insert into two full buckets may move to make room.
+// Only inserts into a nearly full cache search that far.
+#define MAX_MOVES 3
+
+// Shards smaller than this fill up unevenly: the first to fill refuses inserts
+// long before the rest do.
+#define MIN_SHARD_BUCKETS 64
+
+_Static_assert(sizeof(ReplayBucket) == CACHE_LINE, "a bucket is one cache line");
+
+// Padded so that no two shards' locks share a cache line.
+#define SHARD_SIZE ((sizeof(ReplayShard) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+
+static size_t round_up_pow2(size_t n) {
+  size_t p = 1;
+  while (p < n) {
+    p <<= 1;
+  }
+  return p;
+}
+
+static ReplayShard *shard_at(const ReplayCache *cache, size_t i) {
+  return (ReplayShard *)((char *)cache->shards + i * SHARD_SIZE);
+}
+
+int replay_cache_init(ReplayCache *cache, size_t capacity, unsigned shards) {
+  memset(cache, 0, sizeof(*cache));
+  size_t n = round_up_pow2(shards ? shards : 1);
+  while ((1u << cache->shard_bits) < n) {
+    cache->shard_bits++;
+  }
+  size_t per_shard = (capacity + n * REPLAY_BUCKET_ENTRIES - 1) / (n * REPLAY_BUCKET_ENTRIES);
+  per_shard = round_up_pow2(per_shard < MIN_SHARD_BUCKETS ? MIN_SHARD_BUCKETS : per_shard);
+  cache->bucket_mask = per_shard - 1;
+
+  void *memory;
+  if (posix_memalign(&memory, CACHE_LINE, n * SHARD_SIZE)) {
+    return -1;
+  }
+  cache->shards = memory;
+  if (posix_memalign(&memory, CACHE_LINE, n * per_shard * sizeof(ReplayBucket))) {
+    free(cache->shards);
+    cache->shards = NULL;
+    return -1;
+  }
+  cache->buckets = memory;
+  memset(cache->buckets, 0, n * per_shard * sizeof(ReplayBucket));
+  for (size_t i = 0; i < n; ++i) {
+    ReplayShard *shard = shard_at(cache, i);
+    pthread_mutex_init(&shard->lock, NULL);
+    atomic_init(&shard->sequence, 0);
+    shard->buckets = cache->buckets + i * per_shard;
+  }
+  return 0;
+}
+
+void replay_cache_free(ReplayCache *cache) {
+  if (!cache->shards) {
+    return;
+  }
+  for (size_t i = 0; i < (size_t)1 << cache->shard_bits; ++i) {
+    pthread_mutex_destroy(&shard_at(cache, i)->lock);
+  }
+  free(cache->shards);
+  free(cache->buckets);
+  cache->shards = NULL;
+  cache->buckets = NULL;
+}
+
+size_t replay_cache_capacity(const ReplayCache *cache) {
+  return ((size_t)1 << cache->shard_bits) * (cache->bucket_mask + 1) * REPLAY_BUCKET_ENTRIES;
+}
+
+// A 64 bit mix of the pair (MurmurHash3's finalizer), split three ways: the
+// shard from the top bits, the two buckets from the bottom and the middle.
+static uint64_t hash_pair(uint64_t id, uint64_t step) {
+  uint64_t h = id * 0x9E3779B97F4A7C15ull ^ step;
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDull;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+typedef struct {
+  ReplayShard *shard;
+  ReplayBucket *buckets[2];
+} Slots;
+
+static void find_slots(const ReplayCache *cache, uint64_t id, uint64_t step, Slots *slots) {
+  uint64_t h = hash_pair(id, (uint32_t)step);
+  slots->shard = shard_at(cache, cache->shard_bits ? h >> (64 - cache->shard_bits) : 0);
+  size_t first = h & cache->bucket_mask;
+  size_t second = (h >> 24) & cache->bucket_mask;
+  if (second == first) {
+    second ^= 1;
+  }
+  slots->buckets[0] = slots->shard->buckets + first;
+  slots->buckets[1] = slots->shard->buckets + second;
+}
+
+static bool live(const ReplayEntry *entry, unsigned long now) {
+  return atomic_load_explicit(&entry->expires, memory_order_relaxed) > now;
+}
+
+static bool matches(const ReplayEntry *entry, uint64_t id, uint32_t step, unsigned long now) {
+  return atomic_load_explicit(&entry->id, memory_order_relaxed) == id &&
+         atomic_load_explicit(&entry->step, memory_order_relaxed) == step && live(entry, now);
+}
+
+static bool find(const Slots *slots, uint64_t id, uint32_t step, unsigned long now) {
+  for (int b = 0; b < 2; ++b) {
+    for (int i = 0; i < REPLAY_BUCKET_ENTRIES; ++i) {
+      if (matches(&slots->buckets[b]->entries[i], id, step, now)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// The emptier bucket's first free entry, so that the two fill evenly, or
+// NULL if both are full.
+static ReplayEntry *free_entry(const Slots *slots, unsigned long now) {
+  int free_count[2] = { 0, 0 };
+  ReplayEntry *first_free[2] = { NULL, NULL };
+  for (int b = 0; b < 2; ++b) {
+    for (int i = REPLAY_BUCKET_ENTRIES - 1; i >= 0; --i) {
+      ReplayEntry *entry = &slots->buckets[b]->entries[i];
+      if (!live(entry, now)) {
+        free_count[b]++;
+        first_free[b] = entry;
+      }
+    }
+  }
+  return free_count[1] > free_count[0] ? first_free[1] : first_free[0];
+}
+
+// Readers that overlap these stores see the sequence change and look again
+// under the lock; see replay_cache_contains(). The shard's lock is held.
+static void write_entry(ReplayShard *shard, ReplayEntry *entry, uint64_t id, uint64_t step,
+                        unsigned long expires) {
+  uint32_t sequence = atomic_load_explicit(&shard->sequence, memory_order_relaxed);
+  atomic_store_explicit(&shard->sequence, sequence + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&entry->id, id, memory_order_relaxed);
+  atomic_store_explicit(&entry->step, (uint32_t)step, memory_order_relaxed);
+  atomic_store_explicit(&entry->expires, (uint32_t)expires, memory_order_relaxed);
+  atomic_store_explicit(&shard->sequence, sequence + 2, memory_order_release);
+}
+
+// The bucket other than bucket that entry may be in.
+static ReplayBucket *other_bucket(const ReplayCache *cache, const ReplayEntry *entry,
+                                  const ReplayBucket *bucket) {
+  Slots slots;
+  find_slots(cache, atomic_load_explicit(&entry->id, memory_order_relaxed),
+             atomic_load_explicit(&entry->step, memory_order_relaxed), &slots);
+  return slots.buckets[slots.buckets[0] == bucket ? 1 : 0];
+}
+
+// Frees an entry of a full bucket by moving one of its entries to that
+// entry's other bucket, first making room there the same way, up to depth
+// moves in all. Entries are copied before they're dropped, so no lookup can
+// miss one. Returns the entry freed, or NULL.
+static ReplayEntry *make_room(const ReplayCache *cache, ReplayShard *shard, ReplayBucket *bucket,
+                              int depth, unsigned long now) {
+  for (int pass = 0; pass < 2 && (pass == 0 || depth > 1); ++pass) {
+    for (int i = 0; i < REPLAY_BUCKET_ENTRIES; ++i) {
+      ReplayEntry *entry = &bucket->entries[i];
+      ReplayBucket *other = other_bucket(cache, entry, bucket);
+      ReplayEntry *target = NULL;
+      if (pass == 0) {
+        for (int j = 0; j < REPLAY_BUCKET_ENTRIES && !target; ++j) {
+          target = live(&other->entries[j], now) ? NULL : &other->entries[j];
+        }
+      } else {
+        target = make_room(cache, shard, other, depth - 1, now);
+      }
+      if (target) {
+        // What's in entry now; a deeper move may have changed it.
+        write_entry(shard, target, atomic_load_explicit(&entry->id, memory_order_relaxed),
+                    atomic_load_explicit(&entry->step, memory_order_relaxed),
+                    atomic_load_explicit(&entry->expires, memory_order_relaxed));
+        write_entry(shard, entry, 0, 0, 0);
+        return entry;
+      }
+    }
+  }
+  return NULL;
+}
+
+int replay_cache_insert(ReplayCache *cache, uint64_t id, uint64_t step, unsigned long expires,
+                        unsigned long now) {
+  Slots slots;
+  find_slots(cache, id, step, &slots);
+  ReplayShard *shard = slots.shard;
+
+  pthread_mutex_lock(&shard->lock);
+  int result = REPLAY_USED;
+  if (!find(&slots, id, step, now)) {
+    ReplayEntry *entry = free_entry(&slots, now);
+    for (int b = 0; b < 2 && !entry; ++b) {
+      entry = make_room(cache, shard, slots.buckets[b], MAX_MOVES, now);
+    }
+    result = REPLAY_FULL;
+    if (entry) {
+      write_entry(shard, entry, id, step, expires);
+      result = REPLAY_FRESH;
+    }
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return result;
+}
+
+bool replay_cache_contains(ReplayCache *cache, uint64_t id, uint64_t step, unsigned long now) {
+  Slots slots;
+  find_slots(cache, id, step, &slots);
+  ReplayShard *shard = slots.shard;
+
+  uint32_t before = atomic_load_explicit(&shard->sequence, memory_order_acquire);
+  if (!(before & 1)) {
+    bool found = find(&slots, id, (uint32_t)step, now);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&shard->sequence, memory_order_relaxed) == before) {
+      return found;
+    }
+  }
+
+  // An insert overlapped: wait it out rather than spin, in case its thread
+  // isn't running.
+  pthread_mutex_lock(&shard->lock);
+  bool found = find(&slots, id, (uint32_t)step, now);
+  pthread_mutex_unlock(&shard->lock);
+  return found;
+}
@@ -0,0 +1,97 @@
+// A cache of the (record, step) pairs whose codes have been accepted, so a
+// code can be refused the second time it's used within its window, as RFC
+// 6238 section 5.2 asks. Any number of threads may share one.
+//
+// The cache is split into shards by hash, each with its own lock and its own
+// table of buckets of four entries, one cache line a bucket. A pair may be in
+// either of two buckets of its shard. Inserting takes the shard's lock.
+// Looking up doesn't: a shard's sequence number shows whether an insert ran
+// meanwhile, and only then does the lookup take the lock and look again.
+//
+// Each entry carries the time its code stops verifying. From then on the entry
+// counts as empty and the next insert that lands there reuses it, so nothing
+// needs sweeping. Memory is fixed at init, 16 bytes an entry. When both of a
+// pair's buckets are full, an insert moves up to a few entries to their other
+// buckets to make room, as in cuckoo hashing. If that fails too, the insert
+// fails and the code should be refused, not let through unrecorded. That
+// starts at around 92% load. Size the cache for the most codes that may be
+// accepted within one expiry time, with room to spare.
+//
+// Steps and times are kept in 32 bits, which lasts until 2106.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef REPLAY_CACHE_H__
+#define REPLAY_CACHE_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define REPLAY_BUCKET_ENTRIES 4
+
+// Returned by replay_cache_insert().
+#define REPLAY_FRESH 0  // Recorded: the code may be accepted
+#define REPLAY_USED  1  // Already recorded and not yet expired: refuse it
+#define REPLAY_FULL  -1 // No room: refuse it
+
+typedef struct {
+  _Atomic uint64_t id;
+  _Atomic uint32_t step;
+  _Atomic uint32_t expires; // Empty from this time on; 0 if never used
+} ReplayEntry;
+
+typedef struct {
+  ReplayEntry entries[REPLAY_BUCKET_ENTRIES];
+} ReplayBucket;
+
+typedef struct {
+  pthread_mutex_t lock;
+  _Atomic uint32_t sequence; // Odd while an insert is writing
+  ReplayBucket *buckets;
+} ReplayShard;
+
+typedef struct {
+  ReplayShard *shards;
+  ReplayBucket *buckets;
+  unsigned shard_bits;
+  size_t bucket_mask; // Buckets per shard, less one
+} ReplayCache;
+
+// Room for at least capacity entries over at least shards shards, each
+// rounded up to a power of two, and at least 256 entries a shard. Returns 0,
+// or -1 if the memory can't be had.
+int replay_cache_init(ReplayCache *cache, size_t capacity, unsigned shards);
+
+void replay_cache_free(ReplayCache *cache);
+
+// The number of entries there's room for.
+size_t replay_cache_capacity(const ReplayCache *cache);
+
+// Records that the code of record id for step was accepted at now, and
+// stays live until expires. Returns REPLAY_FRESH, REPLAY_USED or REPLAY_FULL.
+int replay_cache_insert(ReplayCache *cache, uint64_t id, uint64_t step, unsigned long expires,
+                        unsigned long now);
+
+// Whether step of record id is recorded and not yet expired at now.
+bool replay_cache_contains(ReplayCache *cache, uint64_t id, uint64_t step, unsigned long now);
+
+// When a code for step stops verifying: once step is more than window steps
+// behind.
+static inline unsigned long replay_expiry(uint64_t step, int period, int window) {
+  return (step + window + 1) * period;
+}
+
+#endif
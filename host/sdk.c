@@ -0,0 +1,110 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "pebble.h"
+#include "sdk.h"
+
+// Like the watch: at most PERSIST_DATA_MAX_LENGTH bytes per key, which a
+// linear list is plenty for at the few hundred keys the app uses.
+#define PERSIST_MAX_KEYS 1024
+
+typedef struct {
+  uint32_t key;
+  int size;
+  uint8_t data[PERSIST_DATA_MAX_LENGTH];
+} PersistEntry;
+
+static PersistEntry persist_entries[PERSIST_MAX_KEYS];
+static int persist_count = 0;
+
+PersistStats persist_stats;
+
+static PersistEntry *persist_find(uint32_t key) {
+  for (int i = 0; i < persist_count; ++i) {
+    if (persist_entries[i].key == key) {
+      return &persist_entries[i];
+    }
+  }
+  return NULL;
+}
+
+bool persist_exists(const uint32_t key) {
+  return persist_find(key) != NULL;
+}
+
+int persist_get_size(const uint32_t key) {
+  PersistEntry *entry = persist_find(key);
+  return entry ? entry->size : -1;
+}
+
+int32_t persist_read_int(const uint32_t key) {
+  int32_t value = 0;
+  persist_read_data(key, &value, sizeof(value));
+  return value;
+}
+
+int persist_read_data(const uint32_t key, void *buffer, const size_t buffer_size) {
+  PersistEntry *entry = persist_find(key);
+  if (!entry) {
+    return -1;
+  }
+  int size = entry->size < (int)buffer_size ? entry->size : (int)buffer_size;
+  memcpy(buffer, entry->data, size);
+  persist_stats.reads++;
+  persist_stats.bytes_read += size;
+  return size;
+}
+
+int persist_write_int(const uint32_t key, const int32_t value) {
+  return persist_write_data(key, &value, sizeof(value));
+}
+
+int persist_write_data(const uint32_t key, const void *data, const size_t size) {
+  PersistEntry *entry = persist_find(key);
+  if (!entry) {
+    if (persist_count == PERSIST_MAX_KEYS) {
+      return -1;
+    }
+    entry = &persist_entries[persist_count++];
+    entry->key = key;
+  }
+  entry->size = size < PERSIST_DATA_MAX_LENGTH ? size : PERSIST_DATA_MAX_LENGTH;
+  memcpy(entry->data, data, entry->size);
+  persist_stats.writes++;
+  persist_stats.bytes_written += entry->size;
+  return entry->size;
+}
+
+int persist_delete(const uint32_t key) {
+  PersistEntry *entry = persist_find(key);
+  if (!entry) {
+    return -1;
+  }
+  *entry = persist_entries[--persist_count];
+  persist_stats.deletes++;
+  return 0;
+}
+
+void persist_reset_stats(void) {
+  memset(&persist_stats, 0, sizeof(persist_stats));
+}
+
+int persist_key_count(void) {
+  return persist_count;
+}
+
+void persist_clear(void) {
+  persist_count = 0;
+}
+
+void app_log(uint8_t log_level, const char *src_filename, int src_line_number, const char *fmt, ...) {
+}
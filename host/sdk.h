@@ -0,0 +1,38 @@
+// Host implementations of the SDK calls declared in include/pebble.h, and
+// what they let a benchmark observe.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SDK_H__
+#define SDK_H__
+
+#include <stddef.h>
+
+// Persist traffic since the last persist_reset_stats().
+typedef struct {
+  size_t reads, bytes_read;
+  size_t writes, bytes_written;
+  size_t deletes;
+} PersistStats;
+
+extern PersistStats persist_stats;
+
+void persist_reset_stats(void);
+
+// Number of keys in storage.
+int persist_key_count(void);
+
+// Empties storage.
+void persist_clear(void);
+
+#endif
@@ -0,0 +1,131 @@
+// Multi-buffer SHA1 kernels and their runtime selection.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <pthread.h>
+#include <string.h>
+
+#include "sha1.h"
+#include "sha1_mb.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_MB_X86 1
+#endif
+
+static int always_supported(void) {
+  return 1;
+}
+
+#ifdef SHA1_MB_X86
+
+#define KERNEL_NAME sha1_mb_compress_x4
+#define KERNEL_LANES 4
+#define KERNEL_TARGET __attribute__((target("sse2")))
+#include "sha1_mb_kernel.h"
+#undef KERNEL_NAME
+#undef KERNEL_LANES
+#undef KERNEL_TARGET
+
+#define KERNEL_NAME sha1_mb_compress_x8
+#define KERNEL_LANES 8
+#define KERNEL_TARGET __attribute__((target("avx2")))
+#include "sha1_mb_kernel.h"
+#undef KERNEL_NAME
+#undef KERNEL_LANES
+#undef KERNEL_TARGET
+
+#define KERNEL_NAME sha1_mb_compress_x16
+#define KERNEL_LANES 16
+#define KERNEL_TARGET __attribute__((target("avx512f")))
+#include "sha1_mb_kernel.h"
+#undef KERNEL_NAME
+#undef KERNEL_LANES
+#undef KERNEL_TARGET
+
+static int sse2_supported(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+}
+
+static int avx2_supported(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+static int avx512_supported(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512f");
+}
+
+static const SHA1_MB_KERNEL kernel_avx512 = { "avx512 x16", 16, sha1_mb_compress_x16, avx512_supported };
+static const SHA1_MB_KERNEL kernel_avx2 = { "avx2 x8", 8, sha1_mb_compress_x8, avx2_supported };
+static const SHA1_MB_KERNEL kernel_sse2 = { "sse2 x4", 4, sha1_mb_compress_x4, sse2_supported };
+
+#else /* !SHA1_MB_X86 */
+
+// Elsewhere let the compiler map a four lane kernel onto whatever vector unit
+// the target has by default.
+#define KERNEL_NAME sha1_mb_compress_x4
+#define KERNEL_LANES 4
+#define KERNEL_TARGET
+#include "sha1_mb_kernel.h"
+#undef KERNEL_NAME
+#undef KERNEL_LANES
+#undef KERNEL_TARGET
+
+static const SHA1_MB_KERNEL kernel_x4 = { "vector x4", 4, sha1_mb_compress_x4, always_supported };
+
+#endif /* !SHA1_MB_X86 */
+
+static void sha1_mb_compress_x1(uint32_t *state, const uint32_t *block) {
+  sha1_compress(state, block);
+}
+
+static const SHA1_MB_KERNEL kernel_scalar = { "scalar", 1, sha1_mb_compress_x1, always_supported };
+
+const SHA1_MB_KERNEL *const sha1_mb_kernels[] = {
+#ifdef SHA1_MB_X86
+  &kernel_avx512,
+  &kernel_avx2,
+  &kernel_sse2,
+#else
+  &kernel_x4,
+#endif
+  &kernel_scalar,
+  NULL
+};
+
+static const SHA1_MB_KERNEL *best;
+static pthread_once_t best_once = PTHREAD_ONCE_INIT;
+
+static void pick_best(void) {
+  for (int i = 0; sha1_mb_kernels[i]; ++i) {
+#ifdef SHA1_MB_X86
+    // A single lane on the SHA extensions outpaces four SSE2 lanes.
+    if (sha1_mb_kernels[i] == &kernel_sse2 && sha1_compress_is_hw()) {
+      continue;
+    }
+#endif
+    if (sha1_mb_kernels[i]->supported()) {
+      best = sha1_mb_kernels[i];
+      break;
+    }
+  }
+}
+
+// Picked once, by whichever thread asks first; workers and the code index's
+// roller may all ask at once.
+const SHA1_MB_KERNEL *sha1_mb_best(void) {
+  pthread_once(&best_once, pick_best);
+  return best;
+}
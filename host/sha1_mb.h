@@ -0,0 +1,41 @@
+// Multi-buffer SHA1: one compression over several independent blocks at once.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SHA1_MB_H__
+#define SHA1_MB_H__
+
+#include <stdint.h>
+
+#define SHA1_MB_MAX_LANES 16
+
+// State and blocks are kept structure-of-arrays: word i of lane l lives at
+// [i * lanes + l], so that each word of every lane loads as one vector.
+typedef struct {
+  const char *name;
+  int lanes;
+  // state is 5 * lanes words, block is 16 * lanes host-order words.
+  void (*compress)(uint32_t *state, const uint32_t *block);
+  int (*supported)(void);
+} SHA1_MB_KERNEL;
+
+// Every kernel built into this binary, widest first, ending with the scalar
+// fallback (one lane, through sha1_compress()) and a NULL entry.
+extern const SHA1_MB_KERNEL *const sha1_mb_kernels[];
+
+// The fastest kernel the running CPU supports: the widest vector kernel, except
+// that with the SHA extensions (see src/sha1.c) the one-lane kernel beats SSE2.
+// Chosen once, on first use.
+const SHA1_MB_KERNEL *sha1_mb_best(void);
+
+#endif
@@ -0,0 +1,59 @@
+// SHA1 compression over KERNEL_LANES independent blocks using GCC vector
+// extensions. Included by sha1_mb.c once per lane count, with KERNEL_NAME,
+// KERNEL_LANES and KERNEL_TARGET (a function attribute) defined; the compiler
+// turns the vector operations into SSE2/AVX2/AVX-512 code per the target.
+
+static KERNEL_TARGET void
+KERNEL_NAME(uint32_t *state, const uint32_t *block)
+{
+    typedef uint32_t vec __attribute__((vector_size(KERNEL_LANES * 4)));
+    vec W[16], A, B, C, D, E, T;
+    int t;
+
+#define LOAD(v, src) memcpy(&(v), (src), sizeof(vec))
+#define STORE(dst, v) memcpy((dst), &(v), sizeof(vec))
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define SCHEDULE(t) \
+    (W[(t) & 15] = ROL(W[((t) - 3) & 15] ^ W[((t) - 8) & 15] ^ \
+                       W[((t) - 14) & 15] ^ W[(t) & 15], 1))
+#define ROUND(f, k, w) \
+    T = ROL(A, 5) + (f) + E + (w) + (k); \
+    E = D; D = C; C = ROL(B, 30); B = A; A = T
+
+    for (t = 0; t < 16; ++t) {
+        LOAD(W[t], block + t * KERNEL_LANES);
+    }
+    LOAD(A, state + 0 * KERNEL_LANES);
+    LOAD(B, state + 1 * KERNEL_LANES);
+    LOAD(C, state + 2 * KERNEL_LANES);
+    LOAD(D, state + 3 * KERNEL_LANES);
+    LOAD(E, state + 4 * KERNEL_LANES);
+
+    for (t = 0; t < 16; ++t) {
+        ROUND((B & C) | (~B & D), 0x5a827999, W[t]);
+    }
+    for (; t < 20; ++t) {
+        ROUND((B & C) | (~B & D), 0x5a827999, SCHEDULE(t));
+    }
+    for (; t < 40; ++t) {
+        ROUND(B ^ C ^ D, 0x6ed9eba1, SCHEDULE(t));
+    }
+    for (; t < 60; ++t) {
+        ROUND((B & C) | (B & D) | (C & D), 0x8f1bbcdc, SCHEDULE(t));
+    }
+    for (; t < 80; ++t) {
+        ROUND(B ^ C ^ D, 0xca62c1d6, SCHEDULE(t));
+    }
+
+    LOAD(T, state + 0 * KERNEL_LANES); A += T; STORE(state + 0 * KERNEL_LANES, A);
+    LOAD(T, state + 1 * KERNEL_LANES); B += T; STORE(state + 1 * KERNEL_LANES, B);
+    LOAD(T, state + 2 * KERNEL_LANES); C += T; STORE(state + 2 * KERNEL_LANES, C);
+    LOAD(T, state + 3 * KERNEL_LANES); D += T; STORE(state + 3 * KERNEL_LANES, D);
+    LOAD(T, state + 4 * KERNEL_LANES); E += T; STORE(state + 4 * KERNEL_LANES, E);
+
+#undef ROUND
+#undef SCHEDULE
+#undef ROL
+#undef STORE
+#undef LOAD
+}
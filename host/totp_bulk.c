@@ -0,0 +1,418 @@
+// Bulk code generation: the codes for a file of secrets at one time, spread
+// over every core.
+//
+//   totp_bulk [-a sha1|sha256|sha512] [-d digits] [-p period] [-t time]
+//             [-j threads] [file]
+//   totp_bulk -s [-n secrets] [-j threads] [...]
+//
+// Reads one base32 secret per line (as in otpauth:// URIs; case, spaces and
+// padding are ignored) from file or stdin and writes one code per line, in
+// the same order, or "invalid" for a line that doesn't decode. time defaults
+// to now. -s instead times n random 20 byte secrets with 1 to threads
+// threads and prints throughput per thread and the scaling against one.
+//
+// Input is read in blocks of BLOCK_LINES. Each block is cut into tasks of
+// TASK_LINES, dealt out evenly to the workers' queues. A worker takes tasks
+// from the front of its own queue and, when that runs dry, steals from the
+// back of the fullest. Codes go to fixed slots, so the block is written out
+// in order once every task is done.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base32.h"
+#include "generate.h"
+#include "generate_batch.h"
+#include "hmac.h"
+
+#define BLOCK_LINES  65536
+#define TASK_LINES   256
+#define MAX_SECRET   128 // Bytes; longer lines are invalid
+#define MAX_THREADS  256
+
+typedef struct {
+  HMACAlgorithm algorithm;
+  int digits;
+  int period;
+  unsigned long time;
+} Options;
+
+// One block of input: secrets decoded up front, codes filled in by the tasks.
+typedef struct {
+  size_t n;
+  uint8_t (*secrets)[MAX_SECRET];
+  uint8_t *lengths; // 0 for a line that didn't decode
+  char (*codes)[MAX_CODE_DIGITS + 1];
+} Block;
+
+// A worker's tasks still to run, [next, end) in units of TASK_LINES. Both
+// change only under lock, but thieves read them without it to pick a victim.
+typedef struct {
+  pthread_mutex_t lock;
+  _Atomic size_t next, end;
+} WorkQueue;
+
+typedef struct {
+  const Options *options;
+  int threads;
+  WorkQueue queues[MAX_THREADS];
+  pthread_t workers[MAX_THREADS];
+
+  // Each block is a round: the main thread fills the queues, bumps round and
+  // waits for running to drop back to 0.
+  pthread_mutex_t lock;
+  pthread_cond_t start, done;
+  unsigned long round;
+  int running;
+  bool quit;
+  Block *block;
+} Pool;
+
+typedef struct {
+  Pool *pool;
+  int index;
+} Worker;
+
+static void run_task(const Options *options, Block *block, size_t task) {
+  size_t first = task * TASK_LINES;
+  size_t n = block->n - first < TASK_LINES ? block->n - first : TASK_LINES;
+  unsigned long step = options->time / options->period;
+
+  if (options->algorithm == HMAC_SHA1) {
+    // The whole task through the multi-buffer kernels, lines that didn't
+    // decode and all; their codes are overwritten below.
+    const uint8_t *keys[TASK_LINES] = { NULL };
+    HMAC_SHA1_KEY prepared[TASK_LINES];
+    uint32_t truncated[TASK_LINES];
+    for (size_t i = 0; i < n; ++i) {
+      keys[i] = block->secrets[first + i];
+    }
+    hmac_sha1_prepare_batch(NULL, keys, block->lengths + first, n, prepared);
+    hmac_sha1_counter_batch(NULL, prepared, NULL, step, n, truncated);
+    for (size_t i = 0; i < n; ++i) {
+      formatCode(reduceCode(truncated[i], options->digits), options->digits, block->codes[first + i]);
+    }
+    memset(prepared, 0, sizeof(prepared));
+  } else {
+    HMAC_KEY key;
+    for (size_t i = 0; i < n; ++i) {
+      hmac_prepare(options->algorithm, &key, block->secrets[first + i], block->lengths[first + i]);
+      formatCode(generateCodeWithKey(options->algorithm, &key, step, options->digits), options->digits,
+                 block->codes[first + i]);
+    }
+    memset(&key, 0, sizeof(key));
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    if (!block->lengths[first + i]) {
+      strcpy(block->codes[first + i], "invalid");
+    }
+  }
+}
+
+// The next task for worker index: its own front, else the back of the
+// fullest queue. Returns false once every queue is empty.
+static bool take_task(Pool *pool, int index, size_t *task) {
+  WorkQueue *own = &pool->queues[index];
+  pthread_mutex_lock(&own->lock);
+  size_t next = atomic_load_explicit(&own->next, memory_order_relaxed);
+  bool found = next < atomic_load_explicit(&own->end, memory_order_relaxed);
+  if (found) {
+    *task = next;
+    atomic_store_explicit(&own->next, next + 1, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&own->lock);
+  while (!found) {
+    // Sizes read unlocked are only a hint; the steal itself is locked.
+    int victim = -1;
+    size_t most = 0;
+    for (int i = 0; i < pool->threads; ++i) {
+      size_t next = atomic_load_explicit(&pool->queues[i].next, memory_order_relaxed);
+      size_t end = atomic_load_explicit(&pool->queues[i].end, memory_order_relaxed);
+      if (next < end && end - next > most) {
+        most = end - next;
+        victim = i;
+      }
+    }
+    if (victim < 0) {
+      return false;
+    }
+    WorkQueue *queue = &pool->queues[victim];
+    pthread_mutex_lock(&queue->lock);
+    size_t end = atomic_load_explicit(&queue->end, memory_order_relaxed);
+    found = atomic_load_explicit(&queue->next, memory_order_relaxed) < end;
+    if (found) {
+      *task = end - 1;
+      atomic_store_explicit(&queue->end, end - 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+  }
+  return true;
+}
+
+static void *worker_main(void *p) {
+  Worker *worker = p;
+  Pool *pool = worker->pool;
+  unsigned long round = 0;
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->round == round && !pool->quit) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    if (pool->quit) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    round = pool->round;
+    pthread_mutex_unlock(&pool->lock);
+
+    size_t task;
+    while (take_task(pool, worker->index, &task)) {
+      run_task(pool->options, pool->block, task);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static Worker worker_args[MAX_THREADS];
+
+static void pool_start(Pool *pool, const Options *options, int threads) {
+  memset(pool, 0, sizeof(*pool));
+  pool->options = options;
+  pool->threads = threads;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (int i = 0; i < threads; ++i) {
+    pthread_mutex_init(&pool->queues[i].lock, NULL);
+    worker_args[i] = (Worker){ pool, i };
+    pthread_create(&pool->workers[i], NULL, worker_main, &worker_args[i]);
+  }
+}
+
+static void pool_run(Pool *pool, Block *block) {
+  size_t tasks = (block->n + TASK_LINES - 1) / TASK_LINES;
+  pthread_mutex_lock(&pool->lock);
+  for (int i = 0; i < pool->threads; ++i) {
+    atomic_store_explicit(&pool->queues[i].next, tasks * i / pool->threads, memory_order_relaxed);
+    atomic_store_explicit(&pool->queues[i].end, tasks * (i + 1) / pool->threads, memory_order_relaxed);
+  }
+  pool->block = block;
+  pool->running = pool->threads;
+  pool->round++;
+  pthread_cond_broadcast(&pool->start);
+  while (pool->running) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_stop(Pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->threads; ++i) {
+    pthread_join(pool->workers[i], NULL);
+    pthread_mutex_destroy(&pool->queues[i].lock);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+}
+
+static void block_alloc(Block *block, size_t n) {
+  block->n = 0;
+  block->secrets = malloc(n * sizeof(*block->secrets));
+  block->lengths = malloc(n);
+  block->codes = malloc(n * sizeof(*block->codes));
+  if (!block->secrets || !block->lengths || !block->codes) {
+    fprintf(stderr, "totp_bulk: out of memory\n");
+    exit(1);
+  }
+}
+
+static void block_free(Block *block, size_t n) {
+  memset(block->secrets, 0, n * sizeof(*block->secrets));
+  free(block->secrets);
+  free(block->lengths);
+  free(block->codes);
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int generate_file(const Options *options, int threads, FILE *in) {
+  Pool pool;
+  Block block;
+  block_alloc(&block, BLOCK_LINES);
+  pool_start(&pool, options, threads);
+
+  char line[4 * MAX_SECRET];
+  bool more = true;
+  while (more) {
+    block.n = 0;
+    while (block.n < BLOCK_LINES && (more = fgets(line, sizeof(line), in) != NULL)) {
+      size_t length = strlen(line);
+      if (length == sizeof(line) - 1 && line[length - 1] != '\n') {
+        // Too long to be a secret; skip the rest of the line.
+        int c;
+        while ((c = getc(in)) != EOF && c != '\n') {
+        }
+        line[0] = '!';
+      }
+      block.lengths[block.n] = base32_decode(line, block.secrets[block.n], MAX_SECRET);
+      block.n++;
+    }
+    if (block.n) {
+      pool_run(&pool, &block);
+      for (size_t i = 0; i < block.n; ++i) {
+        fputs(block.codes[i], stdout);
+        putchar('\n');
+      }
+    }
+  }
+  memset(line, 0, sizeof(line));
+
+  pool_stop(&pool);
+  block_free(&block, BLOCK_LINES);
+  return ferror(in) || ferror(stdout) ? 1 : 0;
+}
+
+// Codes for n random secrets with 1 to threads threads, blocks of
+// BLOCK_LINES as from a file, minus the I/O.
+static void scaling(const Options *options, int threads, size_t n) {
+  Block block;
+  block_alloc(&block, n);
+  block.n = n;
+  srand(1);
+  for (size_t i = 0; i < n; ++i) {
+    for (int j = 0; j < 20; ++j) {
+      block.secrets[i][j] = rand();
+    }
+    block.lengths[i] = 20;
+  }
+
+  printf("%zu secrets, %d digits, %d s period\n", n, options->digits, options->period);
+  printf("threads  codes/s       per thread    scaling\n");
+  double single = 0;
+  for (int t = 1; t <= threads; ++t) {
+    Pool pool;
+    pool_start(&pool, options, t);
+    Block chunk = block;
+    double start = now_seconds();
+    for (size_t i = 0; i < n; i += BLOCK_LINES) {
+      chunk.n = n - i < BLOCK_LINES ? n - i : BLOCK_LINES;
+      chunk.secrets = block.secrets + i;
+      chunk.lengths = block.lengths + i;
+      chunk.codes = block.codes + i;
+      pool_run(&pool, &chunk);
+    }
+    double rate = n / (now_seconds() - start);
+    pool_stop(&pool);
+    if (t == 1) {
+      single = rate;
+    }
+    printf("%7d  %12.0f  %12.0f  %6.2fx\n", t, rate, rate / t, rate / single);
+  }
+  block_free(&block, n);
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: totp_bulk [-a sha1|sha256|sha512] [-d digits] [-p period] [-t time]\n"
+          "                 [-j threads] [file]\n"
+          "       totp_bulk -s [-n secrets] [-j threads] [-a ...] [-d ...] [-p ...]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  Options options = { HMAC_SHA1, 6, 30, time(NULL) };
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = cores > 0 ? (cores < MAX_THREADS ? cores : MAX_THREADS) : 1;
+  bool scale = false;
+  size_t count = 4000000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "a:d:p:t:j:sn:")) != -1) {
+    switch (opt) {
+      case 'a':
+        if (!strcmp(optarg, "sha1")) {
+          options.algorithm = HMAC_SHA1;
+        } else if (!strcmp(optarg, "sha256")) {
+          options.algorithm = HMAC_SHA256;
+        } else if (!strcmp(optarg, "sha512")) {
+          options.algorithm = HMAC_SHA512;
+        } else {
+          usage();
+        }
+        break;
+      case 'd':
+        options.digits = atoi(optarg);
+        break;
+      case 'p':
+        options.period = atoi(optarg);
+        break;
+      case 't':
+        options.time = strtoul(optarg, NULL, 10);
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        break;
+      case 's':
+        scale = true;
+        break;
+      case 'n':
+        count = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        usage();
+    }
+  }
+  if (options.digits < MIN_CODE_DIGITS || options.digits > MAX_CODE_DIGITS || options.period <= 0 ||
+      threads < 1 || threads > MAX_THREADS || count == 0 || argc - optind > 1) {
+    usage();
+  }
+
+  if (scale) {
+    scaling(&options, threads, count);
+    return 0;
+  }
+
+  FILE *in = stdin;
+  if (optind < argc && !(in = fopen(argv[optind], "r"))) {
+    perror(argv[optind]);
+    return 1;
+  }
+  int status = generate_file(&options, threads, in);
+  if (in != stdin) {
+    fclose(in);
+  }
+  return status;
+}
@@ -0,0 +1,467 @@
+// The keystore (keystore.h) from the command line.
+//
+//   totp_store import [-a sha1|sha256|sha512] [-d digits] [-p period]
+//                     [-r record_size] keystore [file]
+//   totp_store codes [-t time] keystore
+//   totp_store verify [-t time] [-w window] keystore index code
+//   totp_store bench [-n records] [-f prefix]
+//
+// import reads one base32 secret per line, as totp_bulk does, from file or
+// stdin, and writes record i for line i. Every line must decode. record_size
+// defaults to the least for the algorithm; give 192 to leave room for keys of
+// any algorithm. codes prints each record's code at time (default now), one
+// per line. verify prints the matching step offset of record index, or "no
+// match" with status 1.
+//
+// bench writes records random secrets as prefix.txt, imports them into
+// prefix.keys and times starting up from each: parsing the text and deriving
+// the midstates, against opening the keystore and then using it. Each is
+// timed cold, with the file dropped from the page cache by posix_fadvise(),
+// and again warm.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base32.h"
+#include "generate.h"
+#include "generate_batch.h"
+#include "keystore.h"
+#include "verify.h"
+
+#define MAX_SECRET   128 // Bytes, as in totp_bulk
+#define IMPORT_CHUNK 256
+
+static volatile uint32_t sink;
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: totp_store import [-a sha1|sha256|sha512] [-d digits] [-p period]\n"
+          "                         [-r record_size] keystore [file]\n"
+          "       totp_store codes [-t time] keystore\n"
+          "       totp_store verify [-t time] [-w window] keystore index code\n"
+          "       totp_store bench [-n records] [-f prefix]\n");
+  exit(2);
+}
+
+static HMACAlgorithm parse_algorithm(const char *name) {
+  if (!strcmp(name, "sha1")) {
+    return HMAC_SHA1;
+  } else if (!strcmp(name, "sha256")) {
+    return HMAC_SHA256;
+  } else if (!strcmp(name, "sha512")) {
+    return HMAC_SHA512;
+  }
+  usage();
+  return HMAC_SHA1;
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Up to IMPORT_CHUNK decoded lines at a time. SHA1 midstates are derived
+// through the multi-buffer kernels.
+static int import_chunk(KeystoreWriter *writer, HMACAlgorithm algorithm, int digits, int period,
+                        uint8_t secrets[][MAX_SECRET], const uint8_t lengths[], size_t n) {
+  KeystoreRecord record;
+  HMAC_SHA1_KEY prepared[IMPORT_CHUNK];
+  if (algorithm == HMAC_SHA1) {
+    const uint8_t *keys[IMPORT_CHUNK] = { NULL };
+    for (size_t i = 0; i < n; ++i) {
+      keys[i] = secrets[i];
+    }
+    hmac_sha1_prepare_batch(NULL, keys, lengths, n, prepared);
+  }
+
+  int status = 0;
+  for (size_t i = 0; i < n && !status; ++i) {
+    if (algorithm == HMAC_SHA1) {
+      memset(&record, 0, sizeof(record));
+      record.algorithm = HMAC_SHA1;
+      record.digits = digits;
+      record.secret_length = lengths[i];
+      record.period = period;
+      record.key.sha1 = prepared[i];
+    } else {
+      keystore_record_init(&record, algorithm, digits, period, secrets[i], lengths[i]);
+    }
+    status = keystore_append(writer, &record);
+  }
+  memset(&record, 0, sizeof(record));
+  memset(prepared, 0, sizeof(prepared));
+  return status;
+}
+
+static int import_file(const char *path, HMACAlgorithm algorithm, int digits, int period,
+                       size_t record_size, FILE *in) {
+  KeystoreWriter writer;
+  if (keystore_create(&writer, path, record_size)) {
+    perror(path);
+    return 1;
+  }
+
+  static uint8_t secrets[IMPORT_CHUNK][MAX_SECRET];
+  uint8_t lengths[IMPORT_CHUNK];
+  char line[4 * MAX_SECRET];
+  unsigned long line_number = 0;
+  size_t n = 0;
+  int status = 0;
+  while (!status && fgets(line, sizeof(line), in)) {
+    line_number++;
+    size_t length = strlen(line);
+    if ((length == sizeof(line) - 1 && line[length - 1] != '\n') ||
+        !(lengths[n] = base32_decode(line, secrets[n], MAX_SECRET))) {
+      fprintf(stderr, "totp_store: line %lu: not a base32 secret of up to %d bytes\n", line_number,
+              MAX_SECRET);
+      status = 1;
+      break;
+    }
+    if (++n == IMPORT_CHUNK) {
+      status = import_chunk(&writer, algorithm, digits, period, secrets, lengths, n) ? 2 : 0;
+      n = 0;
+    }
+  }
+  if (!status && n) {
+    status = import_chunk(&writer, algorithm, digits, period, secrets, lengths, n) ? 2 : 0;
+  }
+  memset(line, 0, sizeof(line));
+  memset(secrets, 0, sizeof(secrets));
+
+  if (status == 2) {
+    perror(path);
+  }
+  if (!status && ferror(in)) {
+    fprintf(stderr, "totp_store: read error\n");
+    status = 1;
+  }
+  if (keystore_finish(&writer) && !status) {
+    perror(path);
+    status = 1;
+  }
+  if (status) {
+    unlink(path);
+    return 1;
+  }
+  return 0;
+}
+
+static int open_keystore(Keystore *keystore, const char *path, int flags) {
+  if (keystore_open(keystore, path, flags)) {
+    perror(path);
+    return 1;
+  }
+  return 0;
+}
+
+static int print_codes(const char *path, unsigned long tm) {
+  Keystore keystore;
+  if (open_keystore(&keystore, path, 0)) {
+    return 1;
+  }
+  int codes[IMPORT_CHUNK];
+  char code[MAX_CODE_DIGITS + 1];
+  for (size_t i = 0; i < keystore.count; i += IMPORT_CHUNK) {
+    size_t n = keystore.count - i < IMPORT_CHUNK ? keystore.count - i : IMPORT_CHUNK;
+    keystore_codes(&keystore, i, n, tm, codes);
+    for (size_t j = 0; j < n; ++j) {
+      if (codes[j] < 0) {
+        puts("invalid");
+      } else {
+        formatCode(codes[j], keystore_record(&keystore, i + j)->digits, code);
+        puts(code);
+      }
+    }
+  }
+  keystore_close(&keystore);
+  return ferror(stdout) ? 1 : 0;
+}
+
+static int verify(const char *path, size_t index, const char *code, int window, unsigned long tm) {
+  Keystore keystore;
+  if (open_keystore(&keystore, path, KEYSTORE_RANDOM)) {
+    return 1;
+  }
+  int offset = keystore_verify(&keystore, index, window, code, tm);
+  keystore_close(&keystore);
+  if (offset == VERIFY_NO_MATCH) {
+    puts("no match");
+    return 1;
+  }
+  printf("%d\n", offset);
+  return 0;
+}
+
+// Benchmark.
+
+// Drops path from the page cache. Dirty pages can't be dropped, so sync
+// first. Returns the fraction of its pages still cached afterwards.
+static double drop_cache(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return 1;
+  }
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  struct stat st;
+  double cached = 1;
+  long page = sysconf(_SC_PAGESIZE);
+  void *map;
+  if (!fstat(fd, &st) && st.st_size > 0 &&
+      (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+    size_t pages = (st.st_size + page - 1) / page;
+    unsigned char *resident = malloc(pages);
+    if (resident && !mincore(map, st.st_size, resident)) {
+      size_t in = 0;
+      for (size_t i = 0; i < pages; ++i) {
+        in += resident[i] & 1;
+      }
+      cached = (double)in / pages;
+    }
+    free(resident);
+    munmap(map, st.st_size);
+  }
+  close(fd);
+  return cached;
+}
+
+static const char base32_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+
+static int write_secrets(const char *path, size_t n) {
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    perror(path);
+    return 1;
+  }
+  uint64_t x = 88172645463325252ull;
+  char line[33];
+  line[32] = '\n';
+  for (size_t i = 0; i < n; ++i) {
+    // 32 base32 characters: a 20 byte secret.
+    for (int j = 0; j < 32; ++j) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      line[j] = base32_alphabet[x >> 59];
+    }
+    fwrite(line, sizeof(line), 1, out);
+  }
+  return fclose(out) ? 1 : 0;
+}
+
+// What startup from text costs: every line decoded and its midstates derived,
+// ready for the first code.
+static double time_text(const char *path, size_t n, HMAC_SHA1_KEY *keys) {
+  double start = now_seconds();
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    return -1;
+  }
+  static uint8_t secrets[IMPORT_CHUNK][MAX_SECRET];
+  const uint8_t *pointers[IMPORT_CHUNK];
+  uint8_t lengths[IMPORT_CHUNK];
+  char line[4 * MAX_SECRET];
+  size_t done = 0, chunk = 0;
+  while (done + chunk < n && fgets(line, sizeof(line), in)) {
+    lengths[chunk] = base32_decode(line, secrets[chunk], MAX_SECRET);
+    pointers[chunk] = secrets[chunk];
+    if (++chunk == IMPORT_CHUNK) {
+      hmac_sha1_prepare_batch(NULL, pointers, lengths, chunk, keys + done);
+      done += chunk;
+      chunk = 0;
+    }
+  }
+  if (chunk) {
+    hmac_sha1_prepare_batch(NULL, pointers, lengths, chunk, keys + done);
+    done += chunk;
+  }
+  fclose(in);
+  double elapsed = now_seconds() - start;
+  sink += keys[n - 1].inner[0];
+  return done == n ? elapsed : -1;
+}
+
+typedef enum { OPEN_ONLY, OPEN_VERIFY_ONE, OPEN_CODES_ALL, OPEN_POPULATE } OpenWork;
+
+static double time_keystore(const char *path, OpenWork work, int *codes, size_t lookup) {
+  double start = now_seconds();
+  Keystore keystore;
+  int flags = work == OPEN_POPULATE ? KEYSTORE_POPULATE : work == OPEN_VERIFY_ONE ? KEYSTORE_RANDOM : 0;
+  if (keystore_open(&keystore, path, flags)) {
+    return -1;
+  }
+  if (work == OPEN_VERIFY_ONE) {
+    sink += keystore_verify(&keystore, lookup, 1, "000000", 59);
+  } else if (work == OPEN_CODES_ALL) {
+    keystore_codes(&keystore, 0, keystore.count, 59, codes);
+    sink += codes[keystore.count - 1];
+  }
+  keystore_close(&keystore);
+  return now_seconds() - start;
+}
+
+static void print_times(const char *name, double cold, double cold_cached, double warm) {
+  printf("%-34s %11.3f ms %11.3f ms", name, cold * 1e3, warm * 1e3);
+  if (cold_cached > 0.01) {
+    printf("   (%.0f%% still cached when cold)", cold_cached * 100);
+  }
+  putchar('\n');
+}
+
+static int bench(size_t n, const char *prefix) {
+  char text[4096], keys[4096];
+  snprintf(text, sizeof(text), "%s.txt", prefix);
+  snprintf(keys, sizeof(keys), "%s.keys", prefix);
+
+  if (write_secrets(text, n)) {
+    return 1;
+  }
+  double start = now_seconds();
+  FILE *in = fopen(text, "r");
+  if (!in || import_file(keys, HMAC_SHA1, 6, 30, keystore_record_size(HMAC_SHA1), in)) {
+    return 1;
+  }
+  fclose(in);
+  double import = now_seconds() - start;
+
+  struct stat text_stat, keys_stat;
+  stat(text, &text_stat);
+  stat(keys, &keys_stat);
+  printf("%zu records: %.0f MB of base32, %.0f MB of keystore; import %.2f s (%.2f M records/s)\n\n",
+         n, text_stat.st_size / 1e6, keys_stat.st_size / 1e6, import, n / import / 1e6);
+
+  HMAC_SHA1_KEY *prepared = malloc(n * sizeof(*prepared));
+  int *codes = malloc(n * sizeof(*codes));
+  if (!prepared || !codes) {
+    fprintf(stderr, "totp_store: out of memory\n");
+    return 1;
+  }
+
+  printf("%-34s %14s %14s\n", "startup", "cold", "warm");
+  double cached = drop_cache(text);
+  double cold = time_text(text, n, prepared);
+  print_times("parse text + derive midstates", cold, cached, time_text(text, n, prepared));
+
+  static const struct {
+    const char *name;
+    OpenWork work;
+  } rows[] = {
+    { "keystore_open()", OPEN_ONLY },
+    { "keystore_open() + verify one", OPEN_VERIFY_ONE },
+    { "keystore_open() + every code", OPEN_CODES_ALL },
+    { "keystore_open(KEYSTORE_POPULATE)", OPEN_POPULATE },
+  };
+  for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); ++i) {
+    cached = drop_cache(keys);
+    cold = time_keystore(keys, rows[i].work, codes, n / 2);
+    // Warm: the whole file cached, as after any earlier run.
+    time_keystore(keys, OPEN_POPULATE, codes, n / 2);
+    print_times(rows[i].name, cold, cached, time_keystore(keys, rows[i].work, codes, n / 2));
+  }
+
+  memset(prepared, 0, n * sizeof(*prepared));
+  free(prepared);
+  free(codes);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage();
+  }
+  const char *command = argv[1];
+  argc--;
+  argv++;
+
+  HMACAlgorithm algorithm = HMAC_SHA1;
+  int digits = 6, period = 30, window = 1;
+  size_t record_size = 0, records = 10000000;
+  unsigned long tm = time(NULL);
+  const char *prefix = "bench_store";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "a:d:p:r:t:w:n:f:")) != -1) {
+    switch (opt) {
+      case 'a':
+        algorithm = parse_algorithm(optarg);
+        break;
+      case 'd':
+        digits = atoi(optarg);
+        break;
+      case 'p':
+        period = atoi(optarg);
+        break;
+      case 'r':
+        record_size = strtoul(optarg, NULL, 10);
+        break;
+      case 't':
+        tm = strtoul(optarg, NULL, 10);
+        break;
+      case 'w':
+        window = atoi(optarg);
+        break;
+      case 'n':
+        records = strtoul(optarg, NULL, 10);
+        break;
+      case 'f':
+        prefix = optarg;
+        break;
+      default:
+        usage();
+    }
+  }
+  argc -= optind;
+  argv += optind;
+
+  if (!strcmp(command, "import") && (argc == 1 || argc == 2)) {
+    if (digits < MIN_CODE_DIGITS || digits > MAX_CODE_DIGITS || period <= 0) {
+      usage();
+    }
+    if (!record_size) {
+      record_size = keystore_record_size(algorithm);
+    } else if (record_size < keystore_record_size(algorithm)) {
+      fprintf(stderr, "totp_store: keys of that algorithm need records of %zu bytes\n",
+              keystore_record_size(algorithm));
+      return 1;
+    }
+    FILE *in = stdin;
+    if (argc == 2 && !(in = fopen(argv[1], "r"))) {
+      perror(argv[1]);
+      return 1;
+    }
+    int status = import_file(argv[0], algorithm, digits, period, record_size, in);
+    if (in != stdin) {
+      fclose(in);
+    }
+    return status;
+  } else if (!strcmp(command, "codes") && argc == 1) {
+    return print_codes(argv[0], tm);
+  } else if (!strcmp(command, "verify") && argc == 3 && window >= 0) {
+    return verify(argv[0], strtoul(argv[1], NULL, 10), argv[2], window, tm);
+  } else if (!strcmp(command, "bench") && argc == 0 && records > 0) {
+    return bench(records, prefix);
+  }
+  usage();
+  return 2;
+}
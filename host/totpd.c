@@ -0,0 +1,610 @@
+// A local TOTP daemon: one keystore (keystore.h) held in memory, serving
+// code generation and verification over a Unix domain socket, so services
+// don't each link and feed their own copy of the core.
+//
+//   totpd [-t time] [-w window] [-b batch] [-i period] [-r entries] socket
+//         keystore
+//
+// The protocol is lines of text, any number of them in flight per
+// connection, answered in order:
+//
+//   G index          the record's code now, or ERR
+//   V index code     the matching step offset within window, or NO; with -r,
+//                    USED for a code already accepted
+//   S                "records requests batches", served so far
+//
+// Anything else gets ERR. time fixes the clock, for tests. With -i,
+// verification is a lookup in a code index (code_index.h) of the records with
+// that period, rolled forward by a thread of its own; other records are
+// verified from their midstates as before. With -r, each accepted code is
+// recorded in a replay cache (replay_cache.h) of room for entries codes, and
+// refused from then on until it expires; if the cache is full, the reply is
+// ERR.
+//
+// One thread runs an epoll loop. Each pass reads whatever every ready
+// connection has sent, parses up to batch complete lines across all of them,
+// and answers the lot with one keystore_codes_at() and one
+// keystore_verify_at(), so concurrent requests share the multi-buffer SHA1
+// kernels. Batches grow with the load on their own: nothing waits to fill
+// one. A connection whose replies aren't being read stops being read from,
+// and lines beyond a full batch wait for the next pass.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE // accept4()
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "generate.h"
+#include "code_index.h"
+#include "keystore.h"
+#include "replay_cache.h"
+#include "verify.h"
+
+#define MAX_BATCH   4096
+#define MAX_EVENTS  256
+#define INPUT_SIZE  4096
+#define OUTPUT_SIZE 65536 // Replies not yet read by the client; reading stops here
+#define MAX_REPLY   64
+
+// Verify results besides a step offset and VERIFY_NO_MATCH, with -r.
+#define VERIFY_USED    (VERIFY_NO_MATCH + 1)
+#define VERIFY_NO_ROOM (VERIFY_NO_MATCH + 2)
+
+typedef struct Connection {
+  int fd;
+  bool eof;    // The client has shut down its side
+  bool failed; // A read or write failed, or a line was too long: close it
+  bool queued; // On the pending list
+  uint32_t events; // What epoll is watching for
+  struct Connection *next_pending;
+  size_t input_used;
+  size_t output_sent, output_used;
+
+  char input[INPUT_SIZE];
+  char output[OUTPUT_SIZE];
+} Connection;
+
+typedef enum { REQUEST_GENERATE, REQUEST_VERIFY, REQUEST_STATS, REQUEST_BAD } RequestType;
+
+typedef struct {
+  Connection *connection;
+  RequestType type;
+  size_t index;
+  char code[MAX_CODE_DIGITS + 2]; // Longer codes are cut to one too long
+  int result;
+} Request;
+
+typedef struct {
+  int epoll;
+  int listener;
+  const Keystore *keystore;
+  const CodeIndex *index; // NULL without -i
+  ReplayCache *replays;   // NULL without -r
+  int window;
+  bool fixed_time;
+  unsigned long time;
+  size_t max_batch;
+
+  // Connections with complete lines still to parse, oldest first.
+  Connection *pending_head, *pending_tail;
+
+  Request batch[MAX_BATCH];
+  size_t indices[MAX_BATCH];
+  const char *codes[MAX_BATCH];
+  int results[MAX_BATCH];
+  size_t lanes[MAX_BATCH];
+
+  unsigned long long requests, batches;
+} Server;
+
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig) {
+  stopping = 1;
+}
+
+static void pending_push(Server *server, Connection *connection) {
+  if (connection->queued) {
+    return;
+  }
+  connection->queued = true;
+  connection->next_pending = NULL;
+  if (server->pending_tail) {
+    server->pending_tail->next_pending = connection;
+  } else {
+    server->pending_head = connection;
+  }
+  server->pending_tail = connection;
+}
+
+static Connection *pending_pop(Server *server) {
+  Connection *connection = server->pending_head;
+  if (connection) {
+    server->pending_head = connection->next_pending;
+    if (!server->pending_head) {
+      server->pending_tail = NULL;
+    }
+    connection->queued = false;
+  }
+  return connection;
+}
+
+static bool output_full(const Connection *connection) {
+  return connection->output_used + MAX_REPLY > OUTPUT_SIZE;
+}
+
+static bool has_line(const Connection *connection) {
+  return memchr(connection->input, '\n', connection->input_used) != NULL;
+}
+
+// Read while there's room for input and for the replies to it; write while
+// replies are waiting.
+static void update_events(Server *server, Connection *connection) {
+  uint32_t events = 0;
+  if (!connection->eof && !connection->failed && connection->input_used < INPUT_SIZE &&
+      !output_full(connection)) {
+    events |= EPOLLIN;
+  }
+  if (connection->output_sent < connection->output_used && !connection->failed) {
+    events |= EPOLLOUT;
+  }
+  if (events != connection->events) {
+    struct epoll_event event = { .events = events, .data.ptr = connection };
+    epoll_ctl(server->epoll, EPOLL_CTL_MOD, connection->fd, &event);
+    connection->events = events;
+  }
+}
+
+static void close_connection(Server *server, Connection *connection) {
+  epoll_ctl(server->epoll, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  free(connection);
+}
+
+// Whether connection is finished with: nothing left to read, parse or send.
+static bool connection_done(const Connection *connection) {
+  return connection->failed ||
+         (connection->eof && !has_line(connection) && connection->output_sent == connection->output_used);
+}
+
+static void accept_connections(Server *server) {
+  for (;;) {
+    int fd = accept4(server->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    Connection *connection = malloc(sizeof(*connection));
+    if (!connection) {
+      close(fd);
+      continue;
+    }
+    memset(connection, 0, offsetof(Connection, input));
+    connection->fd = fd;
+    connection->events = EPOLLIN;
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+    if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, fd, &event)) {
+      close(fd);
+      free(connection);
+    }
+  }
+}
+
+static void read_input(Connection *connection) {
+  while (connection->input_used < INPUT_SIZE) {
+    ssize_t n = read(connection->fd, connection->input + connection->input_used,
+                     INPUT_SIZE - connection->input_used);
+    if (n > 0) {
+      connection->input_used += n;
+    } else if (n == 0) {
+      connection->eof = true;
+      return;
+    } else {
+      if (errno != EAGAIN && errno != EINTR) {
+        connection->failed = true;
+      }
+      return;
+    }
+  }
+}
+
+static void write_output(Connection *connection) {
+  while (connection->output_sent < connection->output_used) {
+    ssize_t n = send(connection->fd, connection->output + connection->output_sent,
+                     connection->output_used - connection->output_sent, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        connection->failed = true;
+      }
+      break;
+    }
+    connection->output_sent += n;
+  }
+  if (connection->output_sent == connection->output_used) {
+    connection->output_sent = connection->output_used = 0;
+  } else if (connection->output_sent > OUTPUT_SIZE / 2) {
+    memmove(connection->output, connection->output + connection->output_sent,
+            connection->output_used - connection->output_sent);
+    connection->output_used -= connection->output_sent;
+    connection->output_sent = 0;
+  }
+}
+
+static void parse_request(char *line, Request *request) {
+  char *end;
+  request->type = REQUEST_BAD;
+  if (line[0] == 'S' && !line[1]) {
+    request->type = REQUEST_STATS;
+  } else if ((line[0] == 'G' || line[0] == 'V') && line[1] == ' ') {
+    request->index = strtoul(line + 2, &end, 10);
+    if (end == line + 2) {
+      return;
+    }
+    if (line[0] == 'G' && !*end) {
+      request->type = REQUEST_GENERATE;
+    } else if (line[0] == 'V' && *end == ' ') {
+      size_t length = strlen(end + 1);
+      if (length > MAX_CODE_DIGITS + 1) {
+        length = MAX_CODE_DIGITS + 1;
+      }
+      memcpy(request->code, end + 1, length);
+      request->code[length] = '\0';
+      request->type = REQUEST_VERIFY;
+    }
+  }
+}
+
+// Moves up to the batch's free space in complete lines from connection into
+// the batch. Returns whether any were left.
+static bool take_lines(Server *server, Connection *connection, size_t *n) {
+  size_t start = 0;
+  char *newline;
+  while (*n < server->max_batch && !output_full(connection) &&
+         (newline = memchr(connection->input + start, '\n', connection->input_used - start))) {
+    *newline = '\0';
+    if (newline > connection->input + start && newline[-1] == '\r') {
+      newline[-1] = '\0';
+    }
+    Request *request = &server->batch[(*n)++];
+    request->connection = connection;
+    parse_request(connection->input + start, request);
+    start = newline + 1 - connection->input;
+    // Replies are sized up front so a batch can't overrun the output buffer.
+    connection->output_used += MAX_REPLY;
+  }
+  memmove(connection->input, connection->input + start, connection->input_used - start);
+  connection->input_used -= start;
+  return has_line(connection);
+}
+
+static void run_batch(Server *server, size_t n) {
+  unsigned long tm = server->fixed_time ? server->time : (unsigned long)time(NULL);
+  size_t count;
+
+  count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (server->batch[i].type == REQUEST_GENERATE) {
+      server->indices[count] = server->batch[i].index;
+      server->lanes[count++] = i;
+    }
+  }
+  keystore_codes_at(server->keystore, server->indices, count, tm, server->results);
+  for (size_t i = 0; i < count; ++i) {
+    server->batch[server->lanes[i]].result = server->results[i];
+  }
+
+  count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (server->batch[i].type == REQUEST_VERIFY) {
+      server->indices[count] = server->batch[i].index;
+      server->codes[count] = server->batch[i].code;
+      server->lanes[count++] = i;
+    }
+  }
+  if (server->index) {
+    for (size_t i = 0; i < count; ++i) {
+      server->results[i] = code_index_verify(server->index, server->indices[i], server->codes[i], tm);
+    }
+  } else {
+    keystore_verify_at(server->keystore, server->indices, server->codes, count, server->window, tm,
+                       server->results);
+  }
+  for (size_t i = 0; i < count; ++i) {
+    int result = server->results[i];
+    if (server->replays && result != VERIFY_NO_MATCH) {
+      int period = keystore_record(server->keystore, server->indices[i])->period;
+      uint64_t step = tm / period + result;
+      switch (replay_cache_insert(server->replays, server->indices[i], step,
+                                  replay_expiry(step, period, server->window), tm)) {
+        case REPLAY_USED:
+          result = VERIFY_USED;
+          break;
+        case REPLAY_FULL:
+          result = VERIFY_NO_ROOM;
+          break;
+      }
+    }
+    server->batch[server->lanes[i]].result = result;
+  }
+
+  server->requests += n;
+  server->batches++;
+}
+
+// Replies in request order. take_lines() reserved MAX_REPLY for each; that's
+// given back here and the real reply written in its place.
+static void write_replies(Server *server, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    server->batch[i].connection->output_used -= MAX_REPLY;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    Request *request = &server->batch[i];
+    Connection *connection = request->connection;
+    char *out = connection->output + connection->output_used;
+    int length;
+    switch (request->type) {
+      case REQUEST_GENERATE:
+        if (request->result < 0) {
+          length = snprintf(out, MAX_REPLY, "ERR\n");
+        } else {
+          formatCode(request->result, keystore_record(server->keystore, request->index)->digits, out);
+          length = strlen(out);
+          out[length++] = '\n';
+        }
+        break;
+      case REQUEST_VERIFY:
+        if (request->result == VERIFY_NO_MATCH) {
+          length = snprintf(out, MAX_REPLY, "NO\n");
+        } else if (request->result == VERIFY_USED) {
+          length = snprintf(out, MAX_REPLY, "USED\n");
+        } else if (request->result == VERIFY_NO_ROOM) {
+          length = snprintf(out, MAX_REPLY, "ERR\n");
+        } else {
+          length = snprintf(out, MAX_REPLY, "%d\n", request->result);
+        }
+        break;
+      case REQUEST_STATS:
+        length = snprintf(out, MAX_REPLY, "%zu %llu %llu\n", server->keystore->count, server->requests,
+                          server->batches);
+        break;
+      default:
+        length = snprintf(out, MAX_REPLY, "ERR\n");
+    }
+    connection->output_used += length;
+  }
+}
+
+static void serve(Server *server) {
+  struct epoll_event events[MAX_EVENTS];
+  Connection *touched[MAX_BATCH];
+
+  while (!stopping) {
+    int ready = epoll_wait(server->epoll, events, MAX_EVENTS, server->pending_head ? 0 : -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      return;
+    }
+
+    size_t n_touched = 0;
+    for (int i = 0; i < ready; ++i) {
+      Connection *connection = events[i].data.ptr;
+      if (!connection) {
+        accept_connections(server);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        read_input(connection);
+      }
+      if (events[i].events & EPOLLOUT) {
+        write_output(connection);
+      }
+      if (connection->input_used == INPUT_SIZE && !has_line(connection)) {
+        connection->failed = true; // A line longer than any request
+      }
+      if (has_line(connection)) {
+        pending_push(server, connection);
+      } else if (!connection->queued && n_touched < MAX_BATCH) {
+        touched[n_touched++] = connection;
+      }
+    }
+
+    // Lines from connections in the order they became ready, each giving up
+    // its turn once it has had some of the batch.
+    size_t n = 0;
+    Connection *requeue[MAX_BATCH];
+    size_t n_requeue = 0;
+    while (n < server->max_batch && server->pending_head && n_touched < MAX_BATCH) {
+      Connection *connection = pending_pop(server);
+      touched[n_touched++] = connection;
+      if (!connection->failed && take_lines(server, connection, &n) && !output_full(connection)) {
+        // Back on the list after this pass, behind the rest.
+        requeue[n_requeue++] = connection;
+      }
+    }
+    if (n) {
+      run_batch(server, n);
+      write_replies(server, n);
+    }
+    for (size_t i = 0; i < n_requeue; ++i) {
+      pending_push(server, requeue[i]);
+    }
+
+    for (size_t i = 0; i < n_touched; ++i) {
+      Connection *connection = touched[i];
+      if (connection->output_sent < connection->output_used) {
+        write_output(connection);
+      }
+      // A connection that was skipped for a full output buffer goes back on
+      // the list once it drains.
+      if (!connection->queued && has_line(connection) && !output_full(connection) && !connection->failed) {
+        pending_push(server, connection);
+      }
+      if (connection_done(connection) && !connection->queued) {
+        // It may be in touched more than once; close it at its last entry.
+        bool later = false;
+        for (size_t j = i + 1; j < n_touched && !later; ++j) {
+          later = touched[j] == connection;
+        }
+        if (!later) {
+          close_connection(server, connection);
+        }
+        continue;
+      }
+      update_events(server, connection);
+    }
+  }
+}
+
+static int listen_on(const char *path) {
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "totpd: socket path too long\n");
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) || listen(fd, SOMAXCONN)) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: totpd [-t time] [-w window] [-b batch] [-i period] [-r entries] socket\n"
+                  "             keystore\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  static Server server;
+  server.window = 1;
+  server.max_batch = 1024;
+  int index_period = 0;
+  size_t replay_entries = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:w:b:i:r:")) != -1) {
+    switch (opt) {
+      case 't':
+        server.fixed_time = true;
+        server.time = strtoul(optarg, NULL, 10);
+        break;
+      case 'w':
+        server.window = atoi(optarg);
+        break;
+      case 'b':
+        server.max_batch = strtoul(optarg, NULL, 10);
+        break;
+      case 'i':
+        index_period = atoi(optarg);
+        if (index_period <= 0) {
+          usage();
+        }
+        break;
+      case 'r':
+        replay_entries = strtoul(optarg, NULL, 10);
+        if (!replay_entries) {
+          usage();
+        }
+        break;
+      default:
+        usage();
+    }
+  }
+  if (argc - optind != 2 || server.window < 0 || server.max_batch < 1 || server.max_batch > MAX_BATCH) {
+    usage();
+  }
+  const char *path = argv[optind];
+
+  // Every record read in now, not on the first request for it.
+  Keystore keystore;
+  if (keystore_open(&keystore, argv[optind + 1], KEYSTORE_POPULATE)) {
+    perror(argv[optind + 1]);
+    return 1;
+  }
+  server.keystore = &keystore;
+
+  // On a fixed clock the index is filled once and never rolls.
+  static CodeIndex index;
+  if (index_period) {
+    if (code_index_init(&index, &keystore, index_period, server.window,
+                        server.fixed_time ? server.time : (unsigned long)time(NULL))) {
+      fprintf(stderr, "totpd: no memory for the code index\n");
+      return 1;
+    }
+    if (!server.fixed_time && code_index_start(&index)) {
+      fprintf(stderr, "totpd: can't start the code index roller\n");
+      return 1;
+    }
+    server.index = &index;
+  }
+
+  // One thread serves, so one shard will do.
+  static ReplayCache replays;
+  if (replay_entries) {
+    if (replay_cache_init(&replays, replay_entries, 1)) {
+      fprintf(stderr, "totpd: no memory for the replay cache\n");
+      return 1;
+    }
+    server.replays = &replays;
+  }
+
+  if ((server.listener = listen_on(path)) < 0) {
+    return 1;
+  }
+  server.epoll = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+  if (server.epoll < 0 || epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.listener, &event)) {
+    perror("epoll");
+    return 1;
+  }
+
+  struct sigaction action = { .sa_handler = on_signal };
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  serve(&server);
+
+  unlink(path);
+  close(server.listener);
+  close(server.epoll);
+  if (server.index) {
+    code_index_free(&index);
+  }
+  if (server.replays) {
+    replay_cache_free(&replays);
+  }
+  keystore_close(&keystore);
+  return 0;
+}
@@ -0,0 +1,318 @@
+// Load generator for totpd.
+//
+//   totpd_load [-c connections] [-d depth] [-n requests] [-m generate|verify]
+//              socket
+//   totpd_load -q socket
+//
+// Opens connections connections, one thread each, and keeps depth requests in
+// flight on each until n requests in all have been answered. Each request is
+// for a random record; verify requests carry a wrong code, so every step of
+// the window is tried. Prints requests/s, the p50, p99 and worst latency from
+// sending a request to reading its reply, and the mean batch size totpd ran
+// them in. Exits 1 if any reply was ERR.
+//
+// -q instead sends the lines on stdin and prints the replies, for scripts.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CONNECTIONS 1024
+#define MAX_DEPTH       4096
+#define REQUEST_SIZE    32
+#define READ_SIZE       65536
+
+typedef struct {
+  const char *path;
+  bool verify;
+  size_t records;
+  int depth;
+  size_t n; // Requests on this connection
+  uint64_t seed;
+
+  uint64_t *latencies; // ns, one per request
+  size_t errors;
+  bool failed;
+} Client;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int connect_to(const char *path) {
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "totpd_load: socket path too long\n");
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+    perror(path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+static bool write_all(int fd, const char *data, size_t length) {
+  while (length) {
+    ssize_t n = write(fd, data, length);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    length -= n;
+  }
+  return true;
+}
+
+static uint64_t next_random(uint64_t *x) {
+  *x ^= *x << 13;
+  *x ^= *x >> 7;
+  *x ^= *x << 17;
+  return *x;
+}
+
+static void *run_client(void *p) {
+  Client *client = p;
+  int fd = connect_to(client->path);
+  if (fd < 0) {
+    client->failed = true;
+    return NULL;
+  }
+
+  static __thread char out[MAX_DEPTH * REQUEST_SIZE];
+  static __thread char in[READ_SIZE];
+  static __thread uint64_t sent_at[MAX_DEPTH];
+  size_t sent = 0, received = 0, in_used = 0;
+
+  while (received < client->n) {
+    // Top up to depth in flight, all in one write.
+    size_t out_used = 0, first = sent;
+    while (sent < client->n && sent - received < (size_t)client->depth) {
+      size_t index = next_random(&client->seed) % client->records;
+      out_used += sprintf(out + out_used, client->verify ? "V %zu 000000\n" : "G %zu\n", index);
+      sent++;
+    }
+    if (out_used) {
+      uint64_t now = now_ns();
+      for (size_t i = first; i < sent; ++i) {
+        sent_at[i % client->depth] = now;
+      }
+      if (!write_all(fd, out, out_used)) {
+        client->failed = true;
+        break;
+      }
+    }
+
+    ssize_t n = read(fd, in + in_used, sizeof(in) - in_used);
+    if (n <= 0) {
+      client->failed = true;
+      break;
+    }
+    in_used += n;
+    uint64_t now = now_ns();
+    char *start = in, *newline;
+    while ((newline = memchr(start, '\n', in + in_used - start))) {
+      client->latencies[received] = now - sent_at[received % client->depth];
+      client->errors += !strncmp(start, "ERR", 3);
+      received++;
+      start = newline + 1;
+    }
+    in_used = in + in_used - start;
+    memmove(in, start, in_used);
+  }
+  close(fd);
+  return NULL;
+}
+
+// totpd's "records requests batches".
+static bool query_stats(const char *path, size_t *records, unsigned long long *requests,
+                        unsigned long long *batches) {
+  int fd = connect_to(path);
+  if (fd < 0) {
+    return false;
+  }
+  char reply[128];
+  size_t used = 0;
+  ssize_t n = 0;
+  bool ok = write_all(fd, "S\n", 2);
+  while (ok && used < sizeof(reply) - 1 && !memchr(reply, '\n', used) &&
+         (n = read(fd, reply + used, sizeof(reply) - 1 - used)) > 0) {
+    used += n;
+  }
+  close(fd);
+  reply[used] = '\0';
+  return ok && sscanf(reply, "%zu %llu %llu", records, requests, batches) == 3;
+}
+
+// Lines from stdin out, replies to stdout, until totpd closes the connection.
+static int query(const char *path) {
+  int fd = connect_to(path);
+  if (fd < 0) {
+    return 1;
+  }
+  char buffer[READ_SIZE];
+  struct pollfd fds[2] = { { .fd = 0, .events = POLLIN }, { .fd = fd, .events = POLLIN } };
+  for (;;) {
+    if (poll(fds, 2, -1) < 0) {
+      perror("poll");
+      return 1;
+    }
+    if (fds[0].revents) {
+      ssize_t n = read(0, buffer, sizeof(buffer));
+      if (n > 0) {
+        if (!write_all(fd, buffer, n)) {
+          perror(path);
+          return 1;
+        }
+      } else {
+        shutdown(fd, SHUT_WR);
+        fds[0].fd = -1;
+      }
+    }
+    if (fds[1].revents) {
+      ssize_t n = read(fd, buffer, sizeof(buffer));
+      if (n <= 0) {
+        break;
+      }
+      fwrite(buffer, 1, n, stdout);
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: totpd_load [-c connections] [-d depth] [-n requests] [-m generate|verify] socket\n"
+          "       totpd_load -q socket\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  int connections = 4, depth = 16;
+  size_t total = 1000000;
+  bool verify = false, query_mode = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:d:n:m:q")) != -1) {
+    switch (opt) {
+      case 'c':
+        connections = atoi(optarg);
+        break;
+      case 'd':
+        depth = atoi(optarg);
+        break;
+      case 'n':
+        total = strtoul(optarg, NULL, 10);
+        break;
+      case 'm':
+        if (!strcmp(optarg, "verify")) {
+          verify = true;
+        } else if (strcmp(optarg, "generate")) {
+          usage();
+        }
+        break;
+      case 'q':
+        query_mode = true;
+        break;
+      default:
+        usage();
+    }
+  }
+  if (argc - optind != 1 || connections < 1 || connections > MAX_CONNECTIONS || depth < 1 ||
+      depth > MAX_DEPTH || total < (size_t)connections) {
+    usage();
+  }
+  const char *path = argv[optind];
+  if (query_mode) {
+    return query(path);
+  }
+
+  size_t records;
+  unsigned long long requests_before, batches_before, requests_after, batches_after;
+  if (!query_stats(path, &records, &requests_before, &batches_before) || !records) {
+    fprintf(stderr, "totpd_load: no records behind %s\n", path);
+    return 1;
+  }
+
+  static Client clients[MAX_CONNECTIONS];
+  static pthread_t threads[MAX_CONNECTIONS];
+  uint64_t *latencies = malloc(total * sizeof(*latencies));
+  if (!latencies) {
+    fprintf(stderr, "totpd_load: out of memory\n");
+    return 1;
+  }
+  size_t offset = 0;
+  for (int i = 0; i < connections; ++i) {
+    size_t n = total * (i + 1) / connections - total * i / connections;
+    clients[i] = (Client){ path, verify, records, depth, n, 0x9E3779B97F4A7C15ull * (i + 1),
+                           latencies + offset, 0, false };
+    offset += n;
+  }
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < connections; ++i) {
+    pthread_create(&threads[i], NULL, run_client, &clients[i]);
+  }
+  size_t errors = 0;
+  bool failed = false;
+  for (int i = 0; i < connections; ++i) {
+    pthread_join(threads[i], NULL);
+    errors += clients[i].errors;
+    failed |= clients[i].failed;
+  }
+  double seconds = (now_ns() - start) / 1e9;
+  if (failed) {
+    fprintf(stderr, "totpd_load: a connection failed\n");
+    return 1;
+  }
+  query_stats(path, &records, &requests_after, &batches_after);
+
+  qsort(latencies, total, sizeof(*latencies), compare_u64);
+  printf("%d connections x %d in flight, %zu %s requests over %zu records\n", connections, depth, total,
+         verify ? "verify" : "generate", records);
+  printf("  requests/s   p50 us   p99 us   max us   mean batch\n");
+  printf("  %10.0f %8.1f %8.1f %8.1f   %10.1f\n", total / seconds, latencies[total / 2] / 1e3,
+         latencies[total * 99 / 100] / 1e3, latencies[total - 1] / 1e3,
+         batches_after > batches_before
+             ? (double)(requests_after - requests_before) / (batches_after - batches_before)
+             : 0.0);
+  free(latencies);
+  if (errors) {
+    fprintf(stderr, "totpd_load: %zu ERR replies\n", errors);
+    return 1;
+  }
+  return 0;
+}
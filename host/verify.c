@@ -0,0 +1,151 @@
+// Server-side TOTP verification.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include "generate.h"
+#include "generate_batch.h"
+#include "verify.h"
+
+#define VERIFY_CHUNK 256
+
+// Whether it's well-formed isn't secret, so this may return early.
+long parseCode(const char *code, int digits) {
+  if (digits < MIN_CODE_DIGITS || digits > MAX_CODE_DIGITS) {
+    return -1;
+  }
+  long value = 0;
+  for (int i = 0; i < digits; ++i) {
+    if (code[i] < '0' || code[i] > '9') {
+      return -1;
+    }
+    value = value * 10 + (code[i] - '0');
+  }
+  return code[digits] ? -1 : value;
+}
+
+// 1 if a == b, else 0, without a branch on either.
+static int code_equal(uint32_t a, uint32_t b) {
+  return ((uint64_t)(a ^ b) - 1) >> 63;
+}
+
+// The nth step offset to try: 0, -1, 1, -2, 2...
+static int nth_offset(int n) {
+  return n & 1 ? -(n + 1) / 2 : n / 2;
+}
+
+// Whether the step at offset exists - no counters before the epoch.
+static int step_valid(unsigned long step, int offset) {
+  return offset >= 0 || step >= (unsigned long)-offset;
+}
+
+int verifyCodeWithKey(const VerifyParams *params, const HMAC_KEY *key,
+                      const char *code, unsigned long tm) {
+  long candidate = parseCode(code, params->digits);
+  if (candidate < 0 || params->period <= 0 || params->window < 0) {
+    return VERIFY_NO_MATCH;
+  }
+  unsigned long step = tm / params->period;
+  for (int n = 0; n <= 2 * params->window; ++n) {
+    int offset = nth_offset(n);
+    if (step_valid(step, offset) &&
+        code_equal(generateCodeWithKey(params->algorithm, key, step + offset, params->digits), candidate)) {
+      return offset;
+    }
+  }
+  return VERIFY_NO_MATCH;
+}
+
+int verifyCode(const VerifyParams *params, const uint8_t *secret, int secret_length,
+               const char *code, unsigned long tm) {
+  HMAC_KEY key;
+  hmac_prepare(params->algorithm, &key, secret, secret_length);
+  int offset = verifyCodeWithKey(params, &key, code, tm);
+  memset(&key, 0, sizeof(key));
+  return offset;
+}
+
+// Up to VERIFY_CHUNK SHA1 requests, by index into requests.
+static void verify_sha1_chunk(const VerifyRequest requests[], const size_t indices[], size_t n,
+                              unsigned long tm, int offsets[]) {
+  const SHA1_MB_KERNEL *kernel = sha1_mb_best();
+  HMAC_SHA1_KEY keys[VERIFY_CHUNK];
+  uint64_t counters[VERIFY_CHUNK];
+  uint32_t truncated[VERIFY_CHUNK];
+  size_t lanes[VERIFY_CHUNK]; // Which request each lane is for
+  long candidates[VERIFY_CHUNK];
+
+  int widest = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const VerifyParams *params = &requests[indices[i]].params;
+    candidates[i] = parseCode(requests[indices[i]].code, params->digits);
+    if (params->window > widest) {
+      widest = params->window;
+    }
+  }
+
+  for (int k = 0; k <= 2 * widest; ++k) {
+    int offset = nth_offset(k);
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+      const VerifyRequest *request = &requests[indices[i]];
+      unsigned long step = request->params.period > 0 ? tm / request->params.period : 0;
+      if (offsets[indices[i]] != VERIFY_NO_MATCH || candidates[i] < 0 || request->params.period <= 0 ||
+          k > 2 * request->params.window || !step_valid(step, offset)) {
+        continue;
+      }
+      keys[count] = request->key->sha1;
+      counters[count] = step + offset;
+      lanes[count++] = i;
+    }
+    if (!count) {
+      continue;
+    }
+    hmac_sha1_counter_batch(kernel, keys, counters, 0, count, truncated);
+    for (size_t lane = 0; lane < count; ++lane) {
+      size_t i = lanes[lane];
+      int digits = requests[indices[i]].params.digits;
+      if (code_equal(reduceCode(truncated[lane], digits), candidates[i])) {
+        offsets[indices[i]] = offset;
+      }
+    }
+  }
+  memset(keys, 0, sizeof(keys));
+}
+
+size_t verifyCodes(const VerifyRequest requests[], size_t n, unsigned long tm, int offsets[]) {
+  size_t sha1[VERIFY_CHUNK];
+  size_t pending = 0;
+  for (size_t i = 0; i < n; ++i) {
+    offsets[i] = VERIFY_NO_MATCH;
+    if (requests[i].params.algorithm != HMAC_SHA1) {
+      offsets[i] = verifyCodeWithKey(&requests[i].params, requests[i].key, requests[i].code, tm);
+      continue;
+    }
+    sha1[pending++] = i;
+    if (pending == VERIFY_CHUNK) {
+      verify_sha1_chunk(requests, sha1, pending, tm, offsets);
+      pending = 0;
+    }
+  }
+  if (pending) {
+    verify_sha1_chunk(requests, sha1, pending, tm, offsets);
+  }
+
+  size_t matched = 0;
+  for (size_t i = 0; i < n; ++i) {
+    matched += offsets[i] != VERIFY_NO_MATCH;
+  }
+  return matched;
+}
@@ -0,0 +1,64 @@
+// Server-side TOTP verification: checking a code someone typed in against
+// the steps around the current one, on top of the same core as the watch.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef VERIFY_H__
+#define VERIFY_H__
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hmac.h"
+
+// Returned in place of a step offset when no step in the window matches, or
+// the code isn't digits decimal digits.
+#define VERIFY_NO_MATCH INT_MIN
+
+typedef struct {
+  HMACAlgorithm algorithm;
+  int digits; // MIN_CODE_DIGITS to MAX_CODE_DIGITS
+  int period; // Seconds
+  int window; // Steps either side of the current one also accepted
+} VerifyParams;
+
+// Checks code against the steps within params->window of tm's, nearest
+// first, stopping at the first match. Returns that step's offset from tm's,
+// or VERIFY_NO_MATCH. The midstates are derived once for the whole window,
+// and codes are compared in constant time; only whether and where a code
+// matched shows in the timing.
+int verifyCode(const VerifyParams *params, const uint8_t *secret, int secret_length,
+               const char *code, unsigned long tm);
+
+// As verifyCode(), from midstates computed by hmac_prepare(), so a server can
+// keep them per user and skip the key blocks altogether.
+int verifyCodeWithKey(const VerifyParams *params, const HMAC_KEY *key,
+                      const char *code, unsigned long tm);
+
+// The code as a number, or -1 if it isn't exactly digits decimal digits.
+long parseCode(const char *code, int digits);
+
+typedef struct {
+  VerifyParams params;
+  const HMAC_KEY *key;
+  const char *code;
+} VerifyRequest;
+
+// offsets[i] = verifyCodeWithKey(&requests[i].params, requests[i].key,
+// requests[i].code, tm). SHA1 requests go through the multi-buffer kernels a
+// step offset at a time, only those still unmatched moving on to the next.
+// Returns how many matched.
+size_t verifyCodes(const VerifyRequest requests[], size_t n, unsigned long tm, int offsets[]);
+
+#endif
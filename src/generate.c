@@ -39,32 +39,95 @@
 #include "sha1.h"
 #include "hmac.h"
 
-#define VERIFICATION_CODE_MODULUS (1000*1000) // Six digits
-
-int generateCode(const uint8_t *secret, const uint8_t secret_length, unsigned long tm) {
-  uint8_t challenge[8];
-  for (int i = 8; i--; tm >>= 8) {
-    challenge[i] = tm;
+// The 31 bits at byte offset of a digest given as host-order 32 bit words.
+static unsigned int truncate_at(const uint32_t *hash, int offset) {
+  // Extract the four big-endian bytes at that offset straight from the words.
+  unsigned int truncatedHash = hash[offset >> 2];
+  int shift = (offset & 3) * 8;
+  if (shift) {
+    truncatedHash = (truncatedHash << shift) | (hash[(offset >> 2) + 1] >> (32 - shift));
   }
 
-  // Compute the HMAC_SHA1 of the secrete and the challenge.
-  uint8_t hash[SHA1_DIGEST_LENGTH];
-  hmac_sha1(secret, secret_length, challenge, 8, hash, SHA1_DIGEST_LENGTH);
+  return truncatedHash & 0x7FFFFFFF;
+}
+
+// floor(x / 10^digits) == (x * magic) >> shift for all x < 2^31, indexed by
+// digits - MIN_CODE_DIGITS. The watch would otherwise call the library divide.
+static const struct {
+  uint32_t modulus;
+  uint32_t magic;
+  uint8_t shift;
+} code_reciprocals[MAX_CODE_DIGITS - MIN_CODE_DIGITS + 1] = {
+  {1000000, 0x431BDE83, 50},
+  {10000000, 0x6B5FCA6B, 54},
+  {100000000, 0x55E63B89, 57},
+};
+
+unsigned int reduceCode(unsigned int truncatedHash, int digits) {
+  const int idx = digits - MIN_CODE_DIGITS;
+  uint32_t quotient = ((uint64_t)truncatedHash * code_reciprocals[idx].magic) >> code_reciprocals[idx].shift;
+  return truncatedHash - quotient * code_reciprocals[idx].modulus;
+}
+
+void formatCode(unsigned int code, int digits, char *out) {
+  out[digits] = 0;
+  while (digits--) {
+    // 0xCCCCCCCD / 2^35 rounds up to 1/10 closely enough to be exact for any 32 bit value.
+    uint32_t quotient = ((uint64_t)code * 0xCCCCCCCD) >> 35;
+    out[digits] = '0' + (code - quotient * 10);
+    code = quotient;
+  }
+}
 
+unsigned int truncateHash(const uint32_t hash[5]) {
   // Pick the offset where to sample our hash value for the actual verification
   // code.
-  int offset = hash[SHA1_DIGEST_LENGTH - 1] & 0xF;
+  return truncate_at(hash, hash[4] & 0xF);
+}
 
-  // Compute the truncated hash in a byte-order independent loop.
-  unsigned int truncatedHash = 0;
-  for (int i = 0; i < 4; ++i) {
-    truncatedHash <<= 8;
-    truncatedHash  |= hash[offset + i];
-  }
+int generateCodeFromKey(const HMAC_SHA1_KEY *key, unsigned long tm) {
+  // The challenge is the 8 byte big-endian time step; hand it over as words so
+  // the single-block HMAC path never has to touch bytes.
+  uint32_t hash[5];
+  hmac_sha1_counter(key, (uint32_t)((uint64_t)tm >> 32), (uint32_t)tm, hash);
 
   // Truncate to a smaller number of digits.
-  truncatedHash &= 0x7FFFFFFF;
-  truncatedHash %= VERIFICATION_CODE_MODULUS;
+  return truncateHash(hash) % VERIFICATION_CODE_MODULUS;
+}
 
-  return truncatedHash;
+int generateCodeWithKey(HMACAlgorithm algorithm, const HMAC_KEY *key, unsigned long tm, int digits) {
+  uint32_t hash[8];
+  unsigned int truncatedHash;
+
+  switch (algorithm) {
+    case HMAC_SHA256:
+      hmac_sha256_counter(&key->sha256, (uint32_t)((uint64_t)tm >> 32), (uint32_t)tm, hash);
+      truncatedHash = truncate_at(hash, hash[7] & 0xF);
+      break;
+    case HMAC_SHA512: {
+      uint64_t hash64[8];
+      hmac_sha512_counter(&key->sha512, tm, hash64);
+      // The sampled bytes always lie in the first 19 bytes of the digest.
+      for (int i = 0; i < 3; ++i) {
+        hash[2 * i] = hash64[i] >> 32;
+        hash[2 * i + 1] = hash64[i];
+      }
+      truncatedHash = truncate_at(hash, hash64[7] & 0xF);
+      break;
+    }
+    default:
+      hmac_sha1_counter(&key->sha1, (uint32_t)((uint64_t)tm >> 32), (uint32_t)tm, hash);
+      truncatedHash = truncateHash(hash);
+      break;
+  }
+
+  return reduceCode(truncatedHash, digits);
+}
+
+int generateCode(const uint8_t *secret, const uint8_t secret_length, unsigned long tm) {
+  HMAC_SHA1_KEY key;
+  hmac_sha1_prepare(&key, secret, secret_length);
+  int code = generateCodeFromKey(&key, tm);
+  memset(&key, 0, sizeof(key));
+  return code;
 }
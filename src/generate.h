@@ -35,5 +35,29 @@
 // limitations under the License.
 
 #include "pebble.h"
+#include "hmac.h"
 
-int generateCode(const uint8_t *key, const uint8_t key_length, unsigned long tm);
\ No newline at end of file
+#define VERIFICATION_CODE_MODULUS (1000*1000) // Six digits
+
+#define MIN_CODE_DIGITS 6
+#define MAX_CODE_DIGITS 8
+
+int generateCode(const uint8_t *key, const uint8_t key_length, unsigned long tm);
+
+// As generateCode(), but starting from midstates computed by hmac_sha1_prepare().
+int generateCodeFromKey(const HMAC_SHA1_KEY *key, unsigned long tm);
+
+// The code of MIN_CODE_DIGITS to MAX_CODE_DIGITS digits for any algorithm,
+// from midstates computed by hmac_prepare().
+int generateCodeWithKey(HMACAlgorithm algorithm, const HMAC_KEY *key, unsigned long tm, int digits);
+
+// truncatedHash modulo 10^digits, by reciprocal multiplication rather than a
+// divide. Exact for every truncatedHash below 2^31.
+unsigned int reduceCode(unsigned int truncatedHash, int digits);
+
+// Writes code as exactly digits zero-padded decimal characters plus a NUL.
+void formatCode(unsigned int code, int digits, char *out);
+
+// RFC 4226 dynamic truncation of a digest given as five host-order words:
+// the 31 bits sampled at the offset named by its low nibble.
+unsigned int truncateHash(const uint32_t hash[5]);
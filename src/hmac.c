@@ -19,6 +19,205 @@
 
 #include "hmac.h"
 #include "sha1.h"
+#include "sha256.h"
+#include "sha512.h"
+
+int hmac_key_size(HMACAlgorithm algorithm) {
+  switch (algorithm) {
+    case HMAC_SHA256:
+      return sizeof(HMAC_SHA256_KEY);
+    case HMAC_SHA512:
+      return sizeof(HMAC_SHA512_KEY);
+    default:
+      return sizeof(HMAC_SHA1_KEY);
+  }
+}
+
+void hmac_prepare(HMACAlgorithm algorithm, HMAC_KEY *hmac_key,
+                  const uint8_t *key, int keyLength) {
+  switch (algorithm) {
+    case HMAC_SHA256:
+      hmac_sha256_prepare(&hmac_key->sha256, key, keyLength);
+      break;
+    case HMAC_SHA512:
+      hmac_sha512_prepare(&hmac_key->sha512, key, keyLength);
+      break;
+    default:
+      hmac_sha1_prepare(&hmac_key->sha1, key, keyLength);
+      break;
+  }
+}
+
+void hmac_sha1_prepare(HMAC_SHA1_KEY *hmac_key,
+                       const uint8_t *key, int keyLength) {
+  // One 64 byte buffer serves as the hashed key, the inner key block and the
+  // outer key block in turn, to keep the stack small on the watch.
+  uint32_t block[16];
+  if (keyLength > 64) {
+    // The key can be no bigger than 64 bytes. If it is, we'll hash it down to
+    // 20 bytes - once per key rather than once per message.
+    SHA1_INFO ctx;
+    sha1_init(&ctx);
+    sha1_update(&ctx, key, keyLength);
+    sha1_final(&ctx, (uint8_t *)block);
+    memset(&ctx, 0, sizeof(ctx));
+    key = (const uint8_t *)block;
+    keyLength = SHA1_DIGEST_LENGTH;
+  }
+
+  // The key for the inner digest is derived from our key, by padding the key
+  // the full length of 64 bytes, and then XOR'ing each byte with 0x36. Each
+  // word only reads the key bytes it replaces, so this works in place too.
+  for (int i = 0; i < 16; ++i) {
+    uint32_t word = 0;
+    for (int j = 4 * i; j < 4 * i + 4; ++j) {
+      word = (word << 8) | (j < keyLength ? key[j] : 0);
+    }
+    block[i] = word ^ 0x36363636;
+  }
+  memcpy(hmac_key->inner, sha1_initial_digest, sizeof(hmac_key->inner));
+  sha1_compress(hmac_key->inner, block);
+
+  // Likewise for the outer key with 0x5C.
+  for (int i = 0; i < 16; ++i) {
+    block[i] ^= 0x36363636 ^ 0x5C5C5C5C;
+  }
+  memcpy(hmac_key->outer, sha1_initial_digest, sizeof(hmac_key->outer));
+  sha1_compress(hmac_key->outer, block);
+
+  // Zero out all internal data structures
+  memset(block, 0, sizeof(block));
+}
+
+void hmac_sha1_counter(const HMAC_SHA1_KEY *hmac_key,
+                       uint32_t counter_hi, uint32_t counter_lo,
+                       uint32_t result[5]) {
+  // Inner block: 8 message bytes, the 0x80 terminator and the bit length of
+  // key block plus message, (64 + 8) * 8.
+  uint32_t block[16] = {
+    counter_hi, counter_lo, 0x80000000, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, (64 + 8) * 8
+  };
+  memcpy(result, hmac_key->inner, 5 * sizeof(uint32_t));
+  sha1_compress(result, block);
+
+  // Outer block: the 20 byte inner digest, terminator and (64 + 20) * 8.
+  memcpy(block, result, 5 * sizeof(uint32_t));
+  block[5] = 0x80000000;
+  block[6] = 0;
+  block[7] = 0;
+  block[15] = (64 + SHA1_DIGEST_LENGTH) * 8;
+  memcpy(result, hmac_key->outer, 5 * sizeof(uint32_t));
+  sha1_compress(result, block);
+
+  memset(block, 0, sizeof(block));
+}
+
+void hmac_sha256_prepare(HMAC_SHA256_KEY *hmac_key,
+                         const uint8_t *key, int keyLength) {
+  // As in hmac_sha1_prepare(), one buffer holds the hashed key and both key
+  // blocks in turn.
+  uint32_t block[16];
+  if (keyLength > SHA256_BLOCKSIZE) {
+    SHA256_INFO ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, key, keyLength);
+    sha256_final(&ctx, (uint8_t *)block);
+    memset(&ctx, 0, sizeof(ctx));
+    key = (const uint8_t *)block;
+    keyLength = SHA256_DIGEST_LENGTH;
+  }
+
+  for (int i = 0; i < 16; ++i) {
+    uint32_t word = 0;
+    for (int j = 4 * i; j < 4 * i + 4; ++j) {
+      word = (word << 8) | (j < keyLength ? key[j] : 0);
+    }
+    block[i] = word ^ 0x36363636;
+  }
+  memcpy(hmac_key->inner, sha256_initial_digest, sizeof(hmac_key->inner));
+  sha256_compress(hmac_key->inner, block);
+
+  for (int i = 0; i < 16; ++i) {
+    block[i] ^= 0x36363636 ^ 0x5C5C5C5C;
+  }
+  memcpy(hmac_key->outer, sha256_initial_digest, sizeof(hmac_key->outer));
+  sha256_compress(hmac_key->outer, block);
+
+  memset(block, 0, sizeof(block));
+}
+
+void hmac_sha256_counter(const HMAC_SHA256_KEY *hmac_key,
+                         uint32_t counter_hi, uint32_t counter_lo,
+                         uint32_t result[8]) {
+  uint32_t block[16] = {
+    counter_hi, counter_lo, 0x80000000, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, (SHA256_BLOCKSIZE + 8) * 8
+  };
+  memcpy(result, hmac_key->inner, 8 * sizeof(uint32_t));
+  sha256_compress(result, block);
+
+  // Outer block: the 32 byte inner digest, terminator and (64 + 32) * 8.
+  memcpy(block, result, 8 * sizeof(uint32_t));
+  block[8] = 0x80000000;
+  block[15] = (SHA256_BLOCKSIZE + SHA256_DIGEST_LENGTH) * 8;
+  memcpy(result, hmac_key->outer, 8 * sizeof(uint32_t));
+  sha256_compress(result, block);
+
+  memset(block, 0, sizeof(block));
+}
+
+void hmac_sha512_prepare(HMAC_SHA512_KEY *hmac_key,
+                         const uint8_t *key, int keyLength) {
+  uint64_t block[16];
+  if (keyLength > SHA512_BLOCKSIZE) {
+    SHA512_INFO ctx;
+    sha512_init(&ctx);
+    sha512_update(&ctx, key, keyLength);
+    sha512_final(&ctx, (uint8_t *)block);
+    memset(&ctx, 0, sizeof(ctx));
+    key = (const uint8_t *)block;
+    keyLength = SHA512_DIGEST_LENGTH;
+  }
+
+  for (int i = 0; i < 16; ++i) {
+    uint64_t word = 0;
+    for (int j = 8 * i; j < 8 * i + 8; ++j) {
+      word = (word << 8) | (j < keyLength ? key[j] : 0);
+    }
+    block[i] = word ^ 0x3636363636363636ULL;
+  }
+  memcpy(hmac_key->inner, sha512_initial_digest, sizeof(hmac_key->inner));
+  sha512_compress(hmac_key->inner, block);
+
+  for (int i = 0; i < 16; ++i) {
+    block[i] ^= 0x3636363636363636ULL ^ 0x5C5C5C5C5C5C5C5CULL;
+  }
+  memcpy(hmac_key->outer, sha512_initial_digest, sizeof(hmac_key->outer));
+  sha512_compress(hmac_key->outer, block);
+
+  memset(block, 0, sizeof(block));
+}
+
+void hmac_sha512_counter(const HMAC_SHA512_KEY *hmac_key,
+                         uint64_t counter, uint64_t result[8]) {
+  // The length field is 128 bits here, but its high half is always zero.
+  uint64_t block[16] = {
+    counter, 0x8000000000000000ULL, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, (SHA512_BLOCKSIZE + 8) * 8
+  };
+  memcpy(result, hmac_key->inner, 8 * sizeof(uint64_t));
+  sha512_compress(result, block);
+
+  // Outer block: the 64 byte inner digest, terminator and (128 + 64) * 8.
+  memcpy(block, result, 8 * sizeof(uint64_t));
+  block[8] = 0x8000000000000000ULL;
+  block[15] = (SHA512_BLOCKSIZE + SHA512_DIGEST_LENGTH) * 8;
+  memcpy(result, hmac_key->outer, 8 * sizeof(uint64_t));
+  sha512_compress(result, block);
+
+  memset(block, 0, sizeof(block));
+}
 
 void hmac_sha1(const uint8_t *key, int keyLength,
                const uint8_t *data, int dataLength,
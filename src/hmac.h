@@ -20,6 +20,77 @@
 
 #include <stdint.h>
 
+typedef enum HMACAlgorithm {
+  HMAC_SHA1 = 0,
+  HMAC_SHA256 = 1,
+  HMAC_SHA512 = 2
+} HMACAlgorithm;
+
+// SHA1 chaining values after absorbing the 0x36 (inner) and 0x5C (outer)
+// padded key blocks. These depend only on the key, so they can be computed
+// once per secret and reused for every message.
+typedef struct {
+  uint32_t inner[5];
+  uint32_t outer[5];
+} HMAC_SHA1_KEY;
+
+// The same for SHA-256 (64 byte key blocks) and SHA-512 (128 byte key blocks).
+typedef struct {
+  uint32_t inner[8];
+  uint32_t outer[8];
+} HMAC_SHA256_KEY;
+
+typedef struct {
+  uint64_t inner[8];
+  uint64_t outer[8];
+} HMAC_SHA512_KEY;
+
+// Midstates for any of the algorithms. Functions taking an HMAC_KEY only touch
+// the member for their algorithm, so storage may be cut to hmac_key_size().
+typedef union {
+  HMAC_SHA1_KEY sha1;
+  HMAC_SHA256_KEY sha256;
+  HMAC_SHA512_KEY sha512;
+} HMAC_KEY;
+
+int hmac_key_size(HMACAlgorithm algorithm)
+ __attribute__((visibility("hidden")));
+
+void hmac_prepare(HMACAlgorithm algorithm, HMAC_KEY *hmac_key,
+                  const uint8_t *key, int keyLength)
+ __attribute__((visibility("hidden")));
+
+void hmac_sha1_prepare(HMAC_SHA1_KEY *hmac_key,
+                       const uint8_t *key, int keyLength)
+ __attribute__((visibility("hidden")));
+
+// HMAC_SHA1 of an 8 byte message, such as a TOTP counter, passed as its two
+// big-endian halves in host order. Both the inner and the outer hash fit in one
+// padded block, so this is exactly two compressions with no buffering. The
+// digest is returned as five host-order words.
+void hmac_sha1_counter(const HMAC_SHA1_KEY *hmac_key,
+                       uint32_t counter_hi, uint32_t counter_lo,
+                       uint32_t result[5])
+ __attribute__((visibility("hidden")));
+
+void hmac_sha256_prepare(HMAC_SHA256_KEY *hmac_key,
+                         const uint8_t *key, int keyLength)
+ __attribute__((visibility("hidden")));
+
+// As hmac_sha1_counter(); the inner and outer hashes still fit one block each.
+void hmac_sha256_counter(const HMAC_SHA256_KEY *hmac_key,
+                         uint32_t counter_hi, uint32_t counter_lo,
+                         uint32_t result[8])
+ __attribute__((visibility("hidden")));
+
+void hmac_sha512_prepare(HMAC_SHA512_KEY *hmac_key,
+                         const uint8_t *key, int keyLength)
+ __attribute__((visibility("hidden")));
+
+void hmac_sha512_counter(const HMAC_SHA512_KEY *hmac_key,
+                         uint64_t counter, uint64_t result[8])
+ __attribute__((visibility("hidden")));
+
 void hmac_sha1(const uint8_t *key, int keyLength,
                const uint8_t *data, int dataLength,
                uint8_t *result, int resultLength)
@@ -1,9 +1,45 @@
 var Tokens = [];
 var TokenLoadFinished = false;
+var AMReadTokenList_Results = 1000;
+var InboxSize = 124; // APP_MESSAGE_INBOX_SIZE_MINIMUM, until the watch says
+
+// The token list (no secrets) as of the watch's generation Generation, whose
+// digest was Digest. Kept so that opening the app only has to fetch what
+// changed since, usually nothing.
+var Cache = null;
+var ReceivedTokens = {}; // By ID, while a readback is in progress
+
+var LoadCache = function() {
+    try {
+        Cache = JSON.parse(localStorage.getItem("TokenCache"));
+    } catch (e) {
+        Cache = null;
+    }
+    if (Cache && !(Cache.Tokens instanceof Array)) Cache = null;
+};
+
+var SaveCache = function() {
+    localStorage.setItem("TokenCache", JSON.stringify(Cache));
+};
+
+var Uint32Bytes = function(value) {
+    return [value & 0xFF, (value >>> 8) & 0xFF, (value >>> 16) & 0xFF, (value >>> 24) & 0xFF];
+};
+
+var ReadTokenList = function() {
+    ReceivedTokens = {};
+    if (Cache) {
+        for (var idx = 0; idx < Cache.Tokens.length; idx++) ReceivedTokens[Cache.Tokens[idx].ID] = Cache.Tokens[idx];
+        QueueAppMessage({"AMSync": Uint32Bytes(Cache.Generation).concat(Uint32Bytes(Cache.Digest))});
+    } else {
+        QueueAppMessage({"AMReadTokenList": 1});
+    }
+};
 
 Pebble.addEventListener("ready",
     function(e) {
-        QueueAppMessage({ "AMReadTokenList": 1});
+        LoadCache();
+        ReadTokenList();
         QueueAppMessage({ "AMSetUTCOffset": (new Date()).getTimezoneOffset() * -60});
     }
 );
@@ -22,10 +58,26 @@ var ToByteArray = function(input) {
     return input.split('').map(function(e){return e.charCodeAt(0);});
 };
 
-var TokenByID = function(id) {
-    for (var idx in Tokens) {
-        if (Tokens[idx].ID == id) return Tokens[idx];
+// As token_list_digest() in src/pTOTP.c: a CRC-32 of each token's ID, name,
+// NUL, algorithm, digits and period, in order.
+var CRC32Table = null;
+var TokenListDigest = function(tokens) {
+    var idx, bit, crc;
+    if (!CRC32Table) {
+        CRC32Table = [];
+        for (idx = 0; idx < 256; idx++) {
+            crc = idx;
+            for (bit = 0; bit < 8; bit++) crc = (crc >>> 1) ^ (0xEDB88320 & -(crc & 1));
+            CRC32Table.push(crc >>> 0);
+        }
+    }
+    crc = 0xFFFFFFFF;
+    for (idx = 0; idx < tokens.length; idx++) {
+        var token = tokens[idx];
+        var bytes = [token.ID].concat(ToByteArray(token.Name).slice(0, 32), [0, token.Algorithm, token.Digits, token.Period]);
+        for (var byte = 0; byte < bytes.length; byte++) crc = CRC32Table[(crc ^ bytes[byte]) & 0xFF] ^ (crc >>> 8);
     }
+    return (crc ^ 0xFFFFFFFF) >>> 0;
 };
 
 var AMQueue = [];
@@ -52,13 +104,36 @@ var AMTransmitQueue = function() {
 
 Pebble.addEventListener("appmessage",
   function(e) {
-    if (e.payload.AMReadTokenList_Result) {
+    // Before anything that may return early, so BulkOpsLimit() always has it.
+    if (e.payload.AMInboxSize) {
+        InboxSize = e.payload.AMInboxSize;
+    }
+    // As many records as fit in the message, under consecutive keys from 1000:
+    // every token, or those changed since the cached generation.
+    for (var key = AMReadTokenList_Results; e.payload[key]; key++) {
+        var record = e.payload[key];
         var token = {};
-        token.ID = e.payload.AMReadTokenList_Result[0];
-        token.Name = UnCString(e.payload.AMReadTokenList_Result, 2);
-        Tokens.push(token);
+        token.ID = record[0];
+        token.Name = UnCString(record, 2);
+        token.Algorithm = record[35] || 0;
+        token.Digits = record[36] || 6;
+        token.Period = record[37] || 30;
+        ReceivedTokens[token.ID] = token;
     }
     if (e.payload.AMReadTokenList_Finished) {
+        // The order has every ID, so tokens deleted since drop out here.
+        var order = e.payload.AMSyncOrder || [];
+        var tokens = order.map(function(id){ return ReceivedTokens[id]; });
+        var complete = tokens.every(function(token){ return token; });
+        if (!complete || TokenListDigest(tokens) !== e.payload.AMSyncDigest) {
+            console.log("Token cache is out of step, reading the whole list");
+            Cache = null;
+            ReadTokenList();
+            return;
+        }
+        Tokens = tokens;
+        Cache = {"Generation": e.payload.AMSyncGeneration, "Digest": e.payload.AMSyncDigest, "Tokens": Tokens};
+        SaveCache();
         TokenLoadFinished = true;
     }
   }
@@ -68,7 +143,7 @@ var DeferredConfigOpen = function(){
     // The docs say that this method must open a URL otherwise the user will receive an error - this doesn't appear to be the case.
     // And that's super handy for cases like this.
     if (TokenLoadFinished) {
-        Pebble.openURL("http://thekev.github.io/pTOTP/config.html?ver=1.2.0#" + encodeURIComponent(JSON.stringify(Tokens)));
+        Pebble.openURL("http://thekev.github.io/pTOTP/config.html?ver=1.3.0#" + encodeURIComponent(JSON.stringify(Tokens)));
     } else {
         setTimeout(DeferredConfigOpen, 100);
     }
@@ -76,52 +151,102 @@ var DeferredConfigOpen = function(){
 
 Pebble.addEventListener("showConfiguration", DeferredConfigOpen);
 
+// Ops for AMBulkOps, as apply_bulk_ops() in src/pTOTP.c reads them.
+var NameBytes = function(name) {
+    return ToByteArray(name).slice(0, 32);
+};
+
+var BulkCreateOp = function(token) {
+    var secret = ToByteArray(atob(token.Secret));
+    var name = NameBytes(token.Name);
+    return [67 /* C */, token.ID, secret.length, token.Algorithm || 0, token.Digits || 6, token.Period || 30, name.length].concat(name, secret);
+};
+
+var BulkUpdateOp = function(token) {
+    var name = NameBytes(token.Name);
+    return [85 /* U */, token.ID, name.length].concat(name);
+};
+
+var BulkDeleteOp = function(id) {
+    return [68 /* D */, id];
+};
+
+// The most one AMBulkOps message can carry: the watch's inbox less the
+// dictionary's 1 byte count and the tuple's 7 byte header.
+var BulkOpsLimit = function() {
+    return InboxSize - 1 - 7;
+};
+
+// Packs the ops, each at most BulkOpsLimit() bytes, into as few AMBulkOps
+// messages as that allows.
+var QueueBulkOps = function(ops) {
+    var limit = BulkOpsLimit();
+    var frame = [];
+    for (var idx = 0; idx < ops.length; idx++) {
+        if (frame.length && frame.length + ops[idx].length > limit) {
+            QueueAppMessage({"AMBulkOps": frame});
+            frame = [];
+        }
+        frame = frame.concat(ops[idx]);
+    }
+    if (frame.length) QueueAppMessage({"AMBulkOps": frame});
+};
+
 var ReconcileConfiguration = function(newTokens) {
-    var existing_ids = [];
-    var new_ids = [];
+    var existing = {};
+    var seen = {};
     var idx, token; // So JSLint stops complaining.
-    for (idx in Tokens) { existing_ids.push(Tokens[idx].ID); } // I can pretend it's list comprehension, right?
-    for (idx in newTokens) { new_ids.push(newTokens[idx].ID); }
-    // Which have been deleted (by ID only)?
-    var to_delete_ids = [];
-    for(idx in existing_ids) {
-        if (new_ids.indexOf(existing_ids[idx]) < 0) to_delete_ids.push(existing_ids[idx]);
+    for (idx = 0; idx < Tokens.length; idx++) { existing[Tokens[idx].ID] = Tokens[idx]; }
+
+    // A new token whose secret and name don't fit in one message can't be
+    // created; leave it out, and say so, rather than have the watch turn it
+    // away while the list here still has it.
+    var too_big = [];
+    newTokens = newTokens.filter(function(e) {
+        if (existing.hasOwnProperty(e.ID) || BulkCreateOp(e).length <= BulkOpsLimit()) return true;
+        too_big.push(e.Name);
+        return false;
+    });
+    if (too_big.length) {
+        console.log("Not creating " + JSON.stringify(too_big) + ": too long for the watch's inbox");
+        Pebble.showSimpleNotificationOnPebble("pTOTP", "Couldn't add " + too_big.join(", ") + ": the secret is too long.");
     }
 
-    // Which have been added?
-    // Which have been modified?
+    // Which have been added, and which modified?
     var to_create = [];
     var to_update = [];
-    for(idx in newTokens) {
-        if (existing_ids.indexOf(newTokens[idx].ID) < 0) {
-            to_create.push(newTokens[idx]);
-        } else {
-            if (TokenByID(newTokens[idx].ID).Name != newTokens[idx].Name) {
-                to_update.push(newTokens[idx]);
-            }
+    var new_ids = [];
+    for (idx = 0; idx < newTokens.length; idx++) {
+        token = newTokens[idx];
+        new_ids.push(token.ID);
+        seen[token.ID] = true;
+        if (!existing.hasOwnProperty(token.ID)) {
+            to_create.push(token);
+        } else if (existing[token.ID].Name != token.Name) {
+            to_update.push(token);
         }
     }
+    // Which have been deleted (by ID only)?
+    var to_delete_ids = [];
+    for (idx = 0; idx < Tokens.length; idx++) {
+        if (!seen[Tokens[idx].ID]) to_delete_ids.push(Tokens[idx].ID);
+    }
 
     console.log("Creating " + JSON.stringify(to_create.map(function(e){return {"Name": e.Name, "ID": e.ID};}))); // Strip the secret so it doesn't appear in logs.
     console.log("Updating " + JSON.stringify(to_update));
     console.log("Deleting " + JSON.stringify(to_delete_ids));
 
-    // Apply updates
-    for(idx in to_delete_ids) {
-        QueueAppMessage({"AMDeleteToken": [to_delete_ids[idx]]});
-    }
-    for (idx in to_create) {
-        token = to_create[idx];
-		var secretArray = ToByteArray(atob(token.Secret));
-		secretArray.unshift(secretArray.length);
-        QueueAppMessage({"AMCreateToken": secretArray, "AMCreateToken_ID": token.ID, "AMCreateToken_Name": token.Name});
-    }
-    for (idx in to_update) {
-        token = to_update[idx];
-        QueueAppMessage({"AMUpdateToken": [token.ID, 0, token.Name, 0]});
-    }
+    // Apply updates, deletes first so their IDs are free again.
+    var ops = to_delete_ids.map(BulkDeleteOp).concat(to_create.map(BulkCreateOp), to_update.map(BulkUpdateOp));
+    QueueBulkOps(ops);
     QueueAppMessage({"AMSetTokenListOrder": new_ids});
     Tokens = newTokens.map(function(e){e.Secret = null; return e;}); // Strip out the secrets so they don't appear in further log messages.
+    // The watch's generation moves on with these, so next time it sends them
+    // back as changed - which they already are here.
+    if (Cache) {
+        Cache.Tokens = Tokens;
+        SaveCache();
+    }
 };
 
 Pebble.addEventListener("webviewclosed", function(e) {
@@ -10,30 +10,52 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <limits.h>
+
 #include "pebble.h"
 
 #include "generate.h"
+#include "store.h"
+#include "tokens.h"
 #include "unixtime.h"
 
+// Keys 2, 4 and from 10000 held the tokens before the packed store (from
+// P_STORE_START); store.c migrates them.
 #define P_UTCOFFSET       1
-#define P_TOKENS_COUNT    2
 #define P_SELECTED_LIST_INDEX    3
-#define P_TOKENS_START    10000
-#define P_SECRETS_START   20000
+#define P_GENERATION      5
+
+// The app sleeps between wakeups: one at every step boundary of the shortest
+// period in the table, so codes change on time, and one every
+// BAR_UPDATE_SECONDS to move the progress bar along.
+#define BAR_UPDATE_SECONDS 3
+
+// Tokens whose next code is computed on each wakeup between step boundaries.
+// A 15 s period leaves four such wakeups; whatever they don't cover is
+// generated at the boundary itself.
+#define LOOKAHEAD_TOKENS_PER_TICK 2
 
-#define MAX_NAME_LENGTH   32
+// 55 px rows on a 168 px screen, the selected one centred: it and part of one
+// either side. Codes are only generated for these and PREFETCH_ROWS beyond
+// them each way, however many tokens there are.
+#define VISIBLE_ROWS      3
+#define PREFETCH_ROWS     1
 
 Window *window;
 
 typedef enum PersistenceWritebackFlags {
   PWNone = 0,
   PWUTCOffset = 1,
-  PWTokens = 1 << 1,
-  PWSecrets = 1 << 2
+  PWGeneration = 1 << 1
 } PersistenceWritebackFlags;
 
 PersistenceWritebackFlags persist_writeback = PWNone;
 
+// Changes from the phone come in bursts - a reorder, or a token per message
+// when syncing - so they're written once things go quiet.
+#define PERSIST_FLUSH_DELAY_MS 2000
+AppTimer *persist_flush_timer = NULL;
+
 typedef enum AMKey {
   AMSetUTCOffset = 0, // Int32 with offset
 
@@ -45,205 +67,224 @@ typedef enum AMKey {
   AMClearTokens = 5,
 
   AMReadTokenList = 6, // Starts token list read
-  AMReadTokenList_Result = 7, // Struct with token info, returned in order of the list
-  AMReadTokenList_Finished = 8, // Included in the last AMReadTokenList_Result message
+  AMReadTokenList_Result = 7, // Struct with token info, returned in order of the list (before 1.3.0)
+  AMReadTokenList_Finished = 8, // Included in the last AMReadTokenList_Results message
 
   AMUpdateToken = 9, // Struct with token info
 
-  AMSetTokenListOrder = 10 // array of shorts of token IDs
-} AMKey;
+  AMSetTokenListOrder = 10, // array of shorts of token IDs
 
-typedef struct TokenInfo {
-  char name[MAX_NAME_LENGTH + 1];
-  short id;
-  uint8_t secret_length; // Since persistence is limited to this size anyways.
-  uint8_t* secret;
-  char code[7];
-} TokenInfo;
+  AMCreateToken_Algorithm = 11, // Optional UInt8 HMACAlgorithm for the token being created, SHA1 if absent
+  AMCreateToken_Digits = 12, // Optional UInt8 code length, 6 to 8, for the token being created, 6 if absent
+  AMCreateToken_Period = 13, // Optional UInt8 step in seconds, 15, 30 or 60, for the token being created, 30 if absent
+
+  AMBulkOps = 14, // UInt8 array of token ops, see apply_bulk_ops()
+  AMInboxSize = 15, // UInt32 with the inbox size, sent with AMReadTokenList_Finished so the phone can size AMBulkOps
+
+  AMSync = 16, // UInt8 array with the generation and digest the phone has cached, both UInt32; answered like AMReadTokenList, with only what changed since
+  AMSyncGeneration = 17, // UInt32, sent with AMReadTokenList_Finished
+  AMSyncDigest = 18, // UInt32 CRC-32 of the token list, see token_list_digest(); sent with AMReadTokenList_Finished
+  AMSyncOrder = 19, // UInt8 array with every token ID in order of the list, sent with AMReadTokenList_Finished
+
+  AMReadTokenList_Results = 1000 // 1000 + i: the ith of as many token info structs as fit in the message, in order of the list
+} AMKey;
 
 typedef struct PublicTokenInfo {
   short id;
   char name[MAX_NAME_LENGTH + 1];
+  // Only meaningful in AMReadTokenList_Results, ignored by AMUpdateToken
+  uint8_t algorithm;
+  uint8_t digits;
+  uint8_t period;
 } PublicTokenInfo;
 
-typedef struct TokenListNode {
-  struct TokenListNode* next;
-  TokenInfo* key;
-} TokenListNode;
-
-TokenListNode* token_list = NULL;
-bool key_list_is_dirty = false;
-
 Layer *bar_layer;
 
 TextLayer *no_tokens_layer;
 
 MenuLayer *code_list_layer;
 
+// Looked up once rather than for every row drawn.
+GFont name_font;
+GFont code_font;
+GFont code_font_narrow;
+GRect name_rect;
+GRect code_rect;
+
 int utc_offset;
 
-int token_list_retrieve_index = 0;
+// Readback sends the tokens changed after token_list_retrieve_after (all of
+// them if 0) from row token_list_retrieve_index on, then the order and digest.
+// INT_MAX once that's sent.
+int token_list_retrieve_index = INT_MAX;
+uint32_t token_list_retrieve_after = 0;
 
-int startup_selected_list_index = 0;
+// Bumped with every change to the table, and stamped on the tokens changed,
+// so the phone can be sent just the tokens changed since the generation it
+// has cached. Tokens unchanged since the app started have generation 0, so
+// that only works from session_generation on; the phone gets everything
+// otherwise.
+uint32_t generation = 0;
+uint32_t session_generation = 0;
 
-void token_list_add(TokenInfo* key) {
-  TokenListNode* node = malloc(sizeof(TokenListNode));
-  node->next = NULL;
-  node->key = key;
+uint32_t inbox_size;
+uint32_t outbox_size;
 
-  if (!token_list) {
-    token_list = node;
-  } else {
-    TokenListNode* tail = token_list;
-    while (tail->next != NULL) {
-      tail = tail->next;
-    }
-    tail->next = node;
-  }
-  key_list_is_dirty = true;
-}
+int startup_selected_list_index = 0;
 
-TokenInfo* token_by_list_index(int index) {
-  TokenListNode* node = token_list;
-  for (int i = 0; i < index; ++i)
-  {
-    node = node->next;
-  }
-  return node->key;
+void tokeninfo2publicinfo(TokenInfo* key, PublicTokenInfo* public) {
+  public->id = key->id;
+  strncpy(public->name, token_name(key), MAX_NAME_LENGTH);
+  public->name[MAX_NAME_LENGTH] = 0;
+  public->algorithm = key->algorithm;
+  public->digits = key->digits;
+  public->period = key->period;
 }
 
-TokenInfo* token_by_id(short id) {
-  TokenListNode* node = token_list;
-  while (node) {
-    if (node->key->id == id) {
-      return node->key;
-    }
-    node = node->next;
-  }
-  return NULL;
+void publicinfo2tokeninfo(PublicTokenInfo* public) {
+  char name[MAX_NAME_LENGTH + 1];
+  strncpy(name, public->name, MAX_NAME_LENGTH);
+  name[MAX_NAME_LENGTH] = 0;
+  token_set_name(public->id, name);
 }
 
-short token_list_length(void){
-  short size = 0;
-  TokenListNode* node = token_list;
-  while (node) {
-    node = node->next;
-    size++;
-  }
-  return size;
+void show_no_tokens_message(bool show) {
+  layer_set_hidden((Layer*)code_list_layer, show);
+  layer_set_hidden(bar_layer, show);
+  layer_set_hidden((Layer*)no_tokens_layer, !show);
 }
 
-void token_list_clear(void){
-  TokenListNode* temp;
-  while (token_list) {
-    temp = token_list;
-    token_list = temp->next;
-    free(temp->key->secret);
-    free(temp->key); // Since it'd be a pain to do this otherwise.
-    free(temp);
-  }
-  key_list_is_dirty = true;
+unsigned long current_base_step(void) {
+  return (time(NULL) - utc_offset) / BASE_PERIOD;
 }
 
-bool token_list_delete(TokenInfo* key){
-  TokenListNode* node = token_list;
-  TokenListNode* last = NULL;
-  while (node && node->key != key) {
-    last = node;
-    node = node->next;
-  }
-  if (node) {
-    if (last) {
-      last->next = node->next;
-    } else {
-      token_list = node->next;
-    }
-    free(node);
-    key_list_is_dirty = true;
-    return true;
+// The rows whose codes are kept current: those on screen, around the
+// selected one, and PREFETCH_ROWS either side of them to scroll into.
+void code_window(short* first, short* last) {
+  short selected = menu_layer_get_selected_index(code_list_layer).row;
+  *first = selected > VISIBLE_ROWS / 2 + PREFETCH_ROWS ? selected - VISIBLE_ROWS / 2 - PREFETCH_ROWS : 0;
+  *last = selected + VISIBLE_ROWS / 2 + PREFETCH_ROWS;
+  if (*last >= token_list_length()) {
+    *last = token_list_length() - 1;
   }
-  return false;
 }
 
-void token_list_supplant(TokenListNode* newList) {
-  TokenListNode* last = NULL;
-  // Free the existing list nodes (but not their TokenInfos)
-  while (token_list) {
-    last = token_list;
-    token_list = last->next;
-    free(last);
+// Fills in the next step's code for up to LOOKAHEAD_TOKENS_PER_TICK tokens in
+// the window that don't have it yet, so the boundary only has to swap buffers.
+void lookahead_slice(unsigned long base_step) {
+  int budget = LOOKAHEAD_TOKENS_PER_TICK;
+  short first, last;
+  code_window(&first, &last);
+  for (short i = first; i <= last && budget; ++i) {
+    budget -= token_lookahead(token_by_list_index(i), base_step);
   }
-  token_list = newList;
-  key_list_is_dirty = true;
 }
 
-void tokeninfo2publicinfo(TokenInfo* key, PublicTokenInfo* public) {
-  public->id = key->id;
-  strncpy(public->name, key->name, MAX_NAME_LENGTH);
-  public->name[MAX_NAME_LENGTH] = 0;
-}
+// Of the tokens in the table, as of the last refresh_all() after a change.
+uint8_t shortest_period = DEFAULT_PERIOD;
 
-void publicinfo2tokeninfo(PublicTokenInfo* public, TokenInfo* key) {
-  key->id = public->id;
-  strncpy(key->name, public->name, MAX_NAME_LENGTH);
-  key->name[MAX_NAME_LENGTH] = 0;
-}
-
-void code2char(unsigned int code, char* out) {
-  for(int x=0; x<6; x++) {
-    out[5-x] = '0' + (code % 10);
-    code /= 10;
-  }
-}
-
-void show_no_tokens_message(bool show) {
-  layer_set_hidden((Layer*)code_list_layer, show);
-  layer_set_hidden(bar_layer, show);
-  layer_set_hidden((Layer*)no_tokens_layer, !show);
-}
+AppTimer *refresh_timer = NULL;
 
 void refresh_all(void){
-  static unsigned int lastQuantizedTimeGenerated = 0;
-
-  unsigned long utcTime = time(NULL) - utc_offset;
+  static unsigned long lastBaseStepGenerated = 0;
 
-  unsigned int quantized_time = utcTime/30;
+  // No period can roll over between two BASE_PERIOD boundaries.
+  unsigned long base_step = current_base_step();
 
-  if (quantized_time == lastQuantizedTimeGenerated && !key_list_is_dirty) {
+  if (base_step == lastBaseStepGenerated && !key_list_is_dirty) {
+    lookahead_slice(base_step);
     return;
   }
 
+  bool changed = key_list_is_dirty;
+  if (key_list_is_dirty) {
+    // 15, 30 and 60 are the only periods, so this stops at the first 15.
+    shortest_period = 60;
+    for (short i = 0; i < token_list_length() && shortest_period > 15; ++i) {
+      uint8_t period = token_by_list_index(i)->period;
+      if (period < shortest_period) {
+        shortest_period = period;
+      }
+    }
+  }
   key_list_is_dirty = false;
+  lastBaseStepGenerated = base_step;
+
+  // Codes are generated as the rows are drawn, so only redraw if one in the
+  // window is out of date.
+  short first, last;
+  code_window(&first, &last);
+  for (short i = first; i <= last && !changed; ++i) {
+    TokenInfo* key = token_by_list_index(i);
+    changed = token_step(key, base_step) != key->step;
+  }
 
-  bool hasKeys = false;
-
-  lastQuantizedTimeGenerated = quantized_time;
-
-  TokenListNode* keyNode = token_list;
-  while (keyNode) {
-    unsigned int code = generateCode(keyNode->key->secret, keyNode->key->secret_length, quantized_time);
-    code2char(code, (char*)&keyNode->key->code);
-    keyNode = keyNode->next;
-    hasKeys = true;
+  // Reloading has the menu lay out every row again; when there are as many
+  // as before, redrawing the cells on screen is enough. An empty list counts
+  // too, so refilling it to the old length still lays it out.
+  static short lastRowCount = -1;
+  short ct = token_list_length();
+  if (ct != lastRowCount) {
+    lastRowCount = ct;
+    if (ct) {
+      menu_layer_reload_data(code_list_layer);
+    }
+  } else if (ct && changed) {
+    layer_mark_dirty(menu_layer_get_layer(code_list_layer));
   }
+  show_no_tokens_message(!ct);
+}
 
-  if (hasKeys) {
-    menu_layer_reload_data(code_list_layer);
+void handle_wakeup(void* data);
+
+// Arms the timer for whichever comes first, the next bar update or the next
+// step boundary, to the millisecond so the new codes aren't late.
+void schedule_wakeup(void) {
+  time_t seconds;
+  uint16_t ms;
+  time_ms(&seconds, &ms);
+  unsigned long utcTime = seconds - utc_offset;
+  unsigned int wait = BAR_UPDATE_SECONDS - utcTime % BAR_UPDATE_SECONDS;
+  unsigned int boundary = shortest_period - utcTime % shortest_period;
+  if (boundary < wait) {
+    wait = boundary;
+  }
+  uint32_t delay = wait * 1000 - ms;
+  if (!refresh_timer || !app_timer_reschedule(refresh_timer, delay)) {
+    refresh_timer = app_timer_register(delay, handle_wakeup, NULL);
   }
-  show_no_tokens_message(!hasKeys);
+}
+
+void handle_wakeup(void* data) {
+  refresh_timer = NULL;
+  refresh_all();
+  layer_mark_dirty(bar_layer);
+  schedule_wakeup();
+}
+
+void selection_changed(struct MenuLayer *menu_layer, MenuIndex new_index, MenuIndex old_index, void *callback_context) {
+  // The bar counts down the selected token's period.
+  layer_mark_dirty(bar_layer);
 }
 
 void bar_layer_update(Layer *l, GContext* ctx) {
   graphics_context_set_fill_color(ctx, GColorBlack);
-  unsigned short slice = 30 - (time(NULL) % 30);
-  graphics_fill_rect(ctx, GRect(0, 0, (slice * 48) / 10, 5), 0, GCornerNone);
+  // Count down the period of the selected token.
+  unsigned short period = DEFAULT_PERIOD;
+  int row = menu_layer_get_selected_index(code_list_layer).row;
+  if (row < token_list_length()) {
+    period = token_by_list_index(row)->period;
+  }
+  unsigned short slice = period - (time(NULL) % period);
+  graphics_fill_rect(ctx, GRect(0, 0, (slice * layer_get_bounds(l).size.w) / period, 5), 0, GCornerNone);
 }
 
 void draw_code_row(GContext *ctx, const Layer *cell_layer, MenuIndex *cell_index, void *callback_context){
   graphics_context_set_text_color(ctx, GColorBlack);
   TokenInfo* key = token_by_list_index(cell_index->row);
-  graphics_draw_text(ctx, (char*)key->name, fonts_get_system_font(FONT_KEY_GOTHIC_14), GRect(0, 36, 144, 20), GTextOverflowModeTrailingEllipsis, GTextAlignmentCenter, NULL);
-  graphics_draw_text(ctx, (char*)key->code, fonts_get_system_font(FONT_KEY_BITHAM_34_MEDIUM_NUMBERS), GRect(0, 0, 144, 100), GTextOverflowModeTrailingEllipsis, GTextAlignmentCenter, NULL);
+  graphics_draw_text(ctx, token_name(key), name_font, name_rect, GTextOverflowModeTrailingEllipsis, GTextAlignmentCenter, NULL);
+  // Eight digits don't fit across the screen in the larger font.
+  graphics_draw_text(ctx, token_code(key, current_base_step()), key->digits < 8 ? code_font : code_font_narrow, code_rect, GTextOverflowModeTrailingEllipsis, GTextAlignmentCenter, NULL);
 }
 
 uint16_t num_code_rows(struct MenuLayer *menu_layer, uint16_t section_index, void *callback_context){
@@ -254,34 +295,157 @@ int16_t get_cell_height(struct MenuLayer *menu_layer, MenuIndex *cell_index, voi
   return 55;
 }
 
+// CRC-32 of what the phone sees of each token in order of the list: ID,
+// name, NUL, algorithm, digits and period.
+uint32_t token_list_digest(void) {
+  uint32_t crc = 0;
+  for (short i = 0; i < token_list_length(); ++i) {
+    TokenInfo* key = token_by_list_index(i);
+    uint8_t id = key->id;
+    uint8_t settings[4] = { 0, key->algorithm, key->digits, key->period };
+    crc = crc32_update(crc, &id, 1);
+    crc = crc32_update(crc, (const uint8_t*)token_name(key), strlen(token_name(key)));
+    crc = crc32_update(crc, settings, sizeof(settings));
+  }
+  return crc;
+}
+
 void token_list_retrieve_iter() {
-  DictionaryIterator *iter;
-  if (token_list_retrieve_index == token_list_length()) {
-    if (token_list_retrieve_index == 0){
-      // We have to send the AMReadTokenList_Finished message by its own, otherwise the configuration screen will block forever waiting for tokens that will never arrive.
-      app_message_outbox_begin(&iter);
-      dict_write_tuplet(iter, &TupletInteger(AMReadTokenList_Finished, 1));
-      app_message_outbox_send();
-    }
+  short ct = token_list_length();
+  if (token_list_retrieve_index > ct) {
     return;
   }
 
-  TokenInfo* key = token_by_list_index(token_list_retrieve_index);
-  PublicTokenInfo* public = malloc(sizeof(PublicTokenInfo));
+  // As many records as fit, each tuple a 7 byte header and its value after
+  // the dictionary's 1 byte count.
+  DictionaryIterator *iter;
   app_message_outbox_begin(&iter);
+  int room = outbox_size - 1;
+  int records = 0;
+  PublicTokenInfo public;
+  for (; token_list_retrieve_index < ct && room >= (int)(7 + sizeof(PublicTokenInfo)); ++token_list_retrieve_index) {
+    TokenInfo* key = token_by_list_index(token_list_retrieve_index);
+    if (!token_changed_since(key, token_list_retrieve_after)) {
+      continue;
+    }
+    tokeninfo2publicinfo(key, &public);
+    dict_write_data(iter, AMReadTokenList_Results + records++, (uint8_t*)&public, sizeof(PublicTokenInfo));
+    room -= 7 + sizeof(PublicTokenInfo);
+  }
+  memset(&public, 0, sizeof(public));
+
+  // Then, in this message if there's room or the next if not, what the phone
+  // needs to put its list together.
+  int summary = (7 + 1) + 3 * (7 + 4) + (7 + ct);
+  if (token_list_retrieve_index == ct && room >= summary) {
+    uint8_t order[MAX_TOKENS];
+    for (short i = 0; i < ct; ++i) {
+      order[i] = token_by_list_index(i)->id;
+    }
+    dict_write_data(iter, AMSyncOrder, order, ct);
+    dict_write_uint32(iter, AMSyncGeneration, generation);
+    dict_write_uint32(iter, AMSyncDigest, token_list_digest());
+    dict_write_uint32(iter, AMInboxSize, inbox_size);
+    // We have to send AMReadTokenList_Finished, even with nothing else, otherwise the configuration screen will block forever waiting for tokens that will never arrive.
+    dict_write_uint8(iter, AMReadTokenList_Finished, 1);
+    token_list_retrieve_index = INT_MAX;
+  }
+
+  app_message_outbox_send();
+}
+
+void token_list_retrieve_start(uint32_t after) {
+  token_list_retrieve_index = 0;
+  token_list_retrieve_after = after;
+  token_list_retrieve_iter();
+}
+
+void list_changed(void) {
+  generation++;
+  persist_writeback |= PWGeneration;
+}
 
-  tokeninfo2publicinfo(key, public);
-  Tuplet record = TupletBytes(AMReadTokenList_Result, (uint8_t*)public, sizeof(PublicTokenInfo));
-  dict_write_tuplet(iter, &record);
+void token_changed(short id) {
+  store_token_changed(id);
+  list_changed();
+  TokenInfo* key = token_by_id(id);
+  if (key) {
+    key->generation = generation;
+  }
+}
 
-  if (token_list_retrieve_index + 1 == token_list_length()) {
-    dict_write_tuplet(iter, &TupletInteger(AMReadTokenList_Finished, 1));
+void persist_flush(void* data) {
+  persist_flush_timer = NULL;
+  if ((persist_writeback & PWUTCOffset) == PWUTCOffset) {
+    persist_write_int(P_UTCOFFSET, utc_offset);
+  }
+  if ((persist_writeback & PWGeneration) == PWGeneration) {
+    persist_write_int(P_GENERATION, generation);
   }
+  persist_writeback = PWNone;
 
-  app_message_outbox_send();
+  // Secrets are journaled with the rest of the token; the store wipes its buffers after.
+  store_flush();
+}
 
-  token_list_retrieve_index++;
-  free(public);
+void create_token_from(TokenInfo* newKey, const char* name, const uint8_t* secret) {
+  token_sanitize(newKey);
+  TokenInfo* key = token_list_add(newKey, name);
+  if (key) {
+    memcpy(token_secret(key), secret, newKey->secret_length);
+    token_prepare_key(key);
+    token_changed(key->id);
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "Create token %d", newKey->id);
+  } else {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "No room for token %d", newKey->id);
+  }
+}
+
+// Many creates, renames and deletes in one message, each an op byte and its
+// operands, back to back:
+//
+//   'C' id secret_length algorithm digits period name_length name secret
+//   'U' id name_length name
+//   'D' id
+//
+// Names aren't NUL-terminated. Stops at the first op that runs past the end.
+void apply_bulk_ops(const uint8_t* data, uint16_t length) {
+  const uint8_t* end = data + length;
+  char name[MAX_NAME_LENGTH + 1];
+  int applied = 0;
+  while (data < end) {
+    uint8_t op = data[0];
+    if (op == 'C' && end - data >= 7 && end - data >= 7 + data[6] + data[2]) {
+      TokenInfo newKey = {
+        .id = data[1],
+        .secret_length = data[2],
+        .algorithm = data[3],
+        .digits = data[4],
+        .period = data[5]
+      };
+      int name_length = data[6] < MAX_NAME_LENGTH ? data[6] : MAX_NAME_LENGTH;
+      memcpy(name, data + 7, name_length);
+      name[name_length] = 0;
+      create_token_from(&newKey, name, data + 7 + data[6]);
+      data += 7 + data[6] + data[2];
+    } else if (op == 'U' && end - data >= 3 && end - data >= 3 + data[2]) {
+      int name_length = data[2] < MAX_NAME_LENGTH ? data[2] : MAX_NAME_LENGTH;
+      memcpy(name, data + 3, name_length);
+      name[name_length] = 0;
+      token_set_name(data[1], name);
+      token_changed(data[1]);
+      data += 3 + data[2];
+    } else if (op == 'D' && end - data >= 2) {
+      token_list_delete(data[1]);
+      token_changed(data[1]);
+      data += 2;
+    } else {
+      APP_LOG(APP_LOG_LEVEL_ERROR, "Bad bulk op at byte %d", length - (int)(end - data));
+      break;
+    }
+    applied++;
+  }
+  APP_LOG(APP_LOG_LEVEL_DEBUG, "Applied %d bulk ops", applied);
 }
 
 void in_received_handler(DictionaryIterator *received, void *context) {
@@ -301,20 +465,19 @@ void in_received_handler(DictionaryIterator *received, void *context) {
     APP_LOG(APP_LOG_LEVEL_DEBUG, "Clear tokens");
     token_list_clear();
 
-    persist_writeback |= PWTokens;
+    store_tokens_cleared();
+    list_changed();
     delta = true;
   }
 
   Tuple *delete_token = dict_find(received, AMDeleteToken);
   if (delete_token) {
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Delete token %d", delete_token->value->int8);
-    TokenInfo* key = token_by_id(delete_token->value->int8);
-    persist_delete(P_SECRETS_START + key->id); // Ensure the secret gets deleted.
-    token_list_delete(key);
-    free(key->secret);
-    free(key);
-
-    persist_writeback |= PWTokens;
+    // A one byte array, so IDs above 127 aren't read as negative.
+    short id = delete_token->value->uint8;
+    APP_LOG(APP_LOG_LEVEL_DEBUG, "Delete token %d", id);
+    token_list_delete(id);
+
+    token_changed(id);
     delta = true;
   }
 
@@ -322,74 +485,82 @@ void in_received_handler(DictionaryIterator *received, void *context) {
   if (update_token) {
     PublicTokenInfo* public = (PublicTokenInfo*)&update_token->value->data;
     APP_LOG(APP_LOG_LEVEL_DEBUG, "Update token %d", public->id);
-    publicinfo2tokeninfo(public, token_by_id(public->id));
+    publicinfo2tokeninfo(public);
 
-    persist_writeback |= PWTokens;
+    token_changed(public->id);
     delta = true;
   }
 
   Tuple *create_token = dict_find(received, AMCreateToken);
   if (create_token) {
     uint8_t* secret = create_token->value->data;
-    TokenInfo* newKey = malloc(sizeof(TokenInfo));
-  newKey->secret_length = secret[0]; // First byte is secret length
-  newKey->secret = malloc(newKey->secret_length);
-    memcpy(newKey->secret, secret + 1, newKey->secret_length); // While the rest is the key itself
-    newKey->id = dict_find(received, AMCreateToken_ID)->value->int32;
-    strncpy((char*)&newKey->name, dict_find(received, AMCreateToken_Name)->value->cstring, MAX_NAME_LENGTH);
-    newKey->name[MAX_NAME_LENGTH] = 0;
-
-    token_list_add(newKey);
-    APP_LOG(APP_LOG_LEVEL_DEBUG, "Create token %d", newKey->id);
+    TokenInfo newKey;
+  newKey.secret_length = secret[0]; // First byte is secret length
+    newKey.id = dict_find(received, AMCreateToken_ID)->value->int32;
+    Tuple *algorithm = dict_find(received, AMCreateToken_Algorithm);
+    newKey.algorithm = algorithm ? algorithm->value->uint8 : HMAC_SHA1;
+    Tuple *digits = dict_find(received, AMCreateToken_Digits);
+    newKey.digits = digits ? digits->value->uint8 : DEFAULT_DIGITS;
+    Tuple *period = dict_find(received, AMCreateToken_Period);
+    newKey.period = period ? period->value->uint8 : DEFAULT_PERIOD;
+
+    create_token_from(&newKey, dict_find(received, AMCreateToken_Name)->value->cstring, secret + 1); // While the rest is the key itself
+    delta = true;
+  }
 
-  persist_writeback |= PWTokens | PWSecrets;
+  Tuple *bulk_ops = dict_find(received, AMBulkOps);
+  if (bulk_ops) {
+    apply_bulk_ops(bulk_ops->value->data, bulk_ops->length);
     delta = true;
   }
 
   if (dict_find(received, AMReadTokenList)) {
     APP_LOG(APP_LOG_LEVEL_DEBUG, "Listing tokens");
-    token_list_retrieve_index = 0;
-    token_list_retrieve_iter();
+    token_list_retrieve_start(0);
+  }
+
+  Tuple *sync = dict_find(received, AMSync);
+  if (sync && sync->length == 8) {
+    const uint8_t* cached = sync->value->data;
+    uint32_t cached_generation = cached[0] | cached[1] << 8 | cached[2] << 16 | (uint32_t)cached[3] << 24;
+    uint32_t cached_digest = cached[4] | cached[5] << 8 | cached[6] << 16 | (uint32_t)cached[7] << 24;
+    if (cached_generation == generation && cached_digest == token_list_digest()) {
+      // Current: nothing but the summary.
+      token_list_retrieve_start(UINT32_MAX);
+    } else if (cached_generation >= session_generation && cached_generation < generation) {
+      APP_LOG(APP_LOG_LEVEL_DEBUG, "Syncing from generation %lu to %lu", (unsigned long)cached_generation, (unsigned long)generation);
+      token_list_retrieve_start(cached_generation);
+    } else {
+      APP_LOG(APP_LOG_LEVEL_DEBUG, "Listing tokens for generation %lu", (unsigned long)cached_generation);
+      token_list_retrieve_start(0);
+    }
   }
 
   Tuple *reorder_list = dict_find(received, AMSetTokenListOrder);
   if (reorder_list) {
     APP_LOG(APP_LOG_LEVEL_DEBUG, "Reordering tokens");
-    TokenListNode* newList = NULL;
-    TokenListNode* node = NULL;
-    TokenListNode* last = NULL;
-
-    // Build a new list using the existing TokenInfos
-    int ct = token_list_length();
-    for (int i = 0; i < ct; ++i)
-    {
-      node = malloc(sizeof(TokenListNode));
-      if (last) {
-        last->next = node;
-      } else {
-        newList = node;
-      }
-      node->next = NULL;
-      node->key = token_by_id(reorder_list->value->data[i]);
-      last = node;
-    }
+    token_list_reorder(reorder_list->value->data, reorder_list->length);
 
-    // Free the existing list and replace.
-    token_list_supplant(newList);
-
-    persist_writeback |= PWTokens;
+    store_order_changed();
+    list_changed();
     delta = true;
   }
 
   if (delta){
     refresh_all();
+    // The offset or the shortest period may have moved the next boundary.
+    schedule_wakeup();
+  }
+
+  if (persist_writeback != PWNone || store_is_dirty()) {
+    if (!persist_flush_timer || !app_timer_reschedule(persist_flush_timer, PERSIST_FLUSH_DELAY_MS)) {
+      persist_flush_timer = app_timer_register(PERSIST_FLUSH_DELAY_MS, persist_flush, NULL);
+    }
   }
 }
 
 void out_sent_handler(DictionaryIterator *sent, void *context) {
-  if (dict_find(sent, AMReadTokenList_Result)) {
-    token_list_retrieve_iter();
-  }
+  token_list_retrieve_iter();
 }
 
 // Standard app init
@@ -399,19 +570,14 @@ void handle_init() {
   app_message_register_inbox_received(in_received_handler);
   app_message_register_outbox_sent(out_sent_handler);
 
-  app_message_open(app_message_inbox_size_maximum(), app_message_outbox_size_maximum());
+  inbox_size = app_message_inbox_size_maximum();
+  outbox_size = app_message_outbox_size_maximum();
+  app_message_open(inbox_size, outbox_size);
   // Load persisted data
   utc_offset = persist_exists(P_UTCOFFSET) ? persist_read_int(P_UTCOFFSET) : 0;
-  if (persist_exists(P_TOKENS_COUNT)) {
-    int ct = persist_read_int(P_TOKENS_COUNT);
-    APP_LOG(APP_LOG_LEVEL_INFO, "Starting with %d tokens & secrets", ct);
-    for (int i = 0; i < ct; ++i) {
-      TokenInfo* key = malloc(sizeof(TokenInfo));
-      persist_read_data(P_TOKENS_START + i, key, sizeof(TokenInfo));
-    key->secret = malloc(key->secret_length);
-    persist_read_data(P_SECRETS_START + key->id, key->secret, key->secret_length);
-      token_list_add(key);
-    }
+  generation = session_generation = persist_exists(P_GENERATION) ? persist_read_int(P_GENERATION) : 0;
+  if (store_load()) {
+    APP_LOG(APP_LOG_LEVEL_INFO, "Starting with %d tokens & secrets", token_list_length());
   }
 
   window = window_create();
@@ -431,11 +597,17 @@ void handle_init() {
   layer_add_child(rootLayer, (Layer*)no_tokens_layer);
 
   code_list_layer = menu_layer_create(GRect(0,0,rootLayerRect.size.w, rootLayerRect.size.h - 4));
+  name_font = fonts_get_system_font(FONT_KEY_GOTHIC_14);
+  code_font = fonts_get_system_font(FONT_KEY_BITHAM_34_MEDIUM_NUMBERS);
+  code_font_narrow = fonts_get_system_font(FONT_KEY_BITHAM_30_BLACK);
+  name_rect = GRect(0, 36, rootLayerRect.size.w, 20);
+  code_rect = GRect(0, 0, rootLayerRect.size.w, 100);
 
   MenuLayerCallbacks menuCallbacks = {
     .draw_row = draw_code_row,
     .get_num_rows = num_code_rows,
-    .get_cell_height = get_cell_height
+    .get_cell_height = get_cell_height,
+    .selection_changed = selection_changed
   };
 
   menu_layer_set_callbacks(code_list_layer, NULL, menuCallbacks);
@@ -455,49 +627,25 @@ void handle_init() {
 
 
   refresh_all();
-}
-
-void handle_tick(struct tm* tick_time, TimeUnits units_changed) {
-  refresh_all();
-  layer_mark_dirty(bar_layer);
+  schedule_wakeup();
 }
 
 void handle_deinit() {
-  if ((persist_writeback & PWUTCOffset) == PWUTCOffset) {
-    // Write back persistent things
-    persist_write_int(P_UTCOFFSET, utc_offset);
+  if (refresh_timer) {
+    app_timer_cancel(refresh_timer);
+  }
+
+  // Write back persistent things
+  if (persist_flush_timer) {
+    app_timer_cancel(persist_flush_timer);
   }
+  persist_flush(NULL);
 
   if (startup_selected_list_index != menu_layer_get_selected_index(code_list_layer).row) {
     persist_write_int(P_SELECTED_LIST_INDEX, menu_layer_get_selected_index(code_list_layer).row);
     APP_LOG(APP_LOG_LEVEL_DEBUG, "Wrote list index");
   }
 
-  if ((persist_writeback & PWTokens) == PWTokens) {
-    persist_write_int(P_TOKENS_COUNT, token_list_length());
-
-    TokenListNode* node = token_list;
-    short idx = 0;
-    while (node) {
-      persist_write_data(P_TOKENS_START + idx, node->key, sizeof(TokenInfo));
-      idx++;
-      node = node->next;
-    }
-
-    APP_LOG(APP_LOG_LEVEL_INFO, "Wrote %d tokens", idx);
-  }
-
-  // This is stored in a seperate storage area keyed by ID because a) it's easier to have truly variable-length secrets this way, and b) it's easier to ensure secrets are deleted (as opposed to relying on them getting overwritten)
-  if ((persist_writeback & PWSecrets) == PWSecrets) {
-    TokenListNode* node = token_list;
-    while (node) {
-      persist_write_data(P_SECRETS_START + node->key->id, node->key->secret, node->key->secret_length);
-      node = node->next;
-    }
-
-    APP_LOG(APP_LOG_LEVEL_INFO, "Wrote secrets");
-  }
-
   token_list_clear();
   menu_layer_destroy(code_list_layer);
   layer_destroy(bar_layer);
@@ -507,7 +655,6 @@ void handle_deinit() {
 
 int main() {
   handle_init();
-  tick_timer_service_subscribe(SECOND_UNIT, handle_tick);
   app_event_loop();
   handle_deinit();
 }
\ No newline at end of file
@@ -45,6 +45,19 @@
 
 #include "sha1.h"
 
+/*
+ * On x86 hosts with the SHA extensions the compression function runs on
+ * those instructions instead; availability is checked once via CPUID and the
+ * portable kernel below remains the fallback. Define SHA1_NO_HW to build the
+ * portable kernel only. The watch never takes this path.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    !defined(SHA1_NO_HW)
+#define SHA1_HW_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #if !defined(BYTE_ORDER)
 #if defined(_BIG_ENDIAN)
 #define BYTE_ORDER 4321
@@ -77,37 +90,271 @@
 /* 32-bit rotate */
 #define R32(x,n)    T32(((x << n) | (x >> (32 - n))))
 
+/*
+ * SHA1_LOW_FOOTPRINT computes the message schedule in a rolling 16 word
+ * window instead of expanding all 80 words up front, trading 256 bytes of
+ * stack for a little index arithmetic per round. The watch, with only a few KB
+ * of stack, gets it by default; define SHA1_FULL_SCHEDULE to opt out.
+ */
+#if defined(__arm__) && !defined(SHA1_FULL_SCHEDULE) && \
+    !defined(SHA1_LOW_FOOTPRINT)
+#define SHA1_LOW_FOOTPRINT
+#endif
+
+#ifdef SHA1_LOW_FOOTPRINT
+#define SHA1_W_WORDS 16
+
+static inline uint32_t
+sha1_schedule(uint32_t W[16], int t)
+{
+    uint32_t X;
+
+    if (t >= 16) {
+        X = W[(t-3) & 15] ^ W[(t-8) & 15] ^ W[(t-14) & 15] ^ W[t & 15];
+        W[t & 15] = R32(X, 1);
+    }
+    return W[t & 15];
+}
+
+#define WORD    sha1_schedule(W, t++)
+#else /* !SHA1_LOW_FOOTPRINT */
+#define SHA1_W_WORDS 80
+#define WORD    (*WP++)
+#endif /* !SHA1_LOW_FOOTPRINT */
+
 /* the generic case, for when the overall rotation is not unraveled */
 #define FG(n)    \
-    T = T32(R32(A,5) + f##n(B,C,D) + E + *WP++ + CONST##n);    \
+    T = T32(R32(A,5) + f##n(B,C,D) + E + WORD + CONST##n);    \
     E = D; D = C; C = R32(B,30); B = A; A = T
 
 /* specific cases, for when the overall rotation is unraveled */
 #define FA(n)    \
-    T = T32(R32(A,5) + f##n(B,C,D) + E + *WP++ + CONST##n); B = R32(B,30)
+    T = T32(R32(A,5) + f##n(B,C,D) + E + WORD + CONST##n); B = R32(B,30)
 
 #define FB(n)    \
-    E = T32(R32(T,5) + f##n(A,B,C) + D + *WP++ + CONST##n); A = R32(A,30)
+    E = T32(R32(T,5) + f##n(A,B,C) + D + WORD + CONST##n); A = R32(A,30)
 
 #define FC(n)    \
-    D = T32(R32(E,5) + f##n(T,A,B) + C + *WP++ + CONST##n); T = R32(T,30)
+    D = T32(R32(E,5) + f##n(T,A,B) + C + WORD + CONST##n); T = R32(T,30)
 
 #define FD(n)    \
-    C = T32(R32(D,5) + f##n(E,T,A) + B + *WP++ + CONST##n); E = R32(E,30)
+    C = T32(R32(D,5) + f##n(E,T,A) + B + WORD + CONST##n); E = R32(E,30)
 
 #define FE(n)    \
-    B = T32(R32(C,5) + f##n(D,E,T) + A + *WP++ + CONST##n); D = R32(D,30)
+    B = T32(R32(C,5) + f##n(D,E,T) + A + WORD + CONST##n); D = R32(D,30)
 
 #define FT(n)    \
-    A = T32(R32(B,5) + f##n(C,D,E) + T + *WP++ + CONST##n); C = R32(C,30)
+    A = T32(R32(B,5) + f##n(C,D,E) + T + WORD + CONST##n); C = R32(C,30)
+
+
+/* the compression function proper; expects W[0..15] to hold the block */
+
+static void
+sha1_compress_words(uint32_t digest[5], uint32_t W[SHA1_W_WORDS])
+{
+#if !defined(SHA1_LOW_FOOTPRINT) || !(defined(UNRAVEL) || defined(UNROLL_LOOPS))
+    int i;
+#endif
+    uint32_t T, A, B, C, D, E;
+
+#ifdef SHA1_LOW_FOOTPRINT
+    int t = 0;
+#else
+    uint32_t *WP;
+
+    for (i = 16; i < 80; ++i) {
+    W[i] = W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16];
+    W[i] = R32(W[i], 1);
+    }
+    WP = W;
+#endif
+    A = digest[0];
+    B = digest[1];
+    C = digest[2];
+    D = digest[3];
+    E = digest[4];
+#ifdef UNRAVEL
+    FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1); FC(1); FD(1);
+    FE(1); FT(1); FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1);
+    FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2); FE(2); FT(2);
+    FA(2); FB(2); FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2);
+    FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3); FA(3); FB(3);
+    FC(3); FD(3); FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3);
+    FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4); FC(4); FD(4);
+    FE(4); FT(4); FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4);
+    digest[0] = T32(digest[0] + E);
+    digest[1] = T32(digest[1] + T);
+    digest[2] = T32(digest[2] + A);
+    digest[3] = T32(digest[3] + B);
+    digest[4] = T32(digest[4] + C);
+#else /* !UNRAVEL */
+#ifdef UNROLL_LOOPS
+    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
+    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
+    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
+    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
+    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
+    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
+    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
+    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
+#else /* !UNROLL_LOOPS */
+    for (i =  0; i < 20; ++i) { FG(1); }
+    for (i = 20; i < 40; ++i) { FG(2); }
+    for (i = 40; i < 60; ++i) { FG(3); }
+    for (i = 60; i < 80; ++i) { FG(4); }
+#endif /* !UNROLL_LOOPS */
+    digest[0] = T32(digest[0] + A);
+    digest[1] = T32(digest[1] + B);
+    digest[2] = T32(digest[2] + C);
+    digest[3] = T32(digest[3] + D);
+    digest[4] = T32(digest[4] + E);
+#endif /* !UNRAVEL */
+}
 
+#ifdef SHA1_HW_X86
+
+/* one group of four rounds once the message schedule is in full swing */
+#define SHANI4(Ecur, Enext, M, Mmsg2, Mxor, Mmsg1, f)    \
+    Ecur = _mm_sha1nexte_epu32(Ecur, M);                  \
+    Enext = ABCD;                                         \
+    Mmsg2 = _mm_sha1msg2_epu32(Mmsg2, M);                 \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, Ecur, f);            \
+    Mmsg1 = _mm_sha1msg1_epu32(Mmsg1, M);                 \
+    Mxor = _mm_xor_si128(Mxor, M)
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha1_compress_shani(uint32_t digest[5], const uint32_t block[16])
+{
+    __m128i ABCD, ABCD_SAVE, E0, E0_SAVE, E1;
+    __m128i MSG0, MSG1, MSG2, MSG3;
+
+    /* the instructions want the first word in the most significant lane */
+    ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) digest), 0x1B);
+    E0 = _mm_set_epi32(digest[4], 0, 0, 0);
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E0;
+
+    MSG0 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (block + 0)), 0x1B);
+    MSG1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (block + 4)), 0x1B);
+    MSG2 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (block + 8)), 0x1B);
+    MSG3 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (block + 12)), 0x1B);
+
+    /* rounds 0-15 consume the block itself */
+    E0 = _mm_add_epi32(E0, MSG0);
+    E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+    E1 = _mm_sha1nexte_epu32(E1, MSG1);
+    E0 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+    MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+
+    E0 = _mm_sha1nexte_epu32(E0, MSG2);
+    E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+    MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+    MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+    E1 = _mm_sha1nexte_epu32(E1, MSG3);
+    E0 = ABCD;
+    MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+    MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+    MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+    /* rounds 16-67 */
+    SHANI4(E0, E1, MSG0, MSG1, MSG2, MSG3, 0);
+    SHANI4(E1, E0, MSG1, MSG2, MSG3, MSG0, 1);
+    SHANI4(E0, E1, MSG2, MSG3, MSG0, MSG1, 1);
+    SHANI4(E1, E0, MSG3, MSG0, MSG1, MSG2, 1);
+    SHANI4(E0, E1, MSG0, MSG1, MSG2, MSG3, 1);
+    SHANI4(E1, E0, MSG1, MSG2, MSG3, MSG0, 1);
+    SHANI4(E0, E1, MSG2, MSG3, MSG0, MSG1, 2);
+    SHANI4(E1, E0, MSG3, MSG0, MSG1, MSG2, 2);
+    SHANI4(E0, E1, MSG0, MSG1, MSG2, MSG3, 2);
+    SHANI4(E1, E0, MSG1, MSG2, MSG3, MSG0, 2);
+    SHANI4(E0, E1, MSG2, MSG3, MSG0, MSG1, 2);
+    SHANI4(E1, E0, MSG3, MSG0, MSG1, MSG2, 3);
+    SHANI4(E0, E1, MSG0, MSG1, MSG2, MSG3, 3);
+
+    /* rounds 68-79 only need to finish the last schedule words */
+    E1 = _mm_sha1nexte_epu32(E1, MSG1);
+    E0 = ABCD;
+    MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+    MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+    E0 = _mm_sha1nexte_epu32(E0, MSG2);
+    E1 = ABCD;
+    MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 3);
+
+    E1 = _mm_sha1nexte_epu32(E1, MSG3);
+    E0 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+
+    E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+    ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+
+    _mm_storeu_si128((__m128i *) digest, _mm_shuffle_epi32(ABCD, 0x1B));
+    digest[4] = _mm_extract_epi32(E0, 3);
+}
+
+/* SHA (CPUID.7.0:EBX[29]), SSSE3 and SSE4.1 (CPUID.1:ECX[9], [19]) */
+
+static int
+sha1_have_shani(void)
+{
+    /* Every thread works out the same answer; atomics keep the race defined */
+    static int have = -1;
+    unsigned int a, b, c, d;
+    int known = __atomic_load_n(&have, __ATOMIC_RELAXED);
+
+    if (known < 0) {
+        known = __get_cpuid(1, &a, &b, &c, &d) &&
+            (c & (1 << 9)) && (c & (1 << 19)) &&
+            __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1 << 29));
+        __atomic_store_n(&have, known, __ATOMIC_RELAXED);
+    }
+    return known;
+}
+
+#endif /* SHA1_HW_X86 */
+
+int
+sha1_compress_is_hw(void)
+{
+#ifdef SHA1_HW_X86
+    return sha1_have_shani();
+#else
+    return 0;
+#endif
+}
+
+/* compress one block that is already in host-order words */
+
+void
+sha1_compress(uint32_t digest[5], const uint32_t block[16])
+{
+    uint32_t W[SHA1_W_WORDS];
+
+#ifdef SHA1_HW_X86
+    if (sha1_have_shani()) {
+        sha1_compress_shani(digest, block);
+        return;
+    }
+#endif
+    memcpy(W, block, 16 * sizeof(uint32_t));
+    sha1_compress_words(digest, W);
+}
 
 static void
 sha1_transform(SHA1_INFO *sha1_info)
 {
     int i;
     uint8_t *dp;
-    uint32_t T, A, B, C, D, E, W[80], *WP;
+    uint32_t T, W[SHA1_W_WORDS];
 
     dp = sha1_info->data;
 
@@ -166,64 +413,25 @@ sha1_transform(SHA1_INFO *sha1_info)
     }
 #endif /* SWAP_DONE */
 
-    for (i = 16; i < 80; ++i) {
-    W[i] = W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16];
-    W[i] = R32(W[i], 1);
+#ifdef SHA1_HW_X86
+    if (sha1_have_shani()) {
+        sha1_compress_shani(sha1_info->digest, W);
+        return;
     }
-    A = sha1_info->digest[0];
-    B = sha1_info->digest[1];
-    C = sha1_info->digest[2];
-    D = sha1_info->digest[3];
-    E = sha1_info->digest[4];
-    WP = W;
-#ifdef UNRAVEL
-    FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1); FC(1); FD(1);
-    FE(1); FT(1); FA(1); FB(1); FC(1); FD(1); FE(1); FT(1); FA(1); FB(1);
-    FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2); FE(2); FT(2);
-    FA(2); FB(2); FC(2); FD(2); FE(2); FT(2); FA(2); FB(2); FC(2); FD(2);
-    FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3); FA(3); FB(3);
-    FC(3); FD(3); FE(3); FT(3); FA(3); FB(3); FC(3); FD(3); FE(3); FT(3);
-    FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4); FC(4); FD(4);
-    FE(4); FT(4); FA(4); FB(4); FC(4); FD(4); FE(4); FT(4); FA(4); FB(4);
-    sha1_info->digest[0] = T32(sha1_info->digest[0] + E);
-    sha1_info->digest[1] = T32(sha1_info->digest[1] + T);
-    sha1_info->digest[2] = T32(sha1_info->digest[2] + A);
-    sha1_info->digest[3] = T32(sha1_info->digest[3] + B);
-    sha1_info->digest[4] = T32(sha1_info->digest[4] + C);
-#else /* !UNRAVEL */
-#ifdef UNROLL_LOOPS
-    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
-    FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1); FG(1);
-    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
-    FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2); FG(2);
-    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
-    FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3); FG(3);
-    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
-    FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4); FG(4);
-#else /* !UNROLL_LOOPS */
-    for (i =  0; i < 20; ++i) { FG(1); }
-    for (i = 20; i < 40; ++i) { FG(2); }
-    for (i = 40; i < 60; ++i) { FG(3); }
-    for (i = 60; i < 80; ++i) { FG(4); }
-#endif /* !UNROLL_LOOPS */
-    sha1_info->digest[0] = T32(sha1_info->digest[0] + A);
-    sha1_info->digest[1] = T32(sha1_info->digest[1] + B);
-    sha1_info->digest[2] = T32(sha1_info->digest[2] + C);
-    sha1_info->digest[3] = T32(sha1_info->digest[3] + D);
-    sha1_info->digest[4] = T32(sha1_info->digest[4] + E);
-#endif /* !UNRAVEL */
+#endif
+    sha1_compress_words(sha1_info->digest, W);
 }
 
+const uint32_t sha1_initial_digest[5] = {
+    0x67452301L, 0xefcdab89L, 0x98badcfeL, 0x10325476L, 0xc3d2e1f0L
+};
+
 /* initialize the SHA digest */
 
 void
 sha1_init(SHA1_INFO *sha1_info)
 {
-    sha1_info->digest[0] = 0x67452301L;
-    sha1_info->digest[1] = 0xefcdab89L;
-    sha1_info->digest[2] = 0x98badcfeL;
-    sha1_info->digest[3] = 0x10325476L;
-    sha1_info->digest[4] = 0xc3d2e1f0L;
+    memcpy(sha1_info->digest, sha1_initial_digest, sizeof(sha1_info->digest));
     sha1_info->count_lo = 0L;
     sha1_info->count_hi = 0L;
     sha1_info->local = 0;
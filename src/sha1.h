@@ -24,16 +24,29 @@
 #define SHA1_DIGEST_LENGTH 20
 
 typedef struct {
-  uint32_t digest[8];
+  uint32_t digest[5];
   uint32_t count_lo, count_hi;
   uint8_t  data[SHA1_BLOCKSIZE];
   int      local;
 } SHA1_INFO;
 
+// The chaining value sha1_init() starts from.
+extern const uint32_t sha1_initial_digest[5] __attribute__((visibility("hidden")));
+
 void sha1_init(SHA1_INFO *sha1_info) __attribute__((visibility("hidden")));
 void sha1_update(SHA1_INFO *sha1_info, const uint8_t *buffer, int count)
   __attribute__((visibility("hidden")));
 void sha1_final(SHA1_INFO *sha1_info, uint8_t digest[20])
   __attribute__((visibility("hidden")));
 
+// Run the compression function over a single 64 byte block supplied as
+// sixteen big-endian words already converted to host order. Callers that
+// build their own padded blocks use this to skip sha1_update()'s buffering.
+void sha1_compress(uint32_t digest[5], const uint32_t block[16])
+  __attribute__((visibility("hidden")));
+
+// Whether sha1_compress() runs on the SHA extensions: never when built with
+// SHA1_NO_HW or off x86.
+int sha1_compress_is_hw(void) __attribute__((visibility("hidden")));
+
 #endif
@@ -0,0 +1,218 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*****************************************************************************
+ *
+ * File:    sha256.c
+ *
+ * Purpose: Implementation of the SHA-256 message-digest algorithm
+ *          (FIPS 180-4), laid out like sha1.c: an unrolled compression
+ *          function over a rolling 16 word message schedule, plus the same
+ *          init/update/final interface.
+ *
+ *****************************************************************************
+*/
+#include <string.h>
+
+#include "sha256.h"
+
+/* 32-bit rotate right */
+#define ROTR(x,n)    (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* SHA-256 functions */
+#define CH(x,y,z)    ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x,y,z)   (((x) & (y)) | ((z) & ((x) | (y))))
+#define S0(x)        (ROTR(x,2) ^ ROTR(x,13) ^ ROTR(x,22))
+#define S1(x)        (ROTR(x,6) ^ ROTR(x,11) ^ ROTR(x,25))
+#define s0(x)        (ROTR(x,7) ^ ROTR(x,18) ^ ((x) >> 3))
+#define s1(x)        (ROTR(x,17) ^ ROTR(x,19) ^ ((x) >> 10))
+
+/* SHA-256 constants */
+static const uint32_t K[64] = {
+    0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL,
+    0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+    0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL,
+    0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+    0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+    0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+    0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL,
+    0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+    0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL,
+    0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+    0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL,
+    0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+    0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL,
+    0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+    0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+    0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+const uint32_t sha256_initial_digest[8] = {
+    0x6a09e667UL, 0xbb67ae85UL, 0x3c6ef372UL, 0xa54ff53aUL,
+    0x510e527fUL, 0x9b05688cUL, 0x1f83d9abUL, 0x5be0cd19UL
+};
+
+/* the message schedule, in a rolling window of 16 words */
+#define W(i)         W[(i) & 15]
+#define SCHEDULE(i)  (W(i) += s1(W((i) - 2)) + W((i) - 7) + s0(W((i) - 15)))
+
+/*
+ * One round. Instead of shifting eight variables down every round, each
+ * round names them in rotated order, so that after eight rounds every
+ * variable is back under its own name.
+ */
+#define ROUND(a,b,c,d,e,f,g,h,i,w)                      \
+    T = h + S1(e) + CH(e,f,g) + K[i] + (w);             \
+    d += T;                                             \
+    h = T + S0(a) + MAJ(a,b,c)
+
+#define ROUNDS8(i,w)                                    \
+    ROUND(A,B,C,D,E,F,G,H,(i)+0,w((i)+0));              \
+    ROUND(H,A,B,C,D,E,F,G,(i)+1,w((i)+1));              \
+    ROUND(G,H,A,B,C,D,E,F,(i)+2,w((i)+2));              \
+    ROUND(F,G,H,A,B,C,D,E,(i)+3,w((i)+3));              \
+    ROUND(E,F,G,H,A,B,C,D,(i)+4,w((i)+4));              \
+    ROUND(D,E,F,G,H,A,B,C,(i)+5,w((i)+5));              \
+    ROUND(C,D,E,F,G,H,A,B,(i)+6,w((i)+6));              \
+    ROUND(B,C,D,E,F,G,H,A,(i)+7,w((i)+7))
+
+/* compress one block that is already in host-order words */
+
+void
+sha256_compress(uint32_t digest[8], const uint32_t block[16])
+{
+    int i;
+    uint32_t T, A, B, C, D, E, F, G, H, W[16];
+
+    memcpy(W, block, sizeof(W));
+    A = digest[0];
+    B = digest[1];
+    C = digest[2];
+    D = digest[3];
+    E = digest[4];
+    F = digest[5];
+    G = digest[6];
+    H = digest[7];
+
+    for (i = 0; i < 16; i += 8) {
+        ROUNDS8(i, W);
+    }
+    for (; i < 64; i += 8) {
+        ROUNDS8(i, SCHEDULE);
+    }
+
+    digest[0] += A;
+    digest[1] += B;
+    digest[2] += C;
+    digest[3] += D;
+    digest[4] += E;
+    digest[5] += F;
+    digest[6] += G;
+    digest[7] += H;
+}
+
+static void
+sha256_transform(SHA256_INFO *sha256_info)
+{
+    int i;
+    const uint8_t *dp = sha256_info->data;
+    uint32_t W[16];
+
+    for (i = 0; i < 16; ++i, dp += 4) {
+        W[i] = (uint32_t) dp[0] << 24 |
+            (uint32_t) dp[1] << 16 |
+            (uint32_t) dp[2] << 8 |
+            (uint32_t) dp[3];
+    }
+    sha256_compress(sha256_info->digest, W);
+}
+
+/* initialize the SHA-256 digest */
+
+void
+sha256_init(SHA256_INFO *sha256_info)
+{
+    memcpy(sha256_info->digest, sha256_initial_digest, sizeof(sha256_info->digest));
+    sha256_info->count_lo = 0;
+    sha256_info->count_hi = 0;
+    sha256_info->local = 0;
+}
+
+/* update the SHA-256 digest */
+
+void
+sha256_update(SHA256_INFO *sha256_info, const uint8_t *buffer, int count)
+{
+    int i;
+    uint32_t clo;
+
+    clo = sha256_info->count_lo + ((uint32_t) count << 3);
+    if (clo < sha256_info->count_lo) {
+    ++sha256_info->count_hi;
+    }
+    sha256_info->count_lo = clo;
+    if (sha256_info->local) {
+    i = SHA256_BLOCKSIZE - sha256_info->local;
+    if (i > count) {
+        i = count;
+    }
+    memcpy(sha256_info->data + sha256_info->local, buffer, i);
+    count -= i;
+    buffer += i;
+    sha256_info->local += i;
+    if (sha256_info->local == SHA256_BLOCKSIZE) {
+        sha256_transform(sha256_info);
+        sha256_info->local = 0;
+    } else {
+        return;
+    }
+    }
+    while (count >= SHA256_BLOCKSIZE) {
+    memcpy(sha256_info->data, buffer, SHA256_BLOCKSIZE);
+    buffer += SHA256_BLOCKSIZE;
+    count -= SHA256_BLOCKSIZE;
+    sha256_transform(sha256_info);
+    }
+    memcpy(sha256_info->data, buffer, count);
+    sha256_info->local = count;
+}
+
+/* finish computing the SHA-256 digest */
+
+void
+sha256_final(SHA256_INFO *sha256_info, uint8_t digest[32])
+{
+    int i, count;
+
+    count = sha256_info->local;
+    sha256_info->data[count++] = 0x80;
+    if (count > SHA256_BLOCKSIZE - 8) {
+    memset(sha256_info->data + count, 0, SHA256_BLOCKSIZE - count);
+    sha256_transform(sha256_info);
+    count = 0;
+    }
+    memset(sha256_info->data + count, 0, SHA256_BLOCKSIZE - 8 - count);
+    for (i = 0; i < 4; ++i) {
+    sha256_info->data[SHA256_BLOCKSIZE - 8 + i] =
+        (uint8_t) (sha256_info->count_hi >> (24 - 8 * i));
+    sha256_info->data[SHA256_BLOCKSIZE - 4 + i] =
+        (uint8_t) (sha256_info->count_lo >> (24 - 8 * i));
+    }
+    sha256_transform(sha256_info);
+    for (i = 0; i < 32; ++i) {
+    digest[i] = (uint8_t) (sha256_info->digest[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+/***EOF***/
@@ -0,0 +1,44 @@
+// SHA-256 header file
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SHA256_H__
+#define SHA256_H__
+
+#include <stdint.h>
+
+#define SHA256_BLOCKSIZE     64
+#define SHA256_DIGEST_LENGTH 32
+
+typedef struct {
+  uint32_t digest[8];
+  uint32_t count_lo, count_hi;
+  uint8_t  data[SHA256_BLOCKSIZE];
+  int      local;
+} SHA256_INFO;
+
+// The chaining value sha256_init() starts from.
+extern const uint32_t sha256_initial_digest[8] __attribute__((visibility("hidden")));
+
+void sha256_init(SHA256_INFO *sha256_info) __attribute__((visibility("hidden")));
+void sha256_update(SHA256_INFO *sha256_info, const uint8_t *buffer, int count)
+  __attribute__((visibility("hidden")));
+void sha256_final(SHA256_INFO *sha256_info, uint8_t digest[32])
+  __attribute__((visibility("hidden")));
+
+// As sha1_compress(): run the compression function over one block given as
+// sixteen big-endian 32-bit words already converted to host order.
+void sha256_compress(uint32_t digest[8], const uint32_t block[16])
+  __attribute__((visibility("hidden")));
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*****************************************************************************
+ *
+ * File:    sha512.c
+ *
+ * Purpose: Implementation of the SHA-512 message-digest algorithm
+ *          (FIPS 180-4), laid out like sha1.c: an unrolled compression
+ *          function over a rolling 16 word message schedule, plus the same
+ *          init/update/final interface.
+ *
+ *****************************************************************************
+*/
+#include <string.h>
+
+#include "sha512.h"
+
+/* 64-bit rotate right */
+#define ROTR(x,n)    (((x) >> (n)) | ((x) << (64 - (n))))
+
+/* SHA-512 functions */
+#define CH(x,y,z)    ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x,y,z)   (((x) & (y)) | ((z) & ((x) | (y))))
+#define S0(x)        (ROTR(x,28) ^ ROTR(x,34) ^ ROTR(x,39))
+#define S1(x)        (ROTR(x,14) ^ ROTR(x,18) ^ ROTR(x,41))
+#define s0(x)        (ROTR(x,1) ^ ROTR(x,8) ^ ((x) >> 7))
+#define s1(x)        (ROTR(x,19) ^ ROTR(x,61) ^ ((x) >> 6))
+
+/* SHA-512 constants */
+static const uint64_t K[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL,
+    0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+    0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+    0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL,
+    0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+    0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL,
+    0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL,
+    0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+    0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL,
+    0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL,
+    0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+    0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL,
+    0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+    0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+    0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL,
+    0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL,
+    0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+    0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+    0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL,
+    0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+    0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+const uint64_t sha512_initial_digest[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+    0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+/* the message schedule, in a rolling window of 16 words */
+#define W(i)         W[(i) & 15]
+#define SCHEDULE(i)  (W(i) += s1(W((i) - 2)) + W((i) - 7) + s0(W((i) - 15)))
+
+/*
+ * One round. Instead of shifting eight variables down every round, each
+ * round names them in rotated order, so that after eight rounds every
+ * variable is back under its own name.
+ */
+#define ROUND(a,b,c,d,e,f,g,h,i,w)                      \
+    T = h + S1(e) + CH(e,f,g) + K[i] + (w);             \
+    d += T;                                             \
+    h = T + S0(a) + MAJ(a,b,c)
+
+#define ROUNDS8(i,w)                                    \
+    ROUND(A,B,C,D,E,F,G,H,(i)+0,w((i)+0));              \
+    ROUND(H,A,B,C,D,E,F,G,(i)+1,w((i)+1));              \
+    ROUND(G,H,A,B,C,D,E,F,(i)+2,w((i)+2));              \
+    ROUND(F,G,H,A,B,C,D,E,(i)+3,w((i)+3));              \
+    ROUND(E,F,G,H,A,B,C,D,(i)+4,w((i)+4));              \
+    ROUND(D,E,F,G,H,A,B,C,(i)+5,w((i)+5));              \
+    ROUND(C,D,E,F,G,H,A,B,(i)+6,w((i)+6));              \
+    ROUND(B,C,D,E,F,G,H,A,(i)+7,w((i)+7))
+
+/* compress one block that is already in host-order words */
+
+void
+sha512_compress(uint64_t digest[8], const uint64_t block[16])
+{
+    int i;
+    uint64_t T, A, B, C, D, E, F, G, H, W[16];
+
+    memcpy(W, block, sizeof(W));
+    A = digest[0];
+    B = digest[1];
+    C = digest[2];
+    D = digest[3];
+    E = digest[4];
+    F = digest[5];
+    G = digest[6];
+    H = digest[7];
+
+    for (i = 0; i < 16; i += 8) {
+        ROUNDS8(i, W);
+    }
+    for (; i < 80; i += 8) {
+        ROUNDS8(i, SCHEDULE);
+    }
+
+    digest[0] += A;
+    digest[1] += B;
+    digest[2] += C;
+    digest[3] += D;
+    digest[4] += E;
+    digest[5] += F;
+    digest[6] += G;
+    digest[7] += H;
+}
+
+static void
+sha512_transform(SHA512_INFO *sha512_info)
+{
+    int i;
+    const uint8_t *dp = sha512_info->data;
+    uint64_t W[16];
+
+    for (i = 0; i < 16; ++i, dp += 8) {
+        W[i] = (uint64_t) dp[0] << 56 |
+            (uint64_t) dp[1] << 48 |
+            (uint64_t) dp[2] << 40 |
+            (uint64_t) dp[3] << 32 |
+            (uint64_t) dp[4] << 24 |
+            (uint64_t) dp[5] << 16 |
+            (uint64_t) dp[6] << 8 |
+            (uint64_t) dp[7];
+    }
+    sha512_compress(sha512_info->digest, W);
+}
+
+/* initialize the SHA-512 digest */
+
+void
+sha512_init(SHA512_INFO *sha512_info)
+{
+    memcpy(sha512_info->digest, sha512_initial_digest, sizeof(sha512_info->digest));
+    sha512_info->count_lo = 0;
+    sha512_info->count_hi = 0;
+    sha512_info->local = 0;
+}
+
+/* update the SHA-512 digest */
+
+void
+sha512_update(SHA512_INFO *sha512_info, const uint8_t *buffer, int count)
+{
+    int i;
+    uint64_t clo;
+
+    clo = sha512_info->count_lo + ((uint64_t) count << 3);
+    if (clo < sha512_info->count_lo) {
+    ++sha512_info->count_hi;
+    }
+    sha512_info->count_lo = clo;
+    if (sha512_info->local) {
+    i = SHA512_BLOCKSIZE - sha512_info->local;
+    if (i > count) {
+        i = count;
+    }
+    memcpy(sha512_info->data + sha512_info->local, buffer, i);
+    count -= i;
+    buffer += i;
+    sha512_info->local += i;
+    if (sha512_info->local == SHA512_BLOCKSIZE) {
+        sha512_transform(sha512_info);
+        sha512_info->local = 0;
+    } else {
+        return;
+    }
+    }
+    while (count >= SHA512_BLOCKSIZE) {
+    memcpy(sha512_info->data, buffer, SHA512_BLOCKSIZE);
+    buffer += SHA512_BLOCKSIZE;
+    count -= SHA512_BLOCKSIZE;
+    sha512_transform(sha512_info);
+    }
+    memcpy(sha512_info->data, buffer, count);
+    sha512_info->local = count;
+}
+
+/* finish computing the SHA-512 digest */
+
+void
+sha512_final(SHA512_INFO *sha512_info, uint8_t digest[64])
+{
+    int i, count;
+
+    count = sha512_info->local;
+    sha512_info->data[count++] = 0x80;
+    if (count > SHA512_BLOCKSIZE - 16) {
+    memset(sha512_info->data + count, 0, SHA512_BLOCKSIZE - count);
+    sha512_transform(sha512_info);
+    count = 0;
+    }
+    memset(sha512_info->data + count, 0, SHA512_BLOCKSIZE - 16 - count);
+    for (i = 0; i < 8; ++i) {
+    sha512_info->data[SHA512_BLOCKSIZE - 16 + i] =
+        (uint8_t) (sha512_info->count_hi >> (56 - 8 * i));
+    sha512_info->data[SHA512_BLOCKSIZE - 8 + i] =
+        (uint8_t) (sha512_info->count_lo >> (56 - 8 * i));
+    }
+    sha512_transform(sha512_info);
+    for (i = 0; i < 64; ++i) {
+    digest[i] = (uint8_t) (sha512_info->digest[i / 8] >> (56 - 8 * (i % 8)));
+    }
+}
+
+/***EOF***/
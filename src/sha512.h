@@ -0,0 +1,44 @@
+// SHA-512 header file
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SHA512_H__
+#define SHA512_H__
+
+#include <stdint.h>
+
+#define SHA512_BLOCKSIZE     128
+#define SHA512_DIGEST_LENGTH 64
+
+typedef struct {
+  uint64_t digest[8];
+  uint64_t count_lo, count_hi;
+  uint8_t  data[SHA512_BLOCKSIZE];
+  int      local;
+} SHA512_INFO;
+
+// The chaining value sha512_init() starts from.
+extern const uint64_t sha512_initial_digest[8] __attribute__((visibility("hidden")));
+
+void sha512_init(SHA512_INFO *sha512_info) __attribute__((visibility("hidden")));
+void sha512_update(SHA512_INFO *sha512_info, const uint8_t *buffer, int count)
+  __attribute__((visibility("hidden")));
+void sha512_final(SHA512_INFO *sha512_info, uint8_t digest[64])
+  __attribute__((visibility("hidden")));
+
+// As sha1_compress(): run the compression function over one block given as
+// sixteen big-endian 64-bit words already converted to host order.
+void sha512_compress(uint64_t digest[8], const uint64_t block[16])
+  __attribute__((visibility("hidden")));
+
+#endif
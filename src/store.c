@@ -0,0 +1,555 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "store.h"
+#include "tokens.h"
+
+#define STORE_HEADER_SIZE 7
+#define STORE_RECORD_SIZE 4 // Without the name and secret
+
+// Journal entries, each a tag and its operands.
+#define JOURNAL_CHUNK     'j'
+#define JOURNAL_PUT       'P' // A token record, as in the store
+#define JOURNAL_DELETE    'D' // id
+#define JOURNAL_ORDER     'O' // count, then that many ids
+#define JOURNAL_CLEAR     'C'
+
+// The layout before the packed store.
+#define P_TOKENS_COUNT    2
+#define P_TOKENS_START    10000
+#define P_SECRETS_START   20000
+
+// The record under P_TOKENS_START + position: what used to be the head of
+// TokenInfo, pointer to the secret and all. Its tokens are all HMAC-SHA1 with
+// the default digits and period.
+typedef struct LegacyTokenRecord {
+  char name[MAX_NAME_LENGTH + 1];
+  short id;
+  uint8_t secret_length;
+  uint32_t unused; // Was the secret pointer
+} LegacyTokenRecord;
+
+// One chunk of the stream at a time, so neither direction needs the whole
+// store in memory.
+typedef struct {
+  uint8_t chunk[PERSIST_DATA_MAX_LENGTH];
+  int used; // Bytes of chunk filled (writing) or consumed (reading)
+  int length; // Bytes in chunk (reading)
+  int index; // Of the chunk, from P_STORE_START
+  uint32_t crc;
+} StoreStream;
+
+// Shared by loading, saving and the journal, which never overlap.
+static StoreStream stream;
+
+// Changes since the last save or flush: a bit per token ID changed, and
+// another per ID deleted along the way, and whether the tokens were reordered
+// or cleared.
+static uint8_t dirty_ids[256 / 8];
+static uint8_t deleted_ids[256 / 8];
+static bool dirty_order = false;
+static bool dirty_cleared = false;
+
+// Chunks in the journal.
+static int journal_chunks = 0;
+
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, int length) {
+  crc = ~crc;
+  while (length--) {
+    crc ^= *data++;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+static bool stream_read(StoreStream* stream, void* out, int length, bool checked) {
+  uint8_t* dst = out;
+  while (length) {
+    if (stream->used == stream->length) {
+      int read = persist_read_data(P_STORE_START + stream->index, stream->chunk, sizeof(stream->chunk));
+      if (read <= 0) {
+        return false;
+      }
+      stream->index++;
+      stream->used = 0;
+      stream->length = read;
+    }
+    int n = stream->length - stream->used;
+    if (n > length) {
+      n = length;
+    }
+    memcpy(dst, stream->chunk + stream->used, n);
+    if (checked) {
+      stream->crc = crc32_update(stream->crc, dst, n);
+    }
+    stream->used += n;
+    dst += n;
+    length -= n;
+  }
+  return true;
+}
+
+// Writes out the chunk unless the store already holds exactly these bytes.
+static void stream_flush(StoreStream* stream) {
+  static uint8_t current[PERSIST_DATA_MAX_LENGTH];
+  uint32_t key = P_STORE_START + stream->index;
+  if (persist_get_size(key) != stream->used ||
+      persist_read_data(key, current, stream->used) != stream->used ||
+      memcmp(current, stream->chunk, stream->used)) {
+    persist_write_data(key, stream->chunk, stream->used);
+  }
+  memset(current, 0, sizeof(current));
+  stream->index++;
+  stream->used = 0;
+}
+
+static void stream_write(StoreStream* stream, const void* data, int length, bool checked) {
+  const uint8_t* src = data;
+  if (checked) {
+    stream->crc = crc32_update(stream->crc, src, length);
+  }
+  while (length) {
+    int n = sizeof(stream->chunk) - stream->used;
+    if (n > length) {
+      n = length;
+    }
+    memcpy(stream->chunk + stream->used, src, n);
+    stream->used += n;
+    src += n;
+    length -= n;
+    if (stream->used == sizeof(stream->chunk)) {
+      stream_flush(stream);
+    }
+  }
+}
+
+static uint32_t read_crc(const uint8_t* crc) {
+  return crc[0] | crc[1] << 8 | crc[2] << 16 | (uint32_t)crc[3] << 24;
+}
+
+static uint8_t pack_settings(const TokenInfo* key) {
+  uint8_t period = key->period == 15 ? 0 : key->period == 30 ? 1 : 2;
+  return key->algorithm | (key->digits - MIN_CODE_DIGITS) << 2 | period << 4;
+}
+
+static void unpack_settings(uint8_t settings, TokenInfo* info) {
+  info->algorithm = settings & 3;
+  info->digits = MIN_CODE_DIGITS + ((settings >> 2) & 3);
+  info->period = 15 << ((settings >> 4) & 3);
+  token_sanitize(info);
+}
+
+// Reads a token record - as in the store, after the header, or in a journal
+// put - into the table. Returns false if it's malformed or doesn't fit.
+static bool read_token(bool (*read)(void* out, int length)) {
+  uint8_t record[STORE_RECORD_SIZE];
+  char name[MAX_NAME_LENGTH + 1] = { 0 };
+  if (!read(record, sizeof(record)) || record[3] > MAX_NAME_LENGTH || !read(name, record[3])) {
+    return false;
+  }
+  TokenInfo info = { .id = record[0], .secret_length = record[2] };
+  unpack_settings(record[1], &info);
+  TokenInfo* key = token_list_add(&info, name);
+  return key && read(token_secret(key), key->secret_length);
+}
+
+static int token_record_size(const TokenInfo* key) {
+  return STORE_RECORD_SIZE + strlen(token_name(key)) + key->secret_length;
+}
+
+static bool stream_read_checked(void* out, int length) {
+  return stream_read(&stream, out, length, true);
+}
+
+static void stream_write_token(const TokenInfo* key) {
+  const char* name = token_name(key);
+  uint8_t record[STORE_RECORD_SIZE] = { key->id, pack_settings(key), key->secret_length, strlen(name) };
+  stream_write(&stream, record, sizeof(record), true);
+  stream_write(&stream, name, record[3], true);
+  stream_write(&stream, token_secret(key), key->secret_length, true);
+}
+
+static bool store_load_packed(void) {
+  memset(&stream, 0, sizeof(stream));
+  uint8_t header[STORE_HEADER_SIZE];
+  if (!stream_read(&stream, header, sizeof(header), true) ||
+      header[0] != 'p' || header[1] != 'T' || header[2] != STORE_VERSION) {
+    return false;
+  }
+  int count = header[3];
+  int length = header[4] | header[5] << 8 | header[6] << 16;
+
+  bool ok = true;
+  int read = 0;
+  for (int i = 0; i < count && ok && read < length; ++i) {
+    ok = read_token(stream_read_checked);
+    if (ok) {
+      read += token_record_size(token_by_list_index(token_list_length() - 1));
+    }
+  }
+
+  uint8_t crc[4];
+  uint32_t expected = stream.crc;
+  ok = ok && read == length && token_list_length() == count &&
+       stream_read(&stream, crc, sizeof(crc), false) &&
+       read_crc(crc) == expected;
+  memset(&stream, 0, sizeof(stream));
+  if (!ok) {
+    APP_LOG(APP_LOG_LEVEL_ERROR, "Token store is corrupt");
+    token_list_clear();
+  }
+  return ok;
+}
+
+static bool store_load_legacy(void) {
+  if (!persist_exists(P_TOKENS_COUNT)) {
+    return false;
+  }
+  int ct = persist_read_int(P_TOKENS_COUNT);
+  APP_LOG(APP_LOG_LEVEL_INFO, "Migrating %d tokens", ct);
+  for (int i = 0; i < ct; ++i) {
+    LegacyTokenRecord stored;
+    persist_read_data(P_TOKENS_START + i, &stored, sizeof(LegacyTokenRecord));
+    stored.name[MAX_NAME_LENGTH] = 0;
+    TokenInfo info = {
+      .id = stored.id,
+      .secret_length = stored.secret_length,
+      .algorithm = HMAC_SHA1,
+      .digits = DEFAULT_DIGITS,
+      .period = DEFAULT_PERIOD
+    };
+    TokenInfo* key = token_list_add(&info, stored.name);
+    if (!key) {
+      APP_LOG(APP_LOG_LEVEL_ERROR, "No room for token %d", info.id);
+      continue;
+    }
+    persist_read_data(P_SECRETS_START + key->id, token_secret(key), key->secret_length);
+  }
+  return true;
+}
+
+static void store_delete_legacy(void) {
+  int ct = persist_read_int(P_TOKENS_COUNT);
+  for (int i = 0; i < ct; ++i) {
+    persist_delete(P_TOKENS_START + i);
+  }
+  // Secrets were keyed by ID, and deleted tokens' secrets were deleted with them.
+  for (short id = 0; id < 256; ++id) {
+    if (persist_exists(P_SECRETS_START + id)) {
+      persist_delete(P_SECRETS_START + id);
+    }
+  }
+  persist_delete(P_TOKENS_COUNT);
+}
+
+// The journal chunk being replayed, consumed front to back.
+static const uint8_t* replay_data;
+static int replay_length;
+
+static bool replay_read(void* out, int length) {
+  if (length > replay_length) {
+    return false;
+  }
+  memcpy(out, replay_data, length);
+  replay_data += length;
+  replay_length -= length;
+  return true;
+}
+
+// Applies a journal chunk's entries to the table. Each entry leaves the table
+// the same however often it's applied, so replaying a journal the store
+// already took in (after a compaction that stopped short) does no harm.
+static bool journal_replay(const uint8_t* chunk, int length) {
+  replay_data = chunk + 1;
+  replay_length = length - 1;
+  uint8_t op, operand;
+  while (replay_read(&op, 1)) {
+    switch (op) {
+      case JOURNAL_PUT:
+        if (!read_token(replay_read)) {
+          return false;
+        }
+        break;
+      case JOURNAL_DELETE:
+        if (!replay_read(&operand, 1)) {
+          return false;
+        }
+        token_list_delete(operand);
+        break;
+      case JOURNAL_ORDER:
+        if (!replay_read(&operand, 1) || operand > replay_length) {
+          return false;
+        }
+        token_list_reorder(replay_data, operand);
+        replay_data += operand;
+        replay_length -= operand;
+        break;
+      case JOURNAL_CLEAR:
+        token_list_clear();
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
+// Replays the journal in order, stopping at the first chunk that isn't
+// intact - the one being written when the app stopped - and dropping it and
+// anything after.
+static void journal_load(void) {
+  journal_chunks = 0;
+  while (persist_exists(P_JOURNAL_START + journal_chunks)) {
+    int length = persist_read_data(P_JOURNAL_START + journal_chunks, stream.chunk, sizeof(stream.chunk));
+    if (length < 5 || stream.chunk[0] != JOURNAL_CHUNK ||
+        read_crc(stream.chunk + length - 4) != crc32_update(0, stream.chunk, length - 4) ||
+        !journal_replay(stream.chunk, length - 4)) {
+      APP_LOG(APP_LOG_LEVEL_ERROR, "Journal chunk %d is corrupt", journal_chunks);
+      for (int index = journal_chunks; persist_exists(P_JOURNAL_START + index); ++index) {
+        persist_delete(P_JOURNAL_START + index);
+      }
+      break;
+    }
+    journal_chunks++;
+  }
+  memset(&stream, 0, sizeof(stream));
+}
+
+bool store_load(void) {
+  bool loaded = store_load_packed();
+  if (loaded) {
+    if (persist_exists(P_TOKENS_COUNT)) {
+      store_delete_legacy(); // A migration that stopped short.
+    }
+    journal_load();
+  } else if (store_load_legacy()) {
+    // The old keys are only deleted once the packed store is written, so if
+    // they're still here they're the ones to trust.
+    store_save();
+    store_delete_legacy();
+    loaded = true;
+  }
+
+  for (short i = 0; i < token_list_length(); ++i) {
+    token_prepare_key(token_by_list_index(i));
+  }
+  if (journal_chunks > STORE_JOURNAL_MAX_CHUNKS) {
+    store_save();
+  }
+  return loaded;
+}
+
+static void store_clean(void) {
+  memset(dirty_ids, 0, sizeof(dirty_ids));
+  memset(deleted_ids, 0, sizeof(deleted_ids));
+  dirty_order = dirty_cleared = false;
+}
+
+void store_save(void) {
+  memset(&stream, 0, sizeof(stream));
+
+  int length = 0;
+  for (short i = 0; i < token_list_length(); ++i) {
+    length += token_record_size(token_by_list_index(i));
+  }
+  uint8_t header[STORE_HEADER_SIZE] = {
+    'p', 'T', STORE_VERSION, token_list_length(), length, length >> 8, length >> 16
+  };
+  stream_write(&stream, header, sizeof(header), true);
+
+  for (short i = 0; i < token_list_length(); ++i) {
+    stream_write_token(token_by_list_index(i));
+  }
+
+  uint8_t crc[4] = { stream.crc, stream.crc >> 8, stream.crc >> 16, stream.crc >> 24 };
+  stream_write(&stream, crc, sizeof(crc), false);
+  if (stream.used) {
+    stream_flush(&stream);
+  }
+
+  // Drop the chunks a longer store left behind, then the journal it replaces.
+  for (int index = stream.index; persist_exists(P_STORE_START + index); ++index) {
+    persist_delete(P_STORE_START + index);
+  }
+  for (int index = 0; persist_exists(P_JOURNAL_START + index); ++index) {
+    persist_delete(P_JOURNAL_START + index);
+  }
+  journal_chunks = 0;
+  store_clean();
+
+  APP_LOG(APP_LOG_LEVEL_INFO, "Saved %d tokens in %d chunks", token_list_length(), stream.index);
+  memset(&stream, 0, sizeof(stream));
+}
+
+void store_token_changed(short id) {
+  dirty_ids[id >> 3] |= 1 << (id & 7);
+  if (!token_by_id(id)) {
+    deleted_ids[id >> 3] |= 1 << (id & 7);
+  }
+}
+
+void store_order_changed(void) {
+  dirty_order = true;
+}
+
+void store_tokens_cleared(void) {
+  dirty_cleared = true;
+  memset(dirty_ids, 0, sizeof(dirty_ids));
+  memset(deleted_ids, 0, sizeof(deleted_ids));
+  dirty_order = false;
+}
+
+bool store_is_dirty(void) {
+  if (dirty_order || dirty_cleared) {
+    return true;
+  }
+  for (unsigned i = 0; i < sizeof(dirty_ids); ++i) {
+    if (dirty_ids[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Seals the journal chunk in stream.chunk with its CRC and writes it.
+static void journal_write_chunk(void) {
+  uint32_t crc = crc32_update(0, stream.chunk, stream.used);
+  uint8_t* end = stream.chunk + stream.used;
+  end[0] = crc;
+  end[1] = crc >> 8;
+  end[2] = crc >> 16;
+  end[3] = crc >> 24;
+  persist_write_data(P_JOURNAL_START + stream.index, stream.chunk, stream.used + 4);
+}
+
+// Makes room for an entry of length bytes in the journal chunk being built,
+// moving on to a new chunk if the current one is full. False if it wouldn't
+// fit even in an empty chunk.
+static bool journal_reserve(int length) {
+  if (1 + length + 4 > (int)sizeof(stream.chunk)) {
+    return false;
+  }
+  if (stream.used + length + 4 > (int)sizeof(stream.chunk)) {
+    journal_write_chunk();
+    stream.index++;
+    stream.chunk[0] = JOURNAL_CHUNK;
+    stream.used = 1;
+  }
+  return true;
+}
+
+static bool journal_append(const void* data, int length) {
+  if (!journal_reserve(length)) {
+    return false;
+  }
+  memcpy(stream.chunk + stream.used, data, length);
+  stream.used += length;
+  return true;
+}
+
+static bool journal_append_token(const TokenInfo* key) {
+  const char* name = token_name(key);
+  uint8_t record[1 + STORE_RECORD_SIZE] = { JOURNAL_PUT, key->id, pack_settings(key), key->secret_length, strlen(name) };
+  if (!journal_reserve(sizeof(record) + record[4] + key->secret_length)) {
+    return false;
+  }
+  journal_append(record, sizeof(record));
+  journal_append(name, record[4]);
+  journal_append(token_secret(key), key->secret_length);
+  return true;
+}
+
+// Appends the pending changes to the journal. False if one of them doesn't
+// fit in a chunk (a reorder of hundreds of tokens, say), leaving the caller to
+// save the whole store instead.
+static bool journal_flush(void) {
+  memset(&stream, 0, sizeof(stream));
+  // Carry on in the last chunk if it has room, otherwise start the next.
+  stream.index = journal_chunks;
+  stream.chunk[0] = JOURNAL_CHUNK;
+  stream.used = 1;
+  if (journal_chunks) {
+    int length = persist_read_data(P_JOURNAL_START + journal_chunks - 1, stream.chunk, sizeof(stream.chunk));
+    if (length > 5 && length < (int)sizeof(stream.chunk)) {
+      stream.index = journal_chunks - 1;
+      stream.used = length - 4;
+    } else {
+      stream.chunk[0] = JOURNAL_CHUNK;
+      stream.used = 1;
+    }
+  }
+
+  bool ok = true;
+  if (dirty_cleared) {
+    uint8_t op = JOURNAL_CLEAR;
+    ok = journal_append(&op, 1);
+  }
+  // Deletes first, so a token deleted and created again is appended on
+  // replay, as it was to the table, rather than updated where it was.
+  for (short id = 0; id < 256 && ok; ++id) {
+    if (deleted_ids[id >> 3] & 1 << (id & 7)) {
+      uint8_t entry[2] = { JOURNAL_DELETE, id };
+      ok = journal_append(entry, sizeof(entry));
+    }
+  }
+  // Then puts in display order, so created tokens are appended in the order
+  // they were created.
+  for (short i = 0; i < token_list_length() && ok; ++i) {
+    TokenInfo* key = token_by_list_index(i);
+    if (dirty_ids[key->id >> 3] & 1 << (key->id & 7)) {
+      ok = journal_append_token(key);
+    }
+  }
+  if (dirty_order && ok) {
+    uint8_t entry[2] = { JOURNAL_ORDER, token_list_length() };
+    ok = journal_reserve(sizeof(entry) + entry[1]) && journal_append(entry, sizeof(entry));
+    for (short i = 0; i < token_list_length() && ok; ++i) {
+      uint8_t id = token_by_list_index(i)->id;
+      journal_append(&id, 1);
+    }
+  }
+
+  if (ok && stream.used > 1) {
+    journal_write_chunk();
+    journal_chunks = stream.index + 1;
+  }
+  memset(&stream, 0, sizeof(stream));
+  return ok;
+}
+
+// Whether a token was deleted or the table cleared since the last flush, in
+// which case the store is saved in full: a deleted token's secret must not be
+// left in the store or the journal.
+static bool store_has_deletes(void) {
+  if (dirty_cleared) {
+    return true;
+  }
+  for (unsigned i = 0; i < sizeof(deleted_ids); ++i) {
+    if (deleted_ids[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void store_flush(void) {
+  if (!store_is_dirty()) {
+    return;
+  }
+  if (store_has_deletes() || !journal_flush() || journal_chunks > STORE_JOURNAL_MAX_CHUNKS) {
+    store_save();
+    return;
+  }
+  store_clean();
+}
@@ -0,0 +1,83 @@
+// Persistent storage of the token table.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _STORE_H_
+#define _STORE_H_
+
+#include "pebble.h"
+
+// The tokens are saved as one packed stream, cut into PERSIST_DATA_MAX_LENGTH
+// chunks under consecutive keys from P_STORE_START:
+//
+//   'p' 'T' version count length(3)     header, little-endian
+//   id settings secret_length name_length name secret
+//                                       per token, in display order
+//   crc32(4)                            of everything before it
+//
+// settings packs the algorithm (bits 0-1), digits - 6 (bits 2-3) and
+// log2(period / 15) (bits 4-5). length counts the token records: up to
+// MAX_TOKENS of 4 + 32 + 255 bytes, more than 2 bytes hold. There are no
+// pointers or scratch fields, so a store takes ceil((11 + records) / 256)
+// keys.
+#define P_STORE_START     100
+#define STORE_VERSION     2
+
+// Changes between saves are appended to a journal, so editing one token
+// writes one small chunk rather than the whole store. Journal chunks go under
+// consecutive keys from P_JOURNAL_START, each
+//
+//   'j' entry... crc32(4)
+//
+// where an entry is one of
+//
+//   'P' id settings secret_length name_length name secret
+//                                       token added or changed
+//   'D' id                              token deleted
+//   'O' count id...                     tokens reordered
+//   'C'                                 tokens cleared
+//
+// Loading replays the journal over the store. Past STORE_JOURNAL_MAX_CHUNKS
+// it's compacted: the store is saved in full and the journal deleted. It's
+// also compacted whenever tokens were deleted or cleared, so that their
+// secrets are deleted rather than left in flash.
+#define P_JOURNAL_START   1000
+#define STORE_JOURNAL_MAX_CHUNKS 4
+
+// Loads the saved tokens into the (empty) token table. A store in the layout
+// of 1.2.0 and before - a key per token and another per secret - is migrated:
+// saved again in the packed format, then deleted. Returns false if there's no
+// store or it's corrupt, in which case the table is left empty.
+bool store_load(void);
+
+// Saves the token table, writing only the chunks whose bytes changed, and
+// deletes the journal.
+void store_save(void);
+
+// Record a change to the token table for the next store_flush.
+void store_token_changed(short id); // Added, updated or deleted
+void store_order_changed(void);
+void store_tokens_cleared(void);
+
+// Whether there are changes store_flush hasn't written.
+bool store_is_dirty(void);
+
+// CRC-32 (the zlib one) of data, continuing from crc; 0 to start.
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, int length);
+
+// Appends the recorded changes to the journal as one batch - a token changed
+// several times is written once - compacting it if it's grown too long or
+// tokens were deleted.
+void store_flush(void);
+
+#endif
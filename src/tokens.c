@@ -0,0 +1,335 @@
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <limits.h>
+
+#include "tokens.h"
+
+// Smallest arena we allocate, enough for a handful of SHA1 tokens.
+#define ARENA_MIN_SIZE    512
+
+// Token data is kept 8 byte aligned for the SHA512 midstates.
+#define ARENA_ALIGN(n)    (((n) + 7) & ~7)
+
+// The arena: token_count TokenInfo records from the start, data_used bytes of
+// token data at the end.
+static uint8_t* token_arena = NULL;
+static size_t arena_size = 0;
+static size_t data_used = 0;
+static short token_count = 0;
+
+#define token_table ((TokenInfo*)token_arena)
+
+// Position in token_table by token ID.
+static uint8_t token_slots[256];
+static bool token_slots_ready = false;
+
+bool key_list_is_dirty = false;
+
+static uint8_t* token_data(const TokenInfo* key) {
+  return token_arena + arena_size - key->data_offset;
+}
+
+// strnlen(name, MAX_NAME_LENGTH), which the SDK's libc doesn't have.
+static size_t name_length_of(const char* name) {
+  size_t length = 0;
+  while (length < MAX_NAME_LENGTH && name[length]) {
+    length++;
+  }
+  return length;
+}
+
+static size_t token_data_size(uint8_t algorithm, uint8_t secret_length, size_t name_length) {
+  return ARENA_ALIGN(hmac_key_size(algorithm) + secret_length + name_length + 1);
+}
+
+// Makes sure the free run in the middle of the arena has at least bytes in
+// it, moving everything to a bigger block if not. The old block is wiped
+// before it's freed, since it holds secrets.
+static bool arena_reserve(size_t bytes) {
+  if (data_used + bytes > UINT16_MAX) {
+    return false; // data_offset would overflow, room or not.
+  }
+  size_t records = token_count * sizeof(TokenInfo);
+  if (arena_size - records - data_used >= bytes) {
+    return true;
+  }
+  size_t size = arena_size + arena_size / 2;
+  if (size < records + data_used + bytes) {
+    size = records + data_used + bytes;
+  }
+  size = ARENA_ALIGN(size < ARENA_MIN_SIZE ? ARENA_MIN_SIZE : size);
+  uint8_t* arena = malloc(size);
+  if (!arena) {
+    return false;
+  }
+  if (token_arena) {
+    memcpy(arena, token_arena, records);
+    memcpy(arena + size - data_used, token_arena + arena_size - data_used, data_used);
+    memset(token_arena, 0, arena_size);
+    free(token_arena);
+  }
+  token_arena = arena;
+  arena_size = size;
+  return true;
+}
+
+// Takes size bytes of token data from the free run; arena_reserve() first.
+static uint16_t data_alloc(size_t size) {
+  data_used += size;
+  memset(token_arena + arena_size - data_used, 0, size);
+  return data_used;
+}
+
+// Returns a token's data to the free run by sliding the data below it up
+// over the gap, and wipes what's left behind.
+static void data_free(uint16_t offset, uint16_t size) {
+  uint8_t* low = token_arena + arena_size - data_used;
+  memmove(low + size, low, data_used - offset);
+  memset(low, 0, size);
+  data_used -= size;
+  for (short i = 0; i < token_count; ++i) {
+    if (token_table[i].data_offset > offset) {
+      token_table[i].data_offset -= size;
+    }
+  }
+}
+
+void token_sanitize(TokenInfo* key) {
+  if (key->algorithm > HMAC_SHA512) {
+    key->algorithm = HMAC_SHA1;
+  }
+  if (key->digits < MIN_CODE_DIGITS || key->digits > MAX_CODE_DIGITS) {
+    key->digits = DEFAULT_DIGITS;
+  }
+  if (key->period != 15 && key->period != 30 && key->period != 60) {
+    key->period = DEFAULT_PERIOD;
+  }
+}
+
+TokenInfo* token_list_add(const TokenInfo* info, const char* name) {
+  if (!token_slots_ready) {
+    memset(token_slots, TOKEN_SLOT_NONE, sizeof(token_slots));
+    token_slots_ready = true;
+  }
+  if (info->id < 0 || info->id >= 256) {
+    return NULL;
+  }
+
+  TokenInfo* existing = token_by_id(info->id);
+  if (!existing && token_count == MAX_TOKENS) {
+    return NULL;
+  }
+
+  size_t name_length = name_length_of(name);
+  size_t size = token_data_size(info->algorithm, info->secret_length, name_length);
+  if (!arena_reserve(size + (existing ? 0 : sizeof(TokenInfo)))) {
+    return NULL;
+  }
+
+  TokenInfo* key;
+  if (existing) {
+    key = token_by_id(info->id); // The arena may have moved.
+  } else {
+    key = &token_table[token_count];
+    token_slots[info->id] = token_count++;
+  }
+  uint16_t old_offset = existing ? key->data_offset : 0;
+  uint16_t old_size = existing ? key->data_size : 0;
+
+  memset(key, 0, sizeof(TokenInfo));
+  key->id = info->id;
+  key->secret_length = info->secret_length;
+  key->algorithm = info->algorithm;
+  key->digits = info->digits;
+  key->period = info->period;
+  key->data_size = size;
+  key->data_offset = data_alloc(size);
+  memcpy((char*)token_name(key), name, name_length);
+
+  if (existing) {
+    data_free(old_offset, old_size);
+  }
+  key_list_is_dirty = true;
+  return key;
+}
+
+void token_prepare_key(TokenInfo* key) {
+  hmac_prepare(key->algorithm, (HMAC_KEY*)token_hmac_key(key), token_secret(key), key->secret_length);
+  // Never real steps, so the next refresh generates a code.
+  key->step = ULONG_MAX;
+  key->next_step = ULONG_MAX;
+  key->front = 0;
+}
+
+unsigned long token_step(const TokenInfo* key, unsigned long base_step) {
+  // log2(period / BASE_PERIOD)
+  return base_step >> (key->period == 15 ? 0 : key->period == 30 ? 1 : 2);
+}
+
+static void token_generate(TokenInfo* key, unsigned long step, char* out) {
+  unsigned int code = generateCodeWithKey(key->algorithm, token_hmac_key(key), step, key->digits);
+  formatCode(code, key->digits, out);
+}
+
+const char* token_code(TokenInfo* key, unsigned long base_step) {
+  unsigned long step = token_step(key, base_step);
+  if (step != key->step) {
+    if (step == key->next_step) {
+      key->front = !key->front;
+    } else {
+      // Not looked ahead (new token, clock change, scrolled into view) or skipped over.
+      token_generate(key, step, key->code[key->front]);
+    }
+    key->step = step;
+  }
+  return key->code[key->front];
+}
+
+bool token_lookahead(TokenInfo* key, unsigned long base_step) {
+  unsigned long next_step = token_step(key, base_step) + 1;
+  if (key->next_step == next_step) {
+    return false;
+  }
+  token_generate(key, next_step, key->code[!key->front]);
+  key->next_step = next_step;
+  return true;
+}
+
+const HMAC_KEY* token_hmac_key(const TokenInfo* key) {
+  return (const HMAC_KEY*)token_data(key);
+}
+
+uint8_t* token_secret(const TokenInfo* key) {
+  return token_data(key) + hmac_key_size(key->algorithm);
+}
+
+const char* token_name(const TokenInfo* key) {
+  return (const char*)token_secret(key) + key->secret_length;
+}
+
+bool token_set_name(short id, const char* name) {
+  TokenInfo* key = token_by_id(id);
+  if (!key) {
+    return false;
+  }
+  size_t name_length = name_length_of(name);
+  size_t size = token_data_size(key->algorithm, key->secret_length, name_length);
+  if (!arena_reserve(size)) {
+    return false;
+  }
+
+  // Copy the midstates and secret into fresh data with the new name, then
+  // drop the old data.
+  key = token_by_id(id);
+  uint16_t old_offset = key->data_offset;
+  uint16_t old_size = key->data_size;
+  uint16_t offset = data_alloc(size);
+  size_t kept = hmac_key_size(key->algorithm) + key->secret_length;
+  memcpy(token_arena + arena_size - offset, token_data(key), kept);
+  memcpy(token_arena + arena_size - offset + kept, name, name_length);
+  key->data_offset = offset;
+  key->data_size = size;
+  data_free(old_offset, old_size);
+  key_list_is_dirty = true;
+  return true;
+}
+
+TokenInfo* token_by_list_index(int index) {
+  return &token_table[index];
+}
+
+TokenInfo* token_by_id(short id) {
+  if (!token_slots_ready || id < 0 || id >= 256 || token_slots[id] == TOKEN_SLOT_NONE) {
+    return NULL;
+  }
+  return &token_table[token_slots[id]];
+}
+
+short token_list_length(void) {
+  return token_count;
+}
+
+bool token_changed_since(const TokenInfo* key, uint32_t after) {
+  return !after || key->generation > after;
+}
+
+bool token_list_delete(short id) {
+  TokenInfo* key = token_by_id(id);
+  if (!key) {
+    return false;
+  }
+  short slot = token_slots[id];
+  token_slots[id] = TOKEN_SLOT_NONE;
+  uint16_t offset = key->data_offset;
+  uint16_t size = key->data_size;
+
+  // Close the gap in the records, keeping the display order, then in the data.
+  token_count--;
+  memmove(&token_table[slot], &token_table[slot + 1], (token_count - slot) * sizeof(TokenInfo));
+  memset(&token_table[token_count], 0, sizeof(TokenInfo));
+  for (short i = slot; i < token_count; ++i) {
+    token_slots[token_table[i].id] = i;
+  }
+  data_free(offset, size);
+  key_list_is_dirty = true;
+  return true;
+}
+
+void token_list_clear(void) {
+  for (short i = 0; i < token_count; ++i) {
+    token_slots[token_table[i].id] = TOKEN_SLOT_NONE;
+  }
+  if (token_arena) {
+    memset(token_arena, 0, arena_size);
+    free(token_arena);
+  }
+  token_arena = NULL;
+  arena_size = 0;
+  data_used = 0;
+  token_count = 0;
+  key_list_is_dirty = true;
+}
+
+void token_list_reorder(const uint8_t* ids, int count) {
+  // Swap each named token into the next position. Every swap keeps token_slots
+  // consistent, so a token already placed is never found again by a later ID.
+  // Only the records move; their data stays where it is.
+  short next = 0;
+  for (int i = 0; i < count && next < token_count; ++i) {
+    TokenInfo* key = token_by_id(ids[i]);
+    if (!key) {
+      continue;
+    }
+    short slot = token_slots[ids[i]];
+    if (slot < next) {
+      continue; // Repeated ID
+    }
+    if (slot != next) {
+      TokenInfo temp = token_table[next];
+      token_table[next] = *key;
+      token_table[slot] = temp;
+      token_slots[token_table[next].id] = next;
+      token_slots[token_table[slot].id] = slot;
+    }
+    next++;
+  }
+  key_list_is_dirty = true;
+}
+
+size_t token_arena_size(void) {
+  return arena_size;
+}
+
+size_t token_arena_used(void) {
+  return token_count * sizeof(TokenInfo) + data_used;
+}
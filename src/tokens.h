@@ -0,0 +1,122 @@
+// The token table: every token's settings, secret and cached HMAC midstates,
+// in display order.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _TOKENS_H_
+#define _TOKENS_H_
+
+#include "pebble.h"
+
+#include "generate.h"
+#include "hmac.h"
+
+#define MAX_NAME_LENGTH   32
+
+#define DEFAULT_DIGITS    6
+#define DEFAULT_PERIOD    30
+
+// Every period is this times a power of two, so a token's step is the base
+// step - time / BASE_PERIOD - shifted down.
+#define BASE_PERIOD       15
+
+// Token IDs are allocated by the phone from 0-255 and index token_slots, a
+// byte per ID, in which TOKEN_SLOT_NONE marks an unused ID - so one fewer
+// token than there are IDs.
+#define MAX_TOKENS        255
+#define TOKEN_SLOT_NONE   0xFF
+
+// Everything lives in one heap block, the arena: the TokenInfo records from
+// its start, and from its end each token's variable-length data - midstates,
+// secret and name, in that order. Deleting a token closes both gaps, so the
+// free space is always the single run in the middle and the arena is only
+// reallocated when that runs out.
+typedef struct TokenInfo {
+  short id;
+  uint8_t secret_length; // Since persistence is limited to this size anyways.
+  uint8_t algorithm; // HMACAlgorithm
+  uint8_t digits;
+  uint8_t period; // Seconds
+  uint16_t data_offset; // Of this token's data, counted back from the end of the arena
+  uint16_t data_size;
+  // The cached code, code[front], for step, and the look-ahead code[!front]
+  // for next_step. See token_code().
+  char code[2][MAX_CODE_DIGITS + 1];
+  uint8_t front;
+  unsigned long step;
+  unsigned long next_step;
+  uint32_t generation; // Of its last change since the app started, else 0; see pTOTP.c
+} TokenInfo;
+
+// Set whenever tokens are added, removed, renamed or moved.
+extern bool key_list_is_dirty;
+
+// Drops anything the phone or an older store sent that we can't generate.
+void token_sanitize(TokenInfo* key);
+
+// Adds a token with the settings (id, secret_length, algorithm, digits,
+// period) in info, at the end of the table or in place of the token with the
+// same ID. Its secret is left zeroed for the caller to fill in through
+// token_secret() before calling token_prepare_key(). Returns NULL if the table
+// is full, the ID is out of range or there's no memory for it.
+//
+// This and everything else that adds, deletes, renames or moves tokens may
+// move them in memory, so TokenInfo pointers and the pointers below are only
+// valid until the next such call.
+TokenInfo* token_list_add(const TokenInfo* info, const char* name);
+
+// Derives the midstates from the secret and marks the codes as not generated yet.
+void token_prepare_key(TokenInfo* key);
+
+// The token's step at a base step.
+unsigned long token_step(const TokenInfo* key, unsigned long base_step);
+
+// The token's code at a base step. Codes are only generated when asked for -
+// for the rows on screen, not the whole table - and cached until the step
+// changes, when the look-ahead code takes over if it's there.
+const char* token_code(TokenInfo* key, unsigned long base_step);
+
+// Generates the code for the step after base step's ahead of time, unless it
+// already has been. Returns whether it had to.
+bool token_lookahead(TokenInfo* key, unsigned long base_step);
+
+const char* token_name(const TokenInfo* key);
+uint8_t* token_secret(const TokenInfo* key);
+const HMAC_KEY* token_hmac_key(const TokenInfo* key);
+
+// False if there's no such ID or no memory for the longer name.
+bool token_set_name(short id, const char* name);
+
+TokenInfo* token_by_list_index(int index);
+TokenInfo* token_by_id(short id);
+short token_list_length(void);
+
+// Removes the token, wiping its secret and midstates. False if there's no such ID.
+bool token_list_delete(short id);
+void token_list_clear(void);
+
+// Moves the tokens with the given IDs to the front in that order, in place.
+// IDs that don't exist (or repeat) are skipped; tokens not mentioned end up
+// after those that are, in no particular order.
+void token_list_reorder(const uint8_t* ids, int count);
+
+// Whether a readback of the tokens changed after generation after sends
+// this one: every token for a full readback, where after is 0, since tokens
+// loaded from storage have generation 0.
+bool token_changed_since(const TokenInfo* key, uint32_t after);
+
+// Bytes the arena has allocated, and of those in use.
+size_t token_arena_size(void);
+size_t token_arena_used(void);
+
+#endif
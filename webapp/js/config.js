@@ -9,6 +9,9 @@ var TokenByID = function(id) {
     }
 };
 
+// Indices match HMACAlgorithm on the watch.
+var Algorithms = ["SHA1", "SHA256", "SHA512"];
+
 var NextTokenID = function(){
     for (var id = 0; id < 256; id++) {
         if (!TokenByID(id) && BlockedIDs.indexOf(id) < 0) return id;
@@ -55,6 +58,9 @@ $(document).ready(function(e) {
 
     $("#token-new").on("pagebeforeshow", function(){
         $("#token-new input[type='text']").val("");
+        $("#new-token-algorithm").val("0").selectmenu("refresh");
+        $("#new-token-digits").val("6").selectmenu("refresh");
+        $("#new-token-period").val("30").selectmenu("refresh");
     });
 
     $("#config-save-btn").bind("click", ConfigurationSave).hide();
@@ -137,7 +143,10 @@ var TokenCreated = function(e){
     var token = {
         "ID": NextTokenID(),
         "Name": $("#new-token-name").val(),
-        "Secret": base64_secret
+        "Secret": base64_secret,
+        "Algorithm": parseInt($("#new-token-algorithm").val(), 10),
+        "Digits": parseInt($("#new-token-digits").val(), 10),
+        "Period": parseInt($("#new-token-period").val(), 10)
     };
     if (!token.Name || !token.Secret) {
         alert("You must enter a name and key for the new token");
@@ -218,6 +227,12 @@ var HandleFileSelect = function(evt) {
            try{
                secret = data.match(/^otpauth\:\/\/.*\?.*secret\=([0-9a-z]{32}|[0-9a-z]{16})/i)[1];
                $tokenInput.val(secret);
+               var algorithm = data.match(/[?&]algorithm=(SHA1|SHA256|SHA512)(&|$)/i);
+               $("#new-token-algorithm").val(algorithm ? Algorithms.indexOf(algorithm[1].toUpperCase()) : 0).selectmenu("refresh");
+               var digits = data.match(/[?&]digits=([678])(&|$)/i);
+               $("#new-token-digits").val(digits ? digits[1] : "6").selectmenu("refresh");
+               var period = data.match(/[?&]period=(15|30|60)(&|$)/i);
+               $("#new-token-period").val(period ? period[1] : "30").selectmenu("refresh");
            }
            catch(e){
                $tokenInput.attr('placeholder', placeholderVal);